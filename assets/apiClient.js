@@ -169,15 +169,13 @@ class ApiClient {
             path += "/";
         }
 
-        let response = await fetch(baseURL + "/fs" + path + "?fmt=json");
+        // sorting and filtering is done server-side
+        let response = await fetch(baseURL + "/fs" + path + "?fmt=json&sort=name&dirsfirst=1&exclude=" +
+            encodeURIComponent(ignoredFileNames.join(",")));
         if (!response.ok) {
             return { status: response.status, data: null };
         }
         let data = await response.json();
-        data = data.filter(entry => !ignoredFileNames.includes(entry.name));
-        data.sort((x, y) => (DirectoryListing.isDir(x) == DirectoryListing.isDir(y)) ?
-            x.name.localeCompare(y.name) :
-            y.mode.localeCompare(x.mode));
 
         const resultData = data.map(entry => new DirectoryListing(entry.name, entry.mode, entry.mtime, entry.size));
         return { status: response.status, data: resultData };
@@ -340,6 +338,62 @@ class ApiClient {
         return await response.json();
     }
 
+    /** @typedef {Object} HomebrewIndexEntry
+     * @property {string} dir
+     * @property {string} exec
+     * @property {string} path
+     * @property {boolean} homebrew_js
+     * @property {string?} icon
+     * @property {string?} icon_etag
+     */
+
+    /**
+     * @returns {Promise<APIResponse<HomebrewIndexEntry[]?>>}
+     */
+    static async getHomebrewIndex() {
+        let response = await fetch(baseURL + "/homebrew/index");
+        if (!response.ok) {
+            return { status: response.status, data: null };
+        }
+        return { status: response.status, data: await response.json() };
+    }
+
+    /**
+     * Fetch several icons in a single request.
+     * @param {string[]} paths
+     * @returns {Promise<Map<string, Blob?>?>} icons by path, null if unavailable
+     */
+    static async getHomebrewIcons(paths) {
+        if (paths.length === 0) {
+            return new Map();
+        }
+
+        let query = paths.map(path => "path=" + encodeURIComponent(path)).join("&");
+        try {
+            let response = await fetch(baseURL + "/homebrew/icons?" + query);
+            if (!response.ok) {
+                return null;
+            }
+
+            // the blob starts with the number of icons, followed by the offset
+            // and size of each icon (little-endian 32-bit integers). A short
+            // blob makes getUint32() throw, which is treated as unavailable.
+            let blob = await response.arrayBuffer();
+            let view = new DataView(blob);
+            let count = Math.min(view.getUint32(0, true), paths.length);
+            let result = new Map();
+            for (let i = 0; i < count; i++) {
+                let offset = view.getUint32(4 + 8 * i, true);
+                let size = view.getUint32(8 + 8 * i, true);
+                result.set(paths[i], size ? new Blob([blob.slice(offset, offset + size)], { type: "image/png" }) : null);
+            }
+
+            return result;
+        } catch (error) {
+            return null;
+        }
+    }
+
     static async getVersion() {
         try {
             const response = await fetch(baseURL + '/version');
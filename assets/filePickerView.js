@@ -408,6 +408,51 @@ async function renderBrowsePageForPath(path, rootPath, fadein = false, fadeout =
     return renderBrowsePage_internal(categories, fadein, fadeout, title);
 }
 
+/** @type {EventSource?} */
+let mdnsEventSource = null;
+
+/**
+ * Stop listening for mdns events, e.g. once the storage device picker is left.
+ */
+function closeMdnsEvents() {
+    if (mdnsEventSource) {
+        mdnsEventSource.close();
+        mdnsEventSource = null;
+    }
+}
+
+/**
+ * Listen for SMB shares that are discovered, changed or lost while the picker is shown.
+ * @param {Map<string, string>} knownLocations address:port of the listed shares, by domain
+ * @returns {Promise<{path: string, finished: boolean}>} resolves with a refresh of the picker
+ */
+function waitForMdnsChange(knownLocations) {
+    closeMdnsEvents();
+    return new Promise((resolve) => {
+        const events = new EventSource(baseURL + "/mdns/events");
+        mdnsEventSource = events;
+
+        const refresh = () => {
+            closeMdnsEvents();
+            resolve({ path: "", finished: false });
+        };
+
+        // services that are already known are sent first, so only differences trigger a refresh
+        events.addEventListener("add", (e) => {
+            const location = JSON.parse(e.data);
+            if (location.protocol.startsWith("_smb.") &&
+                knownLocations.get(location.domain) !== `${location.address}:${location.port}`) {
+                refresh();
+            }
+        });
+        events.addEventListener("remove", (e) => {
+            if (knownLocations.has(e.data)) {
+                refresh();
+            }
+        });
+    });
+}
+
 async function renderStorageDevicePicker(fadein = false, fadeout = false, title = 'Select Storage Device...', allowNetworkLocations = false, pathType = 'file') {
     /** @type {BrowsePageCategory[]} */
     let categories = [];
@@ -472,6 +517,9 @@ async function renderStorageDevicePicker(fadein = false, fadeout = false, title
             items: []
         };
 
+        /** @type {Map<string, string>} */
+        const knownLocations = new Map();
+
         const savedNetworkLocations = getSavedNetworkLocations();
         for (let i = 0; i < savedNetworkLocations.length; i++) {
             const location = savedNetworkLocations[i];
@@ -509,9 +557,12 @@ async function renderStorageDevicePicker(fadein = false, fadeout = false, title
             });
         }
 
-        const discoveredLocations = await ApiClient.getMdnsDiscoveredLocations();
+        // only SMB shares can be browsed, other service types are listed by /mdns for other clients
+        const discoveredLocations = (await ApiClient.getMdnsDiscoveredLocations())
+            .filter(location => location.protocol.startsWith("_smb."));
         for (let i = 0; i < discoveredLocations.length; i++) {
             const location = discoveredLocations[i];
+            knownLocations.set(location.domain, `${location.address}:${location.port}`);
             networkLocationsCategory.items.push({
                 primaryText: `${location.hostname} (${location.address})`,
                 secondaryText: protocolToFriendlyName(location.protocol),
@@ -541,6 +592,12 @@ async function renderStorageDevicePicker(fadein = false, fadeout = false, title
         };
         networkLocationsCategory.items.push(addNetworkLocationButton);
         categories.push(networkLocationsCategory);
+
+        // keep the discovered shares up to date while the picker is shown
+        return Promise.race([
+            renderBrowsePage_internal(categories, fadein, fadeout, title),
+            waitForMdnsChange(knownLocations)
+        ]);
     }
 
 
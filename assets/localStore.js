@@ -16,14 +16,6 @@ along with this program; see the file COPYING. If not, see
 
 
 // @ts-check
-const HOMEBREW_AUTO_SCAN_PATHS = ["/data/homebrew/", "/mnt/usb0/homebrew/",
-				  "/mnt/usb1/homebrew/", "/mnt/usb2/homebrew/",
-				  "/mnt/usb3/homebrew/", "/mnt/usb4/homebrew/",
-				  "/mnt/usb5/homebrew/", "/mnt/usb6/homebrew/",
-				  "/mnt/ext0/homebrew/", "/mnt/ext1/homebrew/"];
-// order of this matters, if both homebrew.js and eboot.elf exist, homebrew.js will be used
-const HOMEBREW_AUTO_SCAN_ALLOWED_EXEC_NAMES = [ "homebrew.js", "eboot.elf" ];
-
 const LOCALSTORE_HOMEBREW_LIST_KEY = "LOCALSTORE_HOMEBREW_LIST";
 const LOCALSTORE_NETWORK_LOCATIONS_KEY = "LOCALSTORE_NETWORK_LOCATIONS";
 
@@ -130,49 +122,16 @@ function getHomebrewList() {
 // 	});
 // }
 
+// the auto-scan folders are indexed server-side, see src/homebrew.c
 async function scanHomebrews() {
-    let jobs = [];
-    for (let path of HOMEBREW_AUTO_SCAN_PATHS) {
-        jobs.push((async () => {
-            let autoScanParentDirEntryList = await ApiClient.fsListDir(path);
-            if (autoScanParentDirEntryList.data === null) {
-                return;
-            }
-
-            let subjobs = [];
-
-            for (let entry of autoScanParentDirEntryList.data) {
-                subjobs.push((async () => {
-                    let hbDirEntries = await ApiClient.fsListDir(path + entry.name);
-                    if (hbDirEntries.data === null) {
-                        return;
-                    }
-
-                    let foundExecutableName = null;
-                    for (let hbDirEntry of hbDirEntries.data) {
-                        for (let allowedName of HOMEBREW_AUTO_SCAN_ALLOWED_EXEC_NAMES) {
-                            if (hbDirEntry.name === allowedName) {
-                                foundExecutableName = allowedName;
-                                break;
-                            }
-                        }
-
-                        if (foundExecutableName) {
-                            break;
-                        }
-                    }
-
-                    if (foundExecutableName) {
-                        addToHomebrewStore(path + entry.name + "/" + foundExecutableName);
-                    }
-                })());
-            }
-
-            await Promise.all(subjobs);
-        })());
+    let index = await ApiClient.getHomebrewIndex();
+    if (index.data === null) {
+        return;
     }
 
-    await Promise.all(jobs);
+    for (let entry of index.data) {
+        addToHomebrewStore(entry.path);
+    }
 }
 
 
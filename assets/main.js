@@ -17,11 +17,19 @@ along with this program; see the file COPYING. If not, see
 
 // @ts-check
 
+/** @type {string[]} */
+let homebrewIconUrls = [];
+
 async function renderHomePage() {
 	await scanHomebrews();
 	let items = getHomebrewList();
 	items.sort((a, b) => a.dir.split('/').pop().localeCompare(b.dir.split('/').pop()));
 
+	// fetch all icons in one request, and fall back to one request per icon
+	homebrewIconUrls.forEach(url => URL.revokeObjectURL(url));
+	homebrewIconUrls = [];
+	let icons = await ApiClient.getHomebrewIcons([...new Set(items.map(item => item.dir + "/sce_sys/icon0.png"))]);
+
 	// remove previous extension sandboxes
 	let oldsandbox = document.getElementById("js-extension-sandbox");
 	if (oldsandbox) {
@@ -35,10 +43,18 @@ async function renderHomePage() {
 		 * @returns {CarouselItem[]} 
 		 */
 		(acc, item) => {
+			let imgPath = baseURL + "/fs" + item.dir + "/sce_sys/icon0.png";
+			// icons that are missing from the batch (size 0) are requested on their own
+			let icon = icons ? icons.get(item.dir + "/sce_sys/icon0.png") : null;
+			if (icon && icon.size > 0) {
+				imgPath = URL.createObjectURL(icon);
+				homebrewIconUrls.push(imgPath);
+			}
+
 			let newItem = {
 				mainText: item.filename,
 				secondaryText: item.dir,
-				imgPath: baseURL + "/fs" + item.dir + "/sce_sys/icon0.png"
+				imgPath: imgPath
 			}
 			if (item.filename.endsWith(".js")) {
 				newItem.asyncInfo = async () => {
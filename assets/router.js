@@ -393,6 +393,7 @@ class Router {
             }
 
             await backButtonPressPromise.cancel();
+            closeMdnsEvents();
 
             if (newPath === null) { // user pressed back
                 if (lastPath.path === "") { // exit
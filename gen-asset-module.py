@@ -17,45 +17,148 @@
 # <http://www.gnu.org/licenses/>.
 
 import argparse
-import string
+import gzip
+import hashlib
 import mimetypes
+import os
+import string
+import sys
+
+try:
+    import brotli
+except ImportError:
+    brotli = None
 
 
 tmpl = string.Template('''
-void asset_register(const char*, void*, unsigned long, const char*);
+#include "asset.h"
+
+$data
+
+const asset_t g_asset_table[] = {
+$table
+};
 
-static unsigned char data[] = $data;
+const int16_t g_asset_index[] = {
+$index
+};
 
-__attribute__((constructor)) static void
-constructor(void) {
-  asset_register("/$path", data, sizeof(data), "$mime");
-}
+const uint32_t g_asset_seed = $seed;
+const uint32_t g_asset_mask = $mask;
 ''')
 
 
-def gen_data(filename):
+def asset_hash(path, seed):
+    '''
+    FNV-1a, must match the hash computed by asset_normalize_path() in
+    src/asset.c.
+    '''
+    h = 2166136261 ^ seed
+    for b in path.encode():
+        h ^= b
+        h = (h * 16777619) & 0xffffffff
+    return h
+
+
+def gen_index(paths):
+    '''
+    Find a seed for which every path hashes to a distinct slot, i.e.,
+    a perfect hash that needs a single string compare per lookup.
+    '''
+    size = 1
+    while size < 2 * len(paths):
+        size *= 2
+
+    while True:
+        for seed in range(0x10000):
+            slots = [-1] * size
+            for i, path in enumerate(paths):
+                slot = asset_hash(path, seed) & (size - 1)
+                if slots[slot] != -1:
+                    break
+                slots[slot] = i
+            else:
+                return seed, size - 1, slots
+        size *= 2
+
+
+def gen_data(data):
     yield '{\n  '
 
-    with open(filename, mode='rb') as f:
-        for n, b in enumerate(f.read(), 1):
-            yield hex(b)
-            yield ', '
+    for n, b in enumerate(data, 1):
+        yield hex(b)
+        yield ', '
 
-            if n % 16 == 0:
-                yield '\n  '
+        if n % 16 == 0:
+            yield '\n  '
 
     yield '\n}'
 
+
+def gen_encodings(data):
+    '''
+    Precompress an asset. Encodings that do not make the asset smaller
+    are omitted.
+    '''
+    encodings = {}
+
+    if brotli is not None:
+        encodings['br'] = brotli.compress(data, quality=11)
+    encodings['gzip'] = gzip.compress(data, compresslevel=9, mtime=0)
+
+    return {k: v for k, v in encodings.items() if len(v) < len(data)}
+
+
 if __name__ == '__main__':
     parser = argparse.ArgumentParser()
-    parser.add_argument('-p', '--path', default=None)
-    parser.add_argument('FILE')
+    parser.add_argument('-r', '--root', default='.')
+    parser.add_argument('FILE', nargs='+')
     args = parser.parse_args()
 
-    if args.path is None:
-        args.path = args.FILE
+    paths = ['/' + os.path.relpath(f, args.root) for f in args.FILE]
+
+    data = []
+    table = []
+    total = {'identity': 0, 'gzip': 0, 'br': 0}
+    for i, (filename, path) in enumerate(zip(args.FILE, paths)):
+        mime = mimetypes.guess_type(path)[0]
+        mime = '"%s"' % mime if mime else '0'
+
+        with open(filename, mode='rb') as f:
+            raw = f.read()
+        encodings = gen_encodings(raw)
+
+        data.append('static unsigned char data_%d[] = %s;'
+                    % (i, ''.join(gen_data(raw))))
+        variants = ['data_%d, sizeof(data_%d)' % (i, i)]
+        for enc in ('gzip', 'br'):
+            if enc in encodings:
+                data.append('static unsigned char data_%d_%s[] = %s;'
+                            % (i, enc, ''.join(gen_data(encodings[enc]))))
+                variants.append('data_%d_%s, sizeof(data_%d_%s)'
+                                % (i, enc, i, enc))
+            else:
+                variants.append('0, 0')
+        etag = hashlib.sha256(raw).hexdigest()[:16]
+        table.append('  {"%s", %s, "%s", %s},'
+                     % (path, mime, etag, ', '.join(variants)))
+
+        total['identity'] += len(raw)
+        for enc in ('gzip', 'br'):
+            total[enc] += len(encodings.get(enc, raw))
+
+    for enc in ('gzip', 'br'):
+        if enc == 'br' and brotli is None:
+            print('%s: brotli module not found, skipping br encoding'
+                  % parser.prog, file=sys.stderr)
+            continue
+        print('%s: %d assets, %d bytes, %d bytes with %s (%.1f%% saved)'
+              % (parser.prog, len(paths), total['identity'], total[enc], enc,
+                 100.0 * (1 - total[enc] / total['identity'])),
+              file=sys.stderr)
 
-    data = ''.join(gen_data(args.FILE))
-    print(tmpl.substitute(data=data, path=args.path,
-                          mime=mimetypes.guess_type(args.path)[0]))
+    seed, mask, slots = gen_index(paths)
+    index = ['  %d,' % slot for slot in slots]
 
+    print(tmpl.substitute(data='\n\n'.join(data), table='\n'.join(table),
+                          index='\n'.join(index), seed=seed, mask=mask))
@@ -0,0 +1,119 @@
+/* Copyright (C) 2026 John Törnblom
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation; either version 3, or (at your option) any
+later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; see the file COPYING. If not, see
+<http://www.gnu.org/licenses/>.  */
+
+/**
+ * Asset lookup microbenchmark. Looks up every embedded asset (hits), and a
+ * set of urls that browsers and crawlers commonly ask for but that are not
+ * embedded (404 misses), and reports the rate of each. The lookup function
+ * is static, so asset.c is compiled into this program rather than linked.
+ **/
+
+#include <time.h>
+
+#include "asset.c"
+
+
+/**
+ * Number of lookups per measurement.
+ **/
+#ifndef BENCH_LOOKUPS
+#define BENCH_LOOKUPS 10000000
+#endif
+
+
+/**
+ * Urls that are not embedded, e.g., probes for well-known files.
+ **/
+static const char* g_misses[] = {
+  "/favicon.ico",
+  "/robots.txt",
+  "/apple-touch-icon.png",
+  "/apple-touch-icon-precomposed.png",
+  "/index.htm",
+  "/wpad.dat",
+  "/.well-known/security.txt",
+  "/sitemap.xml",
+  "/manifest.json",
+  "/service-worker.js",
+  "/main.js.map",
+  "/assets/main.js",
+  "/MAIN.JS",
+  "/main.jsx",
+  "/index.html/",
+  "/this/path/is/rather/long/and/does/not/exist/anywhere.html",
+};
+
+
+static double
+bench_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/**
+ * Look up the given urls round-robin, and print the rate.
+ **/
+static void
+bench_run(const char* name, const char** urls, size_t nurls) {
+  size_t found = 0;
+  double t0, t1;
+
+  t0 = bench_now();
+  for(size_t i=0; i<BENCH_LOOKUPS; i++) {
+    found += asset_lookup(urls[i % nurls]) != 0;
+  }
+  t1 = bench_now();
+
+  printf("%-8s %2zu urls  %10.0f lookups/s  %6.1f ns/lookup  (%zu found)\n",
+	 name, nurls, BENCH_LOOKUPS / (t1 - t0), (t1 - t0) * 1e9 / BENCH_LOOKUPS,
+	 found);
+}
+
+
+int
+main(void) {
+  const char* hits[g_asset_mask + 1];
+  size_t empty = 0;
+  size_t nhits = 0;
+  char path[PATH_MAX];
+  uint32_t hash;
+
+  for(uint32_t i=0; i<=g_asset_mask; i++) {
+    if(g_asset_index[i] >= 0) {
+      hits[nhits++] = g_asset_table[g_asset_index[i]].path;
+    }
+  }
+
+  // misses that land on an empty slot never reach strcmp()
+  for(size_t i=0; i<sizeof(g_misses)/sizeof(g_misses[0]); i++) {
+    if(!asset_normalize_path(g_misses[i], path, &hash) &&
+       g_asset_index[hash & g_asset_mask] < 0) {
+      empty++;
+    }
+  }
+
+  printf("%zu assets, %u index slots, %zu of %zu misses hit an empty slot\n",
+	 nhits, g_asset_mask + 1, empty, sizeof(g_misses)/sizeof(g_misses[0]));
+
+  bench_run("hit", hits, nhits);
+  bench_run("miss", g_misses, sizeof(g_misses)/sizeof(g_misses[0]));
+
+  return 0;
+}
@@ -0,0 +1,56 @@
+#!/usr/bin/env python3
+#   Copyright (C) 2026 John Törnblom
+#
+# This file is free software; you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; see the file COPYING. If not see
+# <http://www.gnu.org/licenses/>.
+
+'''
+Populate a directory with a large number of entries for benchmarking
+directory listings. Every hundredth entry is a folder, and files are sparse
+with varying sizes, so listings with and without stat=0 differ in cost but
+not in disk usage.
+'''
+
+import argparse
+import os
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('path')
+    parser.add_argument('count', type=int, nargs='?', default=100000)
+    args = parser.parse_args()
+
+    os.makedirs(args.path, exist_ok=True)
+    if len(os.listdir(args.path)) == args.count:
+        return
+
+    for name in os.listdir(args.path):
+        path = os.path.join(args.path, name)
+        if os.path.isdir(path):
+            os.rmdir(path)
+        else:
+            os.unlink(path)
+
+    for i in range(args.count):
+        path = os.path.join(args.path, f'entry{i:06d}')
+        if i % 100 == 0:
+            os.mkdir(path)
+        else:
+            with open(path + '.bin', 'wb') as f:
+                f.truncate((i * 7919) % (1 << 20))
+
+
+if __name__ == '__main__':
+    main()
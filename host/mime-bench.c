@@ -0,0 +1,131 @@
+/* Copyright (C) 2026 John Törnblom
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation; either version 3, or (at your option) any
+later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; see the file COPYING. If not, see
+<http://www.gnu.org/licenses/>.  */
+
+/**
+ * Mime type lookup microbenchmark. Looks up a file name for every known
+ * extension (hits), the extensions that directory listings are made of in
+ * practice (common), and names with unknown or no extensions (misses), and
+ * reports the rate of each. The extension map is static, so mime.c is
+ * compiled into this program rather than linked.
+ **/
+
+#include <stdio.h>
+#include <time.h>
+
+#include "mime.c"
+
+
+/**
+ * Number of lookups per measurement.
+ **/
+#ifndef BENCH_LOOKUPS
+#define BENCH_LOOKUPS 10000000
+#endif
+
+
+/**
+ * File names with extensions that are common on a PS5.
+ **/
+static const char* g_common[] = {
+  "/data/homebrew/app/homebrew.js",
+  "/data/homebrew/app/sce_sys/nptitle.dat",
+  "/data/homebrew/app/sce_sys/icon0.png",
+  "/data/homebrew/app/sce_sys/param.json",
+  "/mnt/usb0/games/PPSA01234-app.pkg",
+  "/mnt/usb0/games/Game.ISO",
+  "/mnt/usb0/video/clip.mp4",
+  "/mnt/usb0/music/track01.mp3",
+  "/mnt/usb0/backup/savedata.tar.gz",
+  "/mnt/usb0/backup/savedata.zip",
+  "/user/data/index.html",
+  "/user/data/style.css",
+};
+
+
+/**
+ * File names with unknown or no extensions.
+ **/
+static const char* g_misses[] = {
+  "/system/common/lib/libkernel.sprx",
+  "/system/common/lib/libSceLibcInternal.sprx",
+  "/data/homebrew/app/eboot.elf",
+  "/data/homebrew/app/sce_sys/param.sfo",
+  "/user/home/10000000/savedata/data0000.bin0",
+  "/user/appmeta/PPSA01234/pronunciation.xml0",
+  "/mnt/usb0/games/PPSA01234-app.pkg.part",
+  "/mnt/usb0/backup/savedata.tar.gz.1",
+  "/data/README",
+  "/data/Makefile",
+  "/data/.bashrc",
+  "/data/some.folder/with.dots/no_extension",
+  "/data/file.this-extension-is-too-long",
+  "/data/file.",
+};
+
+
+static double
+bench_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/**
+ * Look up the given file names round-robin, and print the rate.
+ **/
+static void
+bench_run(const char* name, const char** names, size_t nnames) {
+  size_t found = 0;
+  double t0, t1;
+
+  t0 = bench_now();
+  for(size_t i=0; i<BENCH_LOOKUPS; i++) {
+    found += mime_get_type(names[i % nnames]) != 0;
+  }
+  t1 = bench_now();
+
+  printf("%-8s %4zu names  %10.0f lookups/s  %6.1f ns/lookup  (%zu found)\n",
+	 name, nnames, BENCH_LOOKUPS / (t1 - t0),
+	 (t1 - t0) * 1e9 / BENCH_LOOKUPS, found);
+}
+
+
+int
+main(void) {
+  static char buf[MIME_COUNT][MIME_EXT_MAX + 32];
+  const char* hits[MIME_COUNT];
+
+  // one upper case file name per known extension, in table order
+  for(size_t i=0; i<MIME_COUNT; i++) {
+    snprintf(buf[i], sizeof(buf[i]), "/data/file%zu.%s", i,
+	     g_ext2mime[i].ext);
+    for(char* p=strrchr(buf[i], '/'); *p; p++) {
+      *p = toupper((unsigned char)*p);
+    }
+    hits[i] = buf[i];
+  }
+
+  printf("%zu extensions\n", MIME_COUNT);
+
+  bench_run("hit", hits, MIME_COUNT);
+  bench_run("common", g_common, sizeof(g_common)/sizeof(g_common[0]));
+  bench_run("miss", g_misses, sizeof(g_misses)/sizeof(g_misses[0]));
+
+  return 0;
+}
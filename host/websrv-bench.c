@@ -0,0 +1,410 @@
+/* Copyright (C) 2026 John Törnblom
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation; either version 3, or (at your option) any
+later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; see the file COPYING. If not, see
+<http://www.gnu.org/licenses/>.  */
+
+/**
+ * Keep-alive load generator. Opens a number of connections to a web server,
+ * and issues GET requests on all of them for a while, one request in flight
+ * per connection. Reports the rate at which connections were established,
+ * the request rate, the body throughput, and the memory use of the server
+ * if its pid is given. With a request limit, e.g., a single GET of a large
+ * file, the run ends once that many responses have been received.
+ **/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+
+/**
+ * Size of the buffer responses are received into.
+ **/
+#define BENCH_BUF_SIZE 0x4000
+
+
+/**
+ * Size of the buffer that large bodies are discarded into.
+ **/
+#define BENCH_SINK_SIZE 0x100000
+
+
+/**
+ * State of a client connection.
+ **/
+typedef struct bench_conn {
+  int fd;
+  int connected;
+  size_t sent;
+  size_t len;
+  long body;
+  char buf[BENCH_BUF_SIZE];
+} bench_conn_t;
+
+
+/**
+ * Global state variables.
+ **/
+static char g_req[512];
+static size_t g_req_len;
+static unsigned long g_responses = 0;
+static unsigned long g_errors = 0;
+static unsigned long long g_bytes = 0;
+static char g_sink[BENCH_SINK_SIZE];
+
+
+static double
+bench_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/**
+ * Print the resident memory of a process, as reported by the kernel.
+ **/
+static void
+bench_print_rss(pid_t pid, const char* when) {
+  char path[64];
+  char line[256];
+  FILE* f;
+
+  snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+  if(!(f=fopen(path, "r"))) {
+    perror(path);
+    return;
+  }
+  while(fgets(line, sizeof(line), f)) {
+    if(!strncmp(line, "VmRSS:", 6) || !strncmp(line, "VmHWM:", 6) ||
+       !strncmp(line, "Threads:", 8)) {
+      printf("%-10s %s", when, line);
+    }
+  }
+  fclose(f);
+}
+
+
+/**
+ * Open a non-blocking connection, and watch it for writability.
+ **/
+static int
+bench_connect(int epfd, bench_conn_t* c, const struct sockaddr_in* addr) {
+  struct epoll_event ev;
+
+  if((c->fd=socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+    perror("socket");
+    return -1;
+  }
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+
+  if(connect(c->fd, (const struct sockaddr*)addr, sizeof(*addr)) &&
+     errno != EINPROGRESS) {
+    perror("connect");
+    close(c->fd);
+    return -1;
+  }
+
+  c->connected = 0;
+  c->sent = 0;
+  c->len = 0;
+  c->body = -1;
+
+  ev.events = EPOLLOUT;
+  ev.data.ptr = c;
+
+  return epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+
+/**
+ * Write as much of the request as the socket accepts.
+ **/
+static int
+bench_send(int epfd, bench_conn_t* c) {
+  struct epoll_event ev;
+  ssize_t n;
+
+  while(c->sent < g_req_len) {
+    if((n=write(c->fd, g_req + c->sent, g_req_len - c->sent)) < 0) {
+      return errno == EAGAIN ? 0 : -1;
+    }
+    c->sent += n;
+  }
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = c;
+
+  return epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+
+/**
+ * Receive a response, and send the next request once it is complete.
+ * Only responses with a Content-Length are understood. Once the headers
+ * have been parsed, the rest of the body is read into a shared buffer.
+ **/
+static int
+bench_recv(int epfd, bench_conn_t* c) {
+  struct epoll_event ev;
+  char* end;
+  char* p;
+  ssize_t n;
+
+  while(1) {
+    if(c->body > 0 && !c->len) {
+      if((n=read(c->fd, g_sink, (size_t)c->body < sizeof(g_sink) ? c->body :
+		 sizeof(g_sink))) < 0) {
+	return errno == EAGAIN ? 0 : -1;
+      }
+      if(!n) {
+	return -1;
+      }
+      g_bytes += n;
+      if((c->body -= n)) {
+	continue;
+      }
+      break;
+    }
+
+    if((n=read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len - 1)) < 0) {
+      return errno == EAGAIN ? 0 : -1;
+    }
+    if(!n) {
+      return -1;
+    }
+    c->len += n;
+    c->buf[c->len] = 0;
+
+    if(c->body < 0) {
+      if(!(end=strstr(c->buf, "\r\n\r\n"))) {
+	if(c->len == sizeof(c->buf) - 1) {
+	  return -1;
+	}
+	continue;
+      }
+      if(strncmp(c->buf, "HTTP/1.1 2", 10) &&
+	 strncmp(c->buf, "HTTP/1.1 3", 10)) {
+	g_errors++;
+      }
+      for(p=c->buf; p && strncasecmp(p, "\r\nContent-Length:", 17);
+	  p=strstr(p + 2, "\r\n"));
+      if(!p || p >= end) {
+	return -1;
+      }
+      c->body = strtol(p + 17, 0, 10);
+      end += 4;
+      c->len -= end - c->buf;
+      memmove(c->buf, end, c->len);
+    }
+
+    // the body is not kept
+    if((long)c->len < c->body) {
+      g_bytes += c->len;
+      c->body -= c->len;
+      c->len = 0;
+      continue;
+    }
+    if((long)c->len > c->body) {
+      return -1;
+    }
+    g_bytes += c->len;
+    break;
+  }
+
+  g_responses++;
+  c->len = 0;
+  c->body = -1;
+  c->sent = 0;
+
+  ev.events = EPOLLOUT;
+  ev.data.ptr = c;
+
+  return epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+
+int
+main(int argc, char** argv) {
+  struct epoll_event evs[256];
+  struct sockaddr_in addr;
+  struct rlimit rl;
+  unsigned long long start_bytes;
+  unsigned long start_responses;
+  unsigned long limit = 0;
+  unsigned long closed = 0;
+  unsigned int nconns = 1000;
+  unsigned int connected = 0;
+  double duration = 10;
+  const char* path = "/version";
+  bench_conn_t* conns;
+  bench_conn_t* c;
+  double t0, t1, t2;
+  pid_t pid = 0;
+  int epfd;
+  int opt;
+  int n;
+
+  while((opt=getopt(argc, argv, "c:d:n:p:P:")) != -1) {
+    switch(opt) {
+    case 'c':
+      nconns = atoi(optarg);
+      break;
+    case 'd':
+      duration = atof(optarg);
+      break;
+    case 'n':
+      limit = strtoul(optarg, 0, 10);
+      break;
+    case 'p':
+      path = optarg;
+      break;
+    case 'P':
+      pid = atoi(optarg);
+      break;
+    default:
+      goto usage;
+    }
+  }
+  if(optind + 2 != argc) {
+    goto usage;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(atoi(argv[optind+1]));
+  if(inet_pton(AF_INET, argv[optind], &addr.sin_addr) != 1) {
+    goto usage;
+  }
+
+  // each connection needs a file descriptor
+  if(!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < nconns + 16) {
+    rl.rlim_cur = rl.rlim_max < nconns + 16 ? rl.rlim_max : nconns + 16;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+  g_req_len = snprintf(g_req, sizeof(g_req), "GET %s HTTP/1.1\r\n"
+		       "Host: %s\r\nConnection: keep-alive\r\n\r\n",
+		       path, argv[optind]);
+
+  if(!(conns=calloc(nconns, sizeof(bench_conn_t)))) {
+    perror("calloc");
+    return EXIT_FAILURE;
+  }
+  if((epfd=epoll_create1(0)) < 0) {
+    perror("epoll_create1");
+    return EXIT_FAILURE;
+  }
+
+  if(pid) {
+    bench_print_rss(pid, "idle");
+  }
+
+  // establish all connections, each with a first request
+  t0 = bench_now();
+  for(unsigned int i=0; i<nconns; i++) {
+    if(bench_connect(epfd, &conns[i], &addr)) {
+      return EXIT_FAILURE;
+    }
+  }
+  while(connected < nconns) {
+    if((n=epoll_wait(epfd, evs, 256, 5000)) <= 0) {
+      fprintf(stderr, "timed out after %u connections\n", connected);
+      return EXIT_FAILURE;
+    }
+    for(int i=0; i<n; i++) {
+      c = evs[i].data.ptr;
+      if(!c->connected && (evs[i].events & EPOLLOUT)) {
+	c->connected = 1;
+	connected++;
+      }
+      if(evs[i].events & (EPOLLERR | EPOLLHUP)) {
+	fprintf(stderr, "connection failed\n");
+	return EXIT_FAILURE;
+      }
+      if(c->sent < g_req_len) {
+	bench_send(epfd, c);
+      } else if(bench_recv(epfd, c)) {
+	fprintf(stderr, "connection closed during setup\n");
+	return EXIT_FAILURE;
+      }
+    }
+  }
+  t1 = bench_now();
+
+  // keep all connections busy for the given duration, or until the given
+  // number of responses have been received
+  start_responses = g_responses;
+  start_bytes = g_bytes;
+  while((t2=bench_now()) - t1 < duration &&
+	(!limit || g_responses - start_responses < limit)) {
+    if((n=epoll_wait(epfd, evs, 256, 1000)) < 0) {
+      perror("epoll_wait");
+      break;
+    }
+    for(int i=0; i<n; i++) {
+      c = evs[i].data.ptr;
+      if((evs[i].events & EPOLLOUT) ? bench_send(epfd, c) :
+	 bench_recv(epfd, c)) {
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, 0);
+	close(c->fd);
+	c->fd = -1;
+	closed++;
+      }
+    }
+  }
+
+  printf("connections   %u in %.3f s (%.0f/s)\n", nconns, t1 - t0,
+	 nconns / (t1 - t0));
+  printf("requests      %lu in %.3f s (%.0f/s)\n",
+	 g_responses - start_responses, t2 - t1,
+	 (g_responses - start_responses) / (t2 - t1));
+  printf("throughput    %llu bytes in %.3f s (%.1f MB/s)\n",
+	 g_bytes - start_bytes, t2 - t1,
+	 (g_bytes - start_bytes) / (t2 - t1) / 1e6);
+  printf("errors        %lu non-2xx/3xx, %lu closed by peer\n", g_errors,
+	 closed);
+  if(pid) {
+    bench_print_rss(pid, "loaded");
+  }
+
+  for(unsigned int i=0; i<nconns; i++) {
+    if(conns[i].fd >= 0) {
+      close(conns[i].fd);
+    }
+  }
+  free(conns);
+  close(epfd);
+
+  return EXIT_SUCCESS;
+
+ usage:
+  fprintf(stderr, "Usage: %s [-c CONNS] [-d SECONDS] [-n REQUESTS] [-p PATH] "
+	  "[-P PID] ADDR PORT\n", argv[0]);
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,986 @@
+/* Copyright (C) 2026 John Törnblom
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation; either version 3, or (at your option) any
+later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; see the file COPYING. If not, see
+<http://www.gnu.org/licenses/>.  */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include <microhttpd.h>
+
+#include "archive.h"
+#include "task.h"
+#include "websrv.h"
+
+
+/**
+ * Number of bytes produced per invocation of the response callback, which is
+ * also the size of most reads from files in the archive.
+ **/
+#ifndef ARCHIVE_BLOCK_SIZE
+#define ARCHIVE_BLOCK_SIZE (32 * 0x4000)
+#endif
+
+
+/**
+ * Maximum depth of directories included in an archive, which bounds the
+ * number of open directory file descriptors.
+ **/
+#ifndef ARCHIVE_MAX_DEPTH
+#define ARCHIVE_MAX_DEPTH 64
+#endif
+
+
+/**
+ * Size of the buffer where headers and trailers are staged, large enough for
+ * a pax header with two paths, a ustar header and the padding of a file.
+ **/
+#define ARCHIVE_STAGE_SIZE (4 * PATH_MAX + 0x1000)
+
+
+/**
+ * Size of a tar block.
+ **/
+#define TAR_BLOCK_SIZE 512
+
+
+/**
+ * Largest size that fits in the octal size field of a ustar header.
+ **/
+#define TAR_SIZE_MAX 077777777777ULL
+
+
+/**
+ * Largest value of a 32-bit zip field. Larger values are stored in zip64
+ * extra fields.
+ **/
+#define ZIP_32_MAX 0xffffffffULL
+
+
+/**
+ * Bad Request (400)
+ **/
+#define PAGE_400                          \
+  "<html>"                                \
+  "  <head>"                              \
+  "    <title>Bad request</title>"        \
+  "  </head>"                             \
+  "  <body>Bad request</body>"            \
+  "</html>"
+
+
+/**
+ * File not found (404)
+ **/
+#define PAGE_404                      \
+  "<html>"                            \
+    "<head>"                          \
+      "<title>File not found</title>" \
+    "</head>"                         \
+    "<body>File not found</body>"     \
+  "</html>"
+
+
+/**
+ * Internal Server Error (500)
+ **/
+#define PAGE_500                                 \
+  "<html>"                                       \
+  "  <head>"                                     \
+  "    <title>Internal server error</title>"     \
+  "  </head>"                                    \
+  "  <body>Internal server error</body>"         \
+  "</html>"
+
+
+/**
+ * An open directory in the tree being archived.
+ **/
+typedef struct archive_frame {
+  DIR* dir;
+  size_t pathlen;
+  struct archive_frame* parent;
+} archive_frame_t;
+
+
+/**
+ * A zip central directory record, written once all files have been sent.
+ **/
+typedef struct archive_record {
+  uint64_t offset;
+  uint64_t size;
+  uint32_t crc;
+  uint32_t dostime;
+  uint32_t mode;
+  size_t name;
+  size_t namelen;
+} archive_record_t;
+
+
+/**
+ * State of an archive that is being streamed.
+ **/
+typedef struct archive {
+  enum {
+    ARCHIVE_WALK,
+    ARCHIVE_CENTRAL,
+    ARCHIVE_TRAILER,
+    ARCHIVE_DONE
+  } state;
+  bool zip;
+
+  archive_frame_t* top;
+  int depth;
+  char path[PATH_MAX];
+
+  // the file whose content is being sent
+  int fd;
+  uint64_t remaining;
+  uint32_t crc;
+  bool zip64;
+
+  // headers, padding and trailers waiting to be sent
+  uint8_t* stage;
+  size_t stage_len;
+  size_t stage_off;
+
+  // number of bytes produced so far, i.e., the offset of the next header
+  uint64_t written;
+
+  // zip central directory
+  archive_record_t* records;
+  size_t count;
+  size_t capacity;
+  char* names;
+  size_t names_len;
+  size_t names_cap;
+  size_t central_next;
+  uint64_t central_start;
+} archive_t;
+
+
+/**
+ * Lookup tables for slice-by-8 CRC32 computations.
+ **/
+static uint32_t g_crc_table[8][256];
+static pthread_once_t g_crc_once = PTHREAD_ONCE_INIT;
+
+
+/**
+ * Initialize the CRC32 lookup tables (reflected polynomial 0xedb88320).
+ **/
+static void
+archive_crc32_init(void) {
+  uint32_t c;
+
+  for(int i=0; i<256; i++) {
+    c = i;
+    for(int k=0; k<8; k++) {
+      c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+    }
+    g_crc_table[0][i] = c;
+  }
+
+  for(int i=0; i<256; i++) {
+    for(int k=1; k<8; k++) {
+      c = g_crc_table[k-1][i];
+      g_crc_table[k][i] = (c >> 8) ^ g_crc_table[0][c & 0xff];
+    }
+  }
+}
+
+
+/**
+ * Update a CRC32 checksum, consuming eight bytes per iteration.
+ **/
+static uint32_t
+archive_crc32(uint32_t crc, const uint8_t* p, size_t n) {
+  uint32_t a;
+  uint32_t b;
+
+  crc = ~crc;
+  while(n && ((uintptr_t)p & 7)) {
+    crc = g_crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    n--;
+  }
+
+  while(n >= 8) {
+    a = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+	       (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+    b = (uint32_t)p[4] | (uint32_t)p[5] << 8 |
+        (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+    crc = g_crc_table[7][a & 0xff] ^ g_crc_table[6][(a >> 8) & 0xff] ^
+          g_crc_table[5][(a >> 16) & 0xff] ^ g_crc_table[4][a >> 24] ^
+          g_crc_table[3][b & 0xff] ^ g_crc_table[2][(b >> 8) & 0xff] ^
+          g_crc_table[1][(b >> 16) & 0xff] ^ g_crc_table[0][b >> 24];
+    p += 8;
+    n -= 8;
+  }
+
+  while(n--) {
+    crc = g_crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  }
+
+  return ~crc;
+}
+
+
+/**
+ * Append bytes to the staging buffer.
+ **/
+static uint8_t*
+archive_stage(archive_t* ar, size_t len) {
+  uint8_t* p = ar->stage + ar->stage_len;
+
+  memset(p, 0, len);
+  ar->stage_len += len;
+  ar->written += len;
+
+  return p;
+}
+
+
+static uint8_t*
+archive_put16(uint8_t* p, uint16_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  return p + 2;
+}
+
+
+static uint8_t*
+archive_put32(uint8_t* p, uint32_t v) {
+  p = archive_put16(p, v);
+  return archive_put16(p, v >> 16);
+}
+
+
+static uint8_t*
+archive_put64(uint8_t* p, uint64_t v) {
+  p = archive_put32(p, v);
+  return archive_put32(p, v >> 32);
+}
+
+
+/**
+ * Write an octal number to a NUL-terminated ustar header field.
+ **/
+static void
+archive_tar_octal(char* field, size_t size, uint64_t v) {
+  snprintf(field, size, "%0*llo", (int)size - 1, (unsigned long long)v);
+}
+
+
+/**
+ * Append a record to a pax extended header, i.e., "<len> <key>=<value>\n"
+ * where len includes its own digits.
+ **/
+static size_t
+archive_pax_record(char* buf, const char* key, const char* value) {
+  size_t len = strlen(key) + strlen(value) + 3;
+  size_t digits = 1;
+
+  for(size_t n=10; len + digits >= n; n*=10) {
+    digits++;
+  }
+
+  return sprintf(buf, "%zu %s=%s\n", len + digits, key, value);
+}
+
+
+/**
+ * Stage a ustar header block.
+ **/
+static void
+archive_tar_block(archive_t* ar, const char* name, const char* prefix,
+		  const struct stat* st, char type, uint64_t size,
+		  const char* linkname) {
+  uint8_t* hdr = archive_stage(ar, TAR_BLOCK_SIZE);
+  unsigned int sum = 0;
+
+  strncpy((char*)hdr, name, 100);
+  archive_tar_octal((char*)hdr + 100, 8, st->st_mode & 07777);
+  archive_tar_octal((char*)hdr + 108, 8, st->st_uid & 07777777);
+  archive_tar_octal((char*)hdr + 116, 8, st->st_gid & 07777777);
+  archive_tar_octal((char*)hdr + 124, 12, size <= TAR_SIZE_MAX ? size : 0);
+  archive_tar_octal((char*)hdr + 136, 12, st->st_mtime > 0 ?
+		    st->st_mtime & TAR_SIZE_MAX : 0);
+  memset(hdr + 148, ' ', 8);
+  hdr[156] = type;
+  if(linkname) {
+    strncpy((char*)hdr + 157, linkname, 100);
+  }
+  memcpy(hdr + 257, "ustar", 6);
+  memcpy(hdr + 263, "00", 2);
+  if(prefix) {
+    strncpy((char*)hdr + 345, prefix, 155);
+  }
+
+  for(int i=0; i<TAR_BLOCK_SIZE; i++) {
+    sum += hdr[i];
+  }
+  snprintf((char*)hdr + 148, 8, "%06o", sum);
+}
+
+
+/**
+ * Stage the header(s) of a tar entry. Names, link targets and sizes that do
+ * not fit in a ustar header are stored in a pax extended header.
+ **/
+static void
+archive_tar_header(archive_t* ar, const char* path, const struct stat* st,
+		   char type, uint64_t size, const char* linkname) {
+  char pax[2 * PATH_MAX + 128];
+  const char* prefix = 0;
+  const char* name = path;
+  char buf[PATH_MAX];
+  size_t len = strlen(path);
+  size_t paxlen = 0;
+  const char* slash;
+
+  // split long names at a slash into the prefix and name fields
+  if(len > 100) {
+    slash = strchr(path + len - 101, '/');
+    if(slash && slash[1] && slash - path <= 155) {
+      memcpy(buf, path, slash - path);
+      buf[slash - path] = 0;
+      prefix = buf;
+      name = slash + 1;
+    } else {
+      paxlen += archive_pax_record(pax + paxlen, "path", path);
+    }
+  }
+  if(linkname && strlen(linkname) > 100) {
+    paxlen += archive_pax_record(pax + paxlen, "linkpath", linkname);
+  }
+  if(size > TAR_SIZE_MAX) {
+    char num[32];
+    snprintf(num, sizeof(num), "%llu", (unsigned long long)size);
+    paxlen += archive_pax_record(pax + paxlen, "size", num);
+  }
+
+  if(paxlen) {
+    archive_tar_block(ar, "././@PaxHeader", 0, st, 'x', paxlen, 0);
+    memcpy(archive_stage(ar, (paxlen + TAR_BLOCK_SIZE - 1) &
+			 ~(TAR_BLOCK_SIZE - 1)), pax, paxlen);
+  }
+
+  archive_tar_block(ar, name, prefix, st, type, size, linkname);
+}
+
+
+/**
+ * Convert a timestamp to MS-DOS date and time, as used by zip.
+ **/
+static uint32_t
+archive_dostime(time_t t) {
+  struct tm tm;
+
+  localtime_r(&t, &tm);
+  if(tm.tm_year < 80) {
+    return (1 << 21) | (1 << 16);
+  }
+
+  return (uint32_t)(tm.tm_year - 80) << 25 | (uint32_t)(tm.tm_mon + 1) << 21 |
+         (uint32_t)tm.tm_mday << 16 | (uint32_t)tm.tm_hour << 11 |
+         (uint32_t)tm.tm_min << 5 | (uint32_t)tm.tm_sec >> 1;
+}
+
+
+/**
+ * Stage the local header of a zip entry, and remember what goes into its
+ * central directory record. File content is stored without compression, and
+ * its checksum is sent in a data descriptor that follows the content.
+ **/
+static int
+archive_zip_header(archive_t* ar, const char* path, const struct stat* st,
+		   uint64_t size) {
+  size_t namelen = strlen(path);
+  archive_record_t* r;
+  bool dir = S_ISDIR(st->st_mode);
+  size_t n;
+  uint8_t* p;
+  void* ptr;
+
+  if(ar->count == ar->capacity) {
+    n = ar->capacity ? 2 * ar->capacity : 64;
+    if(!(ptr=realloc(ar->records, n * sizeof(archive_record_t)))) {
+      return -1;
+    }
+    ar->records = ptr;
+    ar->capacity = n;
+  }
+  if(ar->names_len + namelen > ar->names_cap) {
+    n = ar->names_cap ? 2 * ar->names_cap : 0x4000;
+    while(n < ar->names_len + namelen) {
+      n *= 2;
+    }
+    if(!(ptr=realloc(ar->names, n))) {
+      return -1;
+    }
+    ar->names = ptr;
+    ar->names_cap = n;
+  }
+
+  r = &ar->records[ar->count++];
+  r->offset = ar->written;
+  r->size = size;
+  r->crc = 0;
+  r->dostime = archive_dostime(st->st_mtime);
+  r->mode = st->st_mode;
+  r->name = ar->names_len;
+  r->namelen = namelen;
+  memcpy(ar->names + ar->names_len, path, namelen);
+  ar->names_len += namelen;
+
+  ar->zip64 = size >= ZIP_32_MAX;
+  ar->crc = 0;
+
+  p = archive_stage(ar, 30 + namelen + (ar->zip64 ? 20 : 0));
+  p = archive_put32(p, 0x04034b50);
+  p = archive_put16(p, ar->zip64 ? 45 : 20);
+  p = archive_put16(p, dir ? 0x0800 : 0x0808); // utf-8, data descriptor
+  p = archive_put16(p, 0);                     // stored
+  p = archive_put32(p, r->dostime);
+  p = archive_put32(p, 0);
+  p = archive_put32(p, ar->zip64 ? ZIP_32_MAX : 0);
+  p = archive_put32(p, ar->zip64 ? ZIP_32_MAX : 0);
+  p = archive_put16(p, namelen);
+  p = archive_put16(p, ar->zip64 ? 20 : 0);
+  memcpy(p, path, namelen);
+  p += namelen;
+
+  if(ar->zip64) {
+    p = archive_put16(p, 0x0001);
+    p = archive_put16(p, 16);
+    p = archive_put64(p, 0);
+    p = archive_put64(p, 0);
+  }
+
+  return 0;
+}
+
+
+/**
+ * Stage the data descriptor of a zip entry.
+ **/
+static void
+archive_zip_descriptor(archive_t* ar) {
+  archive_record_t* r = &ar->records[ar->count - 1];
+  uint8_t* p;
+
+  r->crc = ar->crc;
+
+  p = archive_stage(ar, ar->zip64 ? 24 : 16);
+  p = archive_put32(p, 0x08074b50);
+  p = archive_put32(p, r->crc);
+  if(ar->zip64) {
+    p = archive_put64(p, r->size);
+    p = archive_put64(p, r->size);
+  } else {
+    p = archive_put32(p, r->size);
+    p = archive_put32(p, r->size);
+  }
+}
+
+
+/**
+ * Stage a zip central directory record.
+ **/
+static void
+archive_zip_central(archive_t* ar, const archive_record_t* r) {
+  bool big_size = r->size >= ZIP_32_MAX;
+  bool big_offset = r->offset >= ZIP_32_MAX;
+  bool dir = S_ISDIR(r->mode);
+  size_t extra = 0;
+  uint8_t* p;
+
+  if(big_size || big_offset) {
+    extra = 4 + (big_size ? 16 : 0) + (big_offset ? 8 : 0);
+  }
+
+  p = archive_stage(ar, 46 + r->namelen + extra);
+  p = archive_put32(p, 0x02014b50);
+  p = archive_put16(p, 3 << 8 | 45);            // unix
+  p = archive_put16(p, extra ? 45 : 20);
+  p = archive_put16(p, dir ? 0x0800 : 0x0808);
+  p = archive_put16(p, 0);
+  p = archive_put32(p, r->dostime);
+  p = archive_put32(p, r->crc);
+  p = archive_put32(p, big_size ? ZIP_32_MAX : r->size);
+  p = archive_put32(p, big_size ? ZIP_32_MAX : r->size);
+  p = archive_put16(p, r->namelen);
+  p = archive_put16(p, extra);
+  p = archive_put16(p, 0);                      // comment
+  p = archive_put16(p, 0);                      // disk
+  p = archive_put16(p, 0);                      // internal attributes
+  p = archive_put32(p, (r->mode & 0xffff) << 16 | (dir ? 0x10 : 0));
+  p = archive_put32(p, big_offset ? ZIP_32_MAX : r->offset);
+  memcpy(p, ar->names + r->name, r->namelen);
+  p += r->namelen;
+
+  if(extra) {
+    p = archive_put16(p, 0x0001);
+    p = archive_put16(p, extra - 4);
+    if(big_size) {
+      p = archive_put64(p, r->size);
+      p = archive_put64(p, r->size);
+    }
+    if(big_offset) {
+      p = archive_put64(p, r->offset);
+    }
+  }
+}
+
+
+/**
+ * Stage the end of a zip central directory, with zip64 records if the
+ * archive is too large for the classic one.
+ **/
+static void
+archive_zip_end(archive_t* ar) {
+  uint64_t size = ar->written - ar->central_start;
+  uint64_t offset = ar->written;
+  uint8_t* p;
+
+  if(ar->count >= 0xffff || size >= ZIP_32_MAX ||
+     ar->central_start >= ZIP_32_MAX) {
+    p = archive_stage(ar, 56 + 20);
+    p = archive_put32(p, 0x06064b50);
+    p = archive_put64(p, 44);
+    p = archive_put16(p, 3 << 8 | 45);
+    p = archive_put16(p, 45);
+    p = archive_put32(p, 0);
+    p = archive_put32(p, 0);
+    p = archive_put64(p, ar->count);
+    p = archive_put64(p, ar->count);
+    p = archive_put64(p, size);
+    p = archive_put64(p, ar->central_start);
+
+    p = archive_put32(p, 0x07064b50);
+    p = archive_put32(p, 0);
+    p = archive_put64(p, offset);
+    p = archive_put32(p, 1);
+  }
+
+  p = archive_stage(ar, 22);
+  p = archive_put32(p, 0x06054b50);
+  p = archive_put16(p, 0);
+  p = archive_put16(p, 0);
+  p = archive_put16(p, ar->count < 0xffff ? ar->count : 0xffff);
+  p = archive_put16(p, ar->count < 0xffff ? ar->count : 0xffff);
+  p = archive_put32(p, size < ZIP_32_MAX ? size : ZIP_32_MAX);
+  p = archive_put32(p, ar->central_start < ZIP_32_MAX ?
+		    ar->central_start : ZIP_32_MAX);
+  p = archive_put16(p, 0);
+}
+
+
+/**
+ * Stage the header of an entry.
+ **/
+static int
+archive_header(archive_t* ar, const struct stat* st, const char* linkname) {
+  uint64_t size = S_ISREG(st->st_mode) ? st->st_size : 0;
+  char type = S_ISDIR(st->st_mode) ? '5' : (linkname ? '2' : '0');
+
+  if(ar->zip) {
+    return archive_zip_header(ar, ar->path, st, size);
+  }
+
+  archive_tar_header(ar, ar->path, st, type, size, linkname);
+
+  return 0;
+}
+
+
+/**
+ * Open a directory, and descend into it.
+ **/
+static int
+archive_push(archive_t* ar, int fd, size_t pathlen) {
+  archive_frame_t* frame;
+  DIR* dir;
+
+  if(!(frame=malloc(sizeof(archive_frame_t)))) {
+    close(fd);
+    return -1;
+  }
+  if(!(dir=fdopendir(fd))) {
+    close(fd);
+    free(frame);
+    return -1;
+  }
+
+  frame->dir = dir;
+  frame->pathlen = pathlen;
+  frame->parent = ar->top;
+  ar->top = frame;
+  ar->depth++;
+
+  return 0;
+}
+
+
+/**
+ * Return to the parent of the current directory.
+ **/
+static void
+archive_pop(archive_t* ar) {
+  archive_frame_t* frame = ar->top;
+
+  ar->top = frame->parent;
+  ar->depth--;
+  closedir(frame->dir);
+  free(frame);
+}
+
+
+/**
+ * Stage the next entry of the directory tree. Entries that cannot be opened
+ * are left out. Symbolic links are only included in tar archives, and are
+ * never followed.
+ **/
+static int
+archive_next_entry(archive_t* ar) {
+  char linkname[PATH_MAX];
+  struct dirent* entry;
+  struct stat st;
+  size_t len;
+  ssize_t n;
+  int dfd;
+  int fd;
+
+  while(ar->top) {
+    if(!(entry=readdir(ar->top->dir))) {
+      archive_pop(ar);
+      continue;
+    }
+    if(!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+      continue;
+    }
+
+    dfd = dirfd(ar->top->dir);
+    if(fstatat(dfd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+      continue;
+    }
+
+    len = ar->top->pathlen;
+    n = snprintf(ar->path + len, sizeof(ar->path) - len, "%s%s",
+		 entry->d_name, S_ISDIR(st.st_mode) ? "/" : "");
+    if(n < 0 || (size_t)n >= sizeof(ar->path) - len) {
+      continue;
+    }
+
+    if(S_ISDIR(st.st_mode)) {
+      if(ar->depth >= ARCHIVE_MAX_DEPTH) {
+	continue;
+      }
+      if((fd=openat(dfd, entry->d_name,
+		    O_RDONLY | O_DIRECTORY | O_NOFOLLOW)) < 0) {
+	continue;
+      }
+      if(archive_header(ar, &st, 0)) {
+	close(fd);
+	return -1;
+      }
+      return archive_push(ar, fd, len + n);
+    }
+
+    if(S_ISREG(st.st_mode)) {
+      if((fd=openat(dfd, entry->d_name, O_RDONLY | O_NOFOLLOW)) < 0) {
+	continue;
+      }
+      if(fstat(fd, &st) || archive_header(ar, &st, 0)) {
+	close(fd);
+	continue;
+      }
+      ar->fd = fd;
+      ar->remaining = st.st_size;
+      return 0;
+    }
+
+    if(S_ISLNK(st.st_mode) && !ar->zip) {
+      if((n=readlinkat(dfd, entry->d_name, linkname,
+		       sizeof(linkname) - 1)) < 0) {
+	continue;
+      }
+      linkname[n] = 0;
+      return archive_header(ar, &st, linkname);
+    }
+  }
+
+  return 0;
+}
+
+
+/**
+ * Stage the tail of a file once its content has been sent.
+ **/
+static void
+archive_end_file(archive_t* ar) {
+  uint64_t size;
+
+  close(ar->fd);
+  ar->fd = -1;
+
+  if(ar->zip) {
+    archive_zip_descriptor(ar);
+  } else {
+    size = ar->written % TAR_BLOCK_SIZE;
+    if(size) {
+      archive_stage(ar, TAR_BLOCK_SIZE - size);
+    }
+  }
+}
+
+
+/**
+ * Stage what comes next in the archive.
+ **/
+static int
+archive_next(archive_t* ar) {
+  switch(ar->state) {
+  case ARCHIVE_WALK:
+    if(archive_next_entry(ar)) {
+      return -1;
+    }
+    if(!ar->top && !ar->stage_len && ar->fd < 0) {
+      ar->state = ar->zip ? ARCHIVE_CENTRAL : ARCHIVE_TRAILER;
+      ar->central_start = ar->written;
+    }
+    return 0;
+
+  case ARCHIVE_CENTRAL:
+    if(ar->central_next < ar->count) {
+      archive_zip_central(ar, &ar->records[ar->central_next++]);
+    } else {
+      archive_zip_end(ar);
+      ar->state = ARCHIVE_DONE;
+    }
+    return 0;
+
+  case ARCHIVE_TRAILER:
+    archive_stage(ar, 2 * TAR_BLOCK_SIZE);
+    ar->state = ARCHIVE_DONE;
+    return 0;
+
+  default:
+    return 0;
+  }
+}
+
+
+/**
+ * Produce the next part of an archive. File content is read straight into
+ * the block buffer, so that large files are never buffered in memory as a
+ * whole.
+ **/
+static ssize_t
+archive_read(void *cls, uint64_t pos, char *buf, size_t max) {
+  archive_t* ar = cls;
+  size_t len = 0;
+  ssize_t n;
+
+  while(len < max) {
+    if(ar->stage_off < ar->stage_len) {
+      n = ar->stage_len - ar->stage_off;
+      if((size_t)n > max - len) {
+	n = max - len;
+      }
+      memcpy(buf + len, ar->stage + ar->stage_off, n);
+      ar->stage_off += n;
+      len += n;
+      continue;
+    }
+    ar->stage_off = ar->stage_len = 0;
+
+    if(ar->fd >= 0) {
+      if(!ar->remaining) {
+	archive_end_file(ar);
+	continue;
+      }
+
+      n = max - len;
+      if((uint64_t)n > ar->remaining) {
+	n = ar->remaining;
+      }
+      if((n=read(ar->fd, buf + len, n)) < 0) {
+	if(errno == EINTR) {
+	  continue;
+	}
+	return MHD_CONTENT_READER_END_WITH_ERROR;
+      }
+
+      // the file shrunk after its header was sent, pad it with zeros
+      if(!n) {
+	n = max - len;
+	if((uint64_t)n > ar->remaining) {
+	  n = ar->remaining;
+	}
+	memset(buf + len, 0, n);
+      }
+
+      if(ar->zip) {
+	ar->crc = archive_crc32(ar->crc, (uint8_t*)buf + len, n);
+      }
+      ar->remaining -= n;
+      ar->written += n;
+      len += n;
+      continue;
+    }
+
+    if(ar->state == ARCHIVE_DONE) {
+      break;
+    }
+    if(archive_next(ar)) {
+      return MHD_CONTENT_READER_END_WITH_ERROR;
+    }
+  }
+
+  if(!len) {
+    return MHD_CONTENT_READER_END_OF_STREAM;
+  }
+
+  return len;
+}
+
+
+/**
+ * Release resources held by an archive.
+ **/
+static void
+archive_close(void *cls) {
+  archive_t* ar = cls;
+
+  while(ar->top) {
+    archive_pop(ar);
+  }
+  if(ar->fd >= 0) {
+    close(ar->fd);
+  }
+
+  free(ar->stage);
+  free(ar->records);
+  free(ar->names);
+  free(ar);
+}
+
+
+/**
+ * Respond with a static page.
+ **/
+static enum MHD_Result
+archive_respond(struct MHD_Connection *conn, unsigned int status,
+		const char* page) {
+  enum MHD_Result ret = MHD_NO;
+  struct MHD_Response *resp;
+
+  if((resp=MHD_create_response_from_buffer(strlen(page), (void*)page,
+					   MHD_RESPMEM_PERSISTENT))) {
+    MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE, "text/html");
+    ret = websrv_queue_response(conn, status, resp);
+    MHD_destroy_response(resp);
+  }
+
+  return ret;
+}
+
+
+enum MHD_Result
+archive_request(struct MHD_Connection *conn, const char* path,
+		const char* fmt) {
+  enum MHD_Result ret = MHD_NO;
+  struct MHD_Response *resp;
+  char disposition[NAME_MAX + 64];
+  char name[NAME_MAX + 1];
+  const char* base;
+  struct stat st;
+  archive_t* ar;
+  size_t len;
+  int fd;
+
+  if(strcmp(fmt, "tar") && strcmp(fmt, "zip")) {
+    return archive_respond(conn, MHD_HTTP_BAD_REQUEST, PAGE_400);
+  }
+
+  // entries are stored below a folder named after the archived directory
+  len = strlen(path);
+  while(len > 1 && path[len-1] == '/') {
+    len--;
+  }
+  for(base=path+len; base > path && base[-1] != '/'; base--);
+  if(base == path + len || path + len - base > NAME_MAX) {
+    strcpy(name, "root");
+  } else {
+    memcpy(name, base, path + len - base);
+    name[path + len - base] = 0;
+  }
+
+  if((fd=open(path, O_RDONLY | O_DIRECTORY)) < 0) {
+    return archive_respond(conn, MHD_HTTP_NOT_FOUND, PAGE_404);
+  }
+  if(fstat(fd, &st)) {
+    close(fd);
+    return archive_respond(conn, MHD_HTTP_NOT_FOUND, PAGE_404);
+  }
+
+  pthread_once(&g_crc_once, archive_crc32_init);
+
+  if(!(ar=calloc(1, sizeof(archive_t))) ||
+     !(ar->stage=malloc(ARCHIVE_STAGE_SIZE))) {
+    free(ar);
+    close(fd);
+    return archive_respond(conn, MHD_HTTP_INTERNAL_SERVER_ERROR, PAGE_500);
+  }
+
+  ar->zip = !strcmp(fmt, "zip");
+  ar->fd = -1;
+  ar->state = ARCHIVE_WALK;
+  len = snprintf(ar->path, sizeof(ar->path), "%s/", name);
+
+  if(archive_header(ar, &st, 0) || archive_push(ar, fd, len)) {
+    archive_close(ar);
+    return archive_respond(conn, MHD_HTTP_INTERNAL_SERVER_ERROR, PAGE_500);
+  }
+  // the walk and file reads happen on helper threads
+  if(!(resp=task_create_response(conn, MHD_SIZE_UNKNOWN, ARCHIVE_BLOCK_SIZE,
+				 &archive_read, ar, &archive_close))) {
+    archive_close(ar);
+    return MHD_NO;
+  }
+
+  snprintf(disposition, sizeof(disposition),
+	   "attachment; filename=\"%s.%s\"", name, fmt);
+  MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE,
+			  ar->zip ? "application/zip" : "application/x-tar");
+  MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_DISPOSITION,
+			  disposition);
+  ret = websrv_queue_response(conn, MHD_HTTP_OK, resp);
+  MHD_destroy_response(resp);
+
+  return ret;
+}
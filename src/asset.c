@@ -15,6 +15,8 @@ along with this program; see the file COPYING. If not, see
 <http://www.gnu.org/licenses/>.  */
 
 #include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -37,45 +39,60 @@ along with this program; see the file COPYING. If not, see
   "</html>"
 
 
-typedef struct asset {
-  const char   *path;
-  const char   *mime;
-  void         *data;
-  size_t        size;
-  struct asset *next;
-} asset_t;
-
-
-static asset_t* g_asset_head = 0;
-
-
-static  void
-asset_normalize_path(const char *url, char* path) {
+/**
+ * Remove superfluous forward slashes from the given url, and compute the
+ * hash of the result. Returns -1 if the url does not fit in PATH_MAX.
+ **/
+static int
+asset_normalize_path(const char *url, char* path, uint32_t* hash) {
+  uint32_t h = 2166136261u ^ g_asset_seed;
   char* ptr = path;
 
-  for(size_t i=0; i<strlen(url); i++) {
-    if(url[i] == '/' && url[i+1] == '/') {
+  for(; *url; url++) {
+    if(url[0] == '/' && url[1] == '/') {
       continue;
     }
-    *ptr = url[i];
-    ptr++;
+    if(ptr - path >= PATH_MAX - 1) {
+      return -1;
+    }
+    *ptr++ = *url;
+
+    // FNV-1a, must match asset_hash() in gen-asset-module.py
+    h ^= (uint8_t)url[0];
+    h *= 16777619u;
   }
 
   *ptr = '\0';
+  *hash = h;
+
+  return 0;
 }
 
 
-void
-asset_register(const char* path, void* data, size_t size, const char* mime) {
-  asset_t* a = calloc(1, sizeof(asset_t));
+/**
+ * Lookup an embedded asset.
+ **/
+static const asset_t*
+asset_lookup(const char *url) {
+  const asset_t* a;
+  char path[PATH_MAX];
+  uint32_t hash;
+  int16_t i;
 
-  a->path = path;
-  a->mime = mime;
-  a->data = data;
-  a->size = size;
-  a->next = g_asset_head;
+  if(asset_normalize_path(url, path, &hash)) {
+    return 0;
+  }
 
-  g_asset_head = a;
+  if((i=g_asset_index[hash & g_asset_mask]) < 0) {
+    return 0;
+  }
+
+  a = &g_asset_table[i];
+  if(strcmp(path, a->path)) {
+    return 0;
+  }
+
+  return a;
 }
 
 
@@ -86,17 +103,49 @@ asset_request(struct MHD_Connection *conn, const char* url) {
   size_t size = strlen(PAGE_404);
   struct MHD_Response *resp;
   void* data = PAGE_404;
+  const char* encoding = 0;
   const char* mime = 0;
-  char path[PATH_MAX];
+  const asset_t* a;
+  char etag[64];
+  int gzip_q = 0;
+  int br_q = 0;
+
+  if((a=asset_lookup(url))) {
+    data = a->data;
+    size = a->size;
+    mime = a->mime;
+    status = MHD_HTTP_OK;
+
+    if(a->br_data) {
+      br_q = websrv_accept_encoding(conn, "br");
+    }
+    if(a->gzip_data) {
+      gzip_q = websrv_accept_encoding(conn, "gzip");
+    }
 
-  asset_normalize_path(url, path);
-  for(asset_t* a=g_asset_head; a!=0; a=a->next) {
-    if(!strcmp(path, a->path)) {
-      data = a->data;
-      size = a->size;
-      mime = a->mime;
-      status = MHD_HTTP_OK;
-      break;
+    // prefer the smaller brotli variant unless gzip is ranked higher
+    if(br_q && br_q >= gzip_q) {
+      data = a->br_data;
+      size = a->br_size;
+      encoding = "br";
+    } else if(gzip_q) {
+      data = a->gzip_data;
+      size = a->gzip_size;
+      encoding = "gzip";
+    }
+
+    // each variant is a distinct representation with its own strong etag
+    if(encoding) {
+      snprintf(etag, sizeof(etag), "\"%s-%s\"", a->etag, encoding);
+    } else {
+      snprintf(etag, sizeof(etag), "\"%s\"", a->etag);
+    }
+
+    if(websrv_not_modified(conn, etag, -1)) {
+      status = MHD_HTTP_NOT_MODIFIED;
+      encoding = 0;
+      data = "";
+      size = 0;
     }
   }
 
@@ -105,6 +154,18 @@ asset_request(struct MHD_Connection *conn, const char* url) {
     if(mime) {
       MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE, mime);
     }
+    if(encoding) {
+      MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_ENCODING,
+			      encoding);
+    }
+    if(a && (a->gzip_data || a->br_data)) {
+      MHD_add_response_header(resp, MHD_HTTP_HEADER_VARY,
+			      MHD_HTTP_HEADER_ACCEPT_ENCODING);
+    }
+    if(a) {
+      MHD_add_response_header(resp, MHD_HTTP_HEADER_ETAG, etag);
+      MHD_add_response_header(resp, MHD_HTTP_HEADER_CACHE_CONTROL, "no-cache");
+    }
     ret = websrv_queue_response(conn, status, resp);
     MHD_destroy_response(resp);
   }
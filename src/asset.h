@@ -16,17 +16,43 @@ along with this program; see the file COPYING. If not, see
 
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include <microhttpd.h>
 
 
 /**
- * Respond to an asset request.
+ * An asset embedded into the executable at build time, together with
+ * precompressed variants of it. Variants that would not have made the
+ * asset smaller are left out (null). The etag is a hash of the content,
+ * computed at build time.
  **/
-enum MHD_Result asset_request(struct MHD_Connection *conn,
-			      const char* url);
+typedef struct asset {
+  const char *path;
+  const char *mime;
+  const char *etag;
+  void       *data;
+  size_t      size;
+  void       *gzip_data;
+  size_t      gzip_size;
+  void       *br_data;
+  size_t      br_size;
+} asset_t;
+
 
 /**
- * Register the presence of an asset.
+ * Table of embedded assets, and a perfect hash index into it, generated
+ * by gen-asset-module.py. Unused index slots are set to -1.
  **/
-void asset_register(const char* path, void* data, size_t size, const char* mime);
+extern const asset_t  g_asset_table[];
+extern const int16_t  g_asset_index[];
+extern const uint32_t g_asset_seed;
+extern const uint32_t g_asset_mask;
+
 
+/**
+ * Respond to an asset request.
+ **/
+enum MHD_Result asset_request(struct MHD_Connection *conn,
+			      const char* url);
@@ -0,0 +1,314 @@
+/* Copyright (C) 2026 John Törnblom
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation; either version 3, or (at your option) any
+later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; see the file COPYING. If not, see
+<http://www.gnu.org/licenses/>.  */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <zlib.h>
+
+#include <microhttpd.h>
+
+#include "compress.h"
+#include "task.h"
+#include "websrv.h"
+
+
+/**
+ * Responses smaller than this number of bytes are sent uncompressed, since
+ * the savings do not make up for the overhead.
+ **/
+#ifndef COMPRESS_MIN_SIZE
+#define COMPRESS_MIN_SIZE 1024
+#endif
+
+
+/**
+ * zlib compression level, trading ratio for speed on the console's CPU.
+ **/
+#ifndef COMPRESS_LEVEL
+#define COMPRESS_LEVEL 6
+#endif
+
+
+/**
+ * Mime types, besides text/ and those with a +json or +xml suffix, that are
+ * compressed.
+ **/
+static const char* g_mime_allow[] = {
+  "application/javascript",
+  "application/json",
+  "application/x-javascript",
+  "application/x-sh",
+  "application/xml",
+  "image/svg+xml",
+  0
+};
+
+
+/**
+ * State of a compressed response.
+ **/
+typedef struct compress_sm {
+  z_stream strm;
+  MHD_ContentReaderCallback cb;
+  MHD_ContentReaderFreeCallback free_cb;
+  void* cls;
+  uint64_t pos;
+  bool eof;
+  bool done;
+  size_t size;
+  uint8_t buf[];
+} compress_sm_t;
+
+
+bool
+compress_mime(const char* mime) {
+  size_t len;
+
+  if(!mime) {
+    return false;
+  }
+  if(!strncasecmp(mime, "text/", 5)) {
+    return true;
+  }
+
+  len = strcspn(mime, "; ");
+  if(len > 5 && (!strncasecmp(mime + len - 5, "+json", 5) ||
+		 !strncasecmp(mime + len - 4, "+xml", 4))) {
+    return true;
+  }
+
+  for(int i=0; g_mime_allow[i]; i++) {
+    if(strlen(g_mime_allow[i]) == len &&
+       !strncasecmp(mime, g_mime_allow[i], len)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+const char*
+compress_negotiate(struct MHD_Connection *conn, const char* mime,
+		   uint64_t size) {
+  int gzip_q;
+  int deflate_q;
+
+  if(size < COMPRESS_MIN_SIZE || !compress_mime(mime)) {
+    return 0;
+  }
+
+  gzip_q = websrv_accept_encoding(conn, "gzip");
+  deflate_q = websrv_accept_encoding(conn, "deflate");
+  if(gzip_q > 0 && gzip_q >= deflate_q) {
+    return "gzip";
+  }
+  if(deflate_q > 0) {
+    return "deflate";
+  }
+
+  return 0;
+}
+
+
+/**
+ * Obtain the zlib window bits for a content coding, where gzip wraps the
+ * deflate stream in a gzip rather than a zlib container.
+ **/
+static int
+compress_window_bits(const char* encoding) {
+  return strcmp(encoding, "gzip") ? 15 : 15 + 16;
+}
+
+
+char*
+compress_buffer(const char* encoding, const char* buf, size_t size,
+		size_t* compressed_size) {
+  z_stream strm = {0};
+  char* out;
+  uLong bound;
+
+  if(size < COMPRESS_MIN_SIZE) {
+    return 0;
+  }
+  if(deflateInit2(&strm, COMPRESS_LEVEL, Z_DEFLATED,
+		  compress_window_bits(encoding), 8,
+		  Z_DEFAULT_STRATEGY) != Z_OK) {
+    return 0;
+  }
+
+  bound = deflateBound(&strm, size);
+  if(!(out=malloc(bound))) {
+    deflateEnd(&strm);
+    return 0;
+  }
+
+  strm.next_in = (Bytef*)buf;
+  strm.avail_in = size;
+  strm.next_out = (Bytef*)out;
+  strm.avail_out = bound;
+
+  if(deflate(&strm, Z_FINISH) != Z_STREAM_END || strm.total_out >= size) {
+    deflateEnd(&strm);
+    free(out);
+    return 0;
+  }
+
+  *compressed_size = strm.total_out;
+  deflateEnd(&strm);
+
+  return out;
+}
+
+
+struct MHD_Response*
+compress_buffer_response(const char* encoding, char* buf, size_t size) {
+  struct MHD_Response *resp;
+  size_t zsize;
+  char* zbuf;
+
+  if(encoding && (zbuf=compress_buffer(encoding, buf, size, &zsize))) {
+    free(buf);
+    if(!(resp=MHD_create_response_from_buffer(zsize, zbuf,
+					      MHD_RESPMEM_MUST_FREE))) {
+      free(zbuf);
+      return 0;
+    }
+    MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_ENCODING, encoding);
+    MHD_add_response_header(resp, MHD_HTTP_HEADER_VARY,
+			    MHD_HTTP_HEADER_ACCEPT_ENCODING);
+    return resp;
+  }
+
+  if(!(resp=MHD_create_response_from_buffer(size, buf,
+					    MHD_RESPMEM_MUST_FREE))) {
+    free(buf);
+    return 0;
+  }
+
+  return resp;
+}
+
+
+/**
+ * Produce the next part of a compressed response, pulling as much input
+ * from the wrapped callback as needed to fill at least some of the buffer.
+ **/
+static ssize_t
+compress_read(void *cls, uint64_t pos, char *buf, size_t max) {
+  compress_sm_t* sm = cls;
+  ssize_t n;
+  int ret;
+
+  if(sm->done) {
+    return MHD_CONTENT_READER_END_OF_STREAM;
+  }
+
+  sm->strm.next_out = (Bytef*)buf;
+  sm->strm.avail_out = max;
+
+  while(sm->strm.avail_out == max) {
+    if(!sm->strm.avail_in && !sm->eof) {
+      n = sm->cb(sm->cls, sm->pos, (char*)sm->buf, sm->size);
+      if(n == MHD_CONTENT_READER_END_OF_STREAM) {
+	sm->eof = true;
+      } else if(n < 0) {
+	return MHD_CONTENT_READER_END_WITH_ERROR;
+      } else if(!n) {
+	break;
+      } else {
+	sm->strm.next_in = sm->buf;
+	sm->strm.avail_in = n;
+	sm->pos += n;
+      }
+    }
+
+    ret = deflate(&sm->strm, sm->eof ? Z_FINISH : Z_NO_FLUSH);
+    if(ret == Z_STREAM_END) {
+      sm->done = true;
+      break;
+    }
+    if(ret != Z_OK && ret != Z_BUF_ERROR) {
+      return MHD_CONTENT_READER_END_WITH_ERROR;
+    }
+  }
+
+  if(sm->done && sm->strm.avail_out == max) {
+    return MHD_CONTENT_READER_END_OF_STREAM;
+  }
+
+  return max - sm->strm.avail_out;
+}
+
+
+/**
+ * Release resources held by a compressed response.
+ **/
+static void
+compress_close(void *cls) {
+  compress_sm_t* sm = cls;
+
+  deflateEnd(&sm->strm);
+  sm->free_cb(sm->cls);
+  free(sm);
+}
+
+
+struct MHD_Response*
+compress_create_response(struct MHD_Connection *conn, const char* encoding,
+			 size_t block_size,
+			 MHD_ContentReaderCallback cb, void* cls,
+			 MHD_ContentReaderFreeCallback free_cb) {
+  struct MHD_Response *resp;
+  compress_sm_t* sm;
+
+  if(!(sm=calloc(1, sizeof(compress_sm_t) + block_size))) {
+    return 0;
+  }
+  if(deflateInit2(&sm->strm, COMPRESS_LEVEL, Z_DEFLATED,
+		  compress_window_bits(encoding), 8,
+		  Z_DEFAULT_STRATEGY) != Z_OK) {
+    free(sm);
+    return 0;
+  }
+
+  sm->cb = cb;
+  sm->cls = cls;
+  sm->free_cb = free_cb;
+  sm->size = block_size;
+
+  if(conn) {
+    resp = task_create_response(conn, MHD_SIZE_UNKNOWN, block_size,
+				&compress_read, sm, &compress_close);
+  } else {
+    resp = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, block_size,
+					     &compress_read, sm,
+					     &compress_close);
+  }
+  if(!resp) {
+    deflateEnd(&sm->strm);
+    free(sm);
+    return 0;
+  }
+
+  MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_ENCODING, encoding);
+  MHD_add_response_header(resp, MHD_HTTP_HEADER_VARY,
+			  MHD_HTTP_HEADER_ACCEPT_ENCODING);
+
+  return resp;
+}
@@ -0,0 +1,72 @@
+/* Copyright (C) 2026 John Törnblom
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation; either version 3, or (at your option) any
+later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; see the file COPYING. If not, see
+<http://www.gnu.org/licenses/>.  */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <microhttpd.h>
+
+
+/**
+ * Check if content of the given mime type is worth compressing.
+ **/
+bool compress_mime(const char* mime);
+
+
+/**
+ * Select a content coding ("gzip" or "deflate") for a response with the
+ * given mime type and size (MHD_SIZE_UNKNOWN if not known in advance).
+ * Returns NULL if the response should be sent as is.
+ **/
+const char* compress_negotiate(struct MHD_Connection *conn, const char* mime,
+			       uint64_t size);
+
+
+/**
+ * Compress a buffer in one go with the given content coding. Returns a
+ * buffer allocated with malloc(), and its size in compressed_size, or NULL
+ * if the buffer is too small to be worth it, does not shrink, or on error.
+ **/
+char* compress_buffer(const char* encoding, const char* buf, size_t size,
+		      size_t* compressed_size);
+
+
+/**
+ * Create a response that serves a buffer, compressed with the given content
+ * coding if it is not NULL and compress_buffer() succeeds. Ownership of buf
+ * is transferred to the response, also when NULL is returned.
+ **/
+struct MHD_Response* compress_buffer_response(const char* encoding,
+					      char* buf, size_t size);
+
+
+/**
+ * Create a response that compresses the output of a content reader callback
+ * incrementally with the given content coding. The callback is invoked with
+ * buffers of block_size bytes. If conn is not NULL, the callbacks are
+ * invoked (and the data compressed) on helper threads, see
+ * task_create_response(). Like MHD_create_response_from_callback(),
+ * free_cb is invoked with cls once the response is destroyed, but not when
+ * this function fails.
+ **/
+struct MHD_Response* compress_create_response(struct MHD_Connection *conn,
+					      const char* encoding,
+					      size_t block_size,
+					      MHD_ContentReaderCallback cb,
+					      void* cls,
+					      MHD_ContentReaderFreeCallback free_cb);
@@ -0,0 +1,341 @@
+/* Copyright (C) 2026 John Törnblom
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation; either version 3, or (at your option) any
+later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; see the file COPYING. If not, see
+<http://www.gnu.org/licenses/>.  */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/stat.h>
+
+#include <microhttpd.h>
+
+#include "compress.h"
+#include "dircache.h"
+#include "websrv.h"
+
+
+/**
+ * Maximum number of cached listings. Zero disables the cache.
+ **/
+#ifndef DIRCACHE_SIZE
+#define DIRCACHE_SIZE 32
+#endif
+
+
+/**
+ * Maximum number of bytes held by cached listings.
+ **/
+#ifndef DIRCACHE_MAX_BYTES
+#define DIRCACHE_MAX_BYTES (4 * 1024 * 1024)
+#endif
+
+
+/**
+ * Number of seconds a cached listing is used before it is rendered again.
+ * The mtime of a directory only changes when entries are added, removed or
+ * renamed, so this bounds how long changes to the size and mtime of the
+ * entries themselves may go unnoticed.
+ **/
+#ifndef DIRCACHE_TTL
+#define DIRCACHE_TTL 10
+#endif
+
+
+/**
+ * A rendered directory listing.
+ **/
+typedef struct dircache_entry {
+  char* key;
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtim;
+  time_t expires;
+
+  char* buf;
+  size_t size;
+  char* gzip;
+  size_t gzip_size;
+  unsigned int refs;
+
+  struct dircache_entry* next;
+} dircache_entry_t;
+
+
+/**
+ * Global state variables, the list is ordered from most to least recently
+ * used.
+ **/
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static dircache_entry_t* g_entry_seq = 0;
+static size_t g_entries = 0;
+static size_t g_bytes = 0;
+static unsigned long g_hits = 0;
+static unsigned long g_misses = 0;
+static unsigned long g_evictions = 0;
+
+
+/**
+ * Obtain the current time in seconds from a monotonic clock.
+ **/
+static time_t
+dircache_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec;
+}
+
+
+/**
+ * Drop a reference to an entry, and free it when there are none left.
+ * The caller must hold g_lock.
+ **/
+static void
+dircache_unref(dircache_entry_t* e) {
+  if(--e->refs) {
+    return;
+  }
+
+  free(e->key);
+  free(e->buf);
+  free(e->gzip);
+  free(e);
+}
+
+
+/**
+ * Remove the entry that follows the given link from the cache.
+ * The caller must hold g_lock.
+ **/
+static void
+dircache_unlink(dircache_entry_t** link) {
+  dircache_entry_t* e = *link;
+
+  *link = e->next;
+  g_entries--;
+  g_bytes -= e->size + e->gzip_size;
+  dircache_unref(e);
+}
+
+
+/**
+ * Release the reference held by a response once it has been sent.
+ **/
+static void
+dircache_release(void* cls) {
+  pthread_mutex_lock(&g_lock);
+  dircache_unref(cls);
+  pthread_mutex_unlock(&g_lock);
+}
+
+
+/**
+ * Create a response that serves a cached listing, gzip-compressed if the
+ * encoding asks for it and the entry has a compressed copy.
+ * The caller must hold g_lock.
+ **/
+static struct MHD_Response*
+dircache_create_response(dircache_entry_t* e, const char* encoding) {
+  bool gzip = e->gzip && encoding && !strcmp(encoding, "gzip");
+  struct MHD_Response *resp;
+
+  e->refs++;
+  if(!(resp=MHD_create_response_from_buffer_with_free_callback_cls(
+	  gzip ? e->gzip_size : e->size, gzip ? e->gzip : e->buf,
+	  &dircache_release, e))) {
+    dircache_unref(e);
+    return 0;
+  }
+
+  MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE,
+			  "application/json");
+  if(gzip) {
+    MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_ENCODING, "gzip");
+  }
+  if(e->gzip) {
+    MHD_add_response_header(resp, MHD_HTTP_HEADER_VARY,
+			    MHD_HTTP_HEADER_ACCEPT_ENCODING);
+  }
+
+  return resp;
+}
+
+
+struct MHD_Response*
+dircache_lookup(const char* key, const struct stat* st,
+		const char* encoding) {
+  struct MHD_Response *resp = 0;
+  dircache_entry_t** link;
+  dircache_entry_t* e;
+
+  if(!DIRCACHE_SIZE) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&g_lock);
+  for(link=&g_entry_seq; (e=*link); link=&e->next) {
+    if(strcmp(e->key, key)) {
+      continue;
+    }
+
+    if(e->dev != st->st_dev || e->ino != st->st_ino ||
+       e->mtim.tv_sec != st->st_mtim.tv_sec ||
+       e->mtim.tv_nsec != st->st_mtim.tv_nsec ||
+       e->expires <= dircache_now()) {
+      dircache_unlink(link);
+      break;
+    }
+
+    // move to the front of the list
+    *link = e->next;
+    e->next = g_entry_seq;
+    g_entry_seq = e;
+
+    if((resp=dircache_create_response(e, encoding))) {
+      g_hits++;
+    }
+    break;
+  }
+
+  if(!resp) {
+    g_misses++;
+  }
+  pthread_mutex_unlock(&g_lock);
+
+  return resp;
+}
+
+
+struct MHD_Response*
+dircache_insert(const char* key, const struct stat* st, char* buf,
+		size_t size, const char* encoding) {
+  struct MHD_Response *resp;
+  dircache_entry_t** link;
+  dircache_entry_t* e;
+
+  if(!DIRCACHE_SIZE || size > DIRCACHE_MAX_BYTES ||
+     !(e=calloc(1, sizeof(dircache_entry_t)))) {
+    if((resp=compress_buffer_response(encoding, buf, size))) {
+      MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE,
+			      "application/json");
+    }
+    return resp;
+  }
+
+  if(!(e->key=strdup(key))) {
+    free(e);
+    free(buf);
+    return 0;
+  }
+
+  e->dev = st->st_dev;
+  e->ino = st->st_ino;
+  e->mtim = st->st_mtim;
+  e->expires = dircache_now() + DIRCACHE_TTL;
+  e->buf = buf;
+  e->size = size;
+  e->refs = 1;
+
+  // nearly all clients accept gzip, so the compressed copy is made once
+  // rather than compressing the listing for every request that hits it
+  e->gzip = compress_buffer("gzip", buf, size, &e->gzip_size);
+
+  // the listing alone fits, keep it without the copy rather than not at all
+  if(e->gzip && size + e->gzip_size > DIRCACHE_MAX_BYTES) {
+    free(e->gzip);
+    e->gzip = 0;
+    e->gzip_size = 0;
+  }
+
+  pthread_mutex_lock(&g_lock);
+
+  // replace listings rendered concurrently by other requests
+  for(link=&g_entry_seq; *link; link=&(*link)->next) {
+    if(!strcmp((*link)->key, key)) {
+      dircache_unlink(link);
+      break;
+    }
+  }
+
+  e->next = g_entry_seq;
+  g_entry_seq = e;
+  g_entries++;
+  g_bytes += size + e->gzip_size;
+
+  // evict the least recently used listings, but never the new one at the
+  // front of the list
+  while((g_entries > DIRCACHE_SIZE || g_bytes > DIRCACHE_MAX_BYTES) &&
+	g_entry_seq->next) {
+    for(link=&g_entry_seq; (*link)->next; link=&(*link)->next);
+    dircache_unlink(link);
+    g_evictions++;
+  }
+
+  resp = dircache_create_response(e, encoding);
+  pthread_mutex_unlock(&g_lock);
+
+  return resp;
+}
+
+
+void
+dircache_invalidate(const char* path) {
+  size_t len = strlen(path);
+  dircache_entry_t** link;
+
+  while(len > 1 && path[len-1] == '/') {
+    len--;
+  }
+
+  pthread_mutex_lock(&g_lock);
+  for(link=&g_entry_seq; *link;) {
+    if(!strncmp((*link)->key, path, len) && (*link)->key[len] == '?') {
+      dircache_unlink(link);
+    } else {
+      link = &(*link)->next;
+    }
+  }
+  pthread_mutex_unlock(&g_lock);
+}
+
+
+enum MHD_Result
+dircache_request(struct MHD_Connection *conn, const char* url) {
+  enum MHD_Result ret = MHD_NO;
+  struct MHD_Response *resp;
+  char buf[256];
+  size_t size;
+
+  pthread_mutex_lock(&g_lock);
+  size = snprintf(buf, sizeof(buf), "{\"entries\": %zu, \"capacity\": %d, "
+		  "\"bytes\": %zu, \"hits\": %lu, \"misses\": %lu, "
+		  "\"evictions\": %lu}\n", g_entries, DIRCACHE_SIZE,
+		  g_bytes, g_hits, g_misses, g_evictions);
+  pthread_mutex_unlock(&g_lock);
+
+  if((resp=MHD_create_response_from_buffer(size, buf,
+					   MHD_RESPMEM_MUST_COPY))) {
+    MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE,
+                            "application/json");
+    ret = websrv_queue_response(conn, MHD_HTTP_OK, resp);
+    MHD_destroy_response(resp);
+  }
+
+  return ret;
+}
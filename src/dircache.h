@@ -0,0 +1,57 @@
+/* Copyright (C) 2026 John Törnblom
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation; either version 3, or (at your option) any
+later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; see the file COPYING. If not, see
+<http://www.gnu.org/licenses/>.  */
+
+#pragma once
+
+#include <sys/stat.h>
+
+#include <microhttpd.h>
+
+
+/**
+ * Look up a rendered directory listing. The key identifies the directory
+ * and the listing options, and the entry is only used if it was rendered
+ * from a directory with the same inode and mtime as st. Returns a response
+ * that serves the cached buffer, or NULL on a miss. Listings are also kept
+ * gzip-compressed, which is served if encoding (as negotiated with
+ * compress_negotiate()) is "gzip".
+ **/
+struct MHD_Response* dircache_lookup(const char* key, const struct stat* st,
+				     const char* encoding);
+
+
+/**
+ * Insert a rendered directory listing into the cache, and return a response
+ * that serves it with the given content coding (which may be NULL).
+ * Ownership of buf is transferred to the cache, also when NULL is returned.
+ **/
+struct MHD_Response* dircache_insert(const char* key, const struct stat* st,
+				     char* buf, size_t size,
+				     const char* encoding);
+
+
+/**
+ * Drop all cached listings of the directory at the given path, e.g., after
+ * an entry has been added to or removed from it.
+ **/
+void dircache_invalidate(const char* path);
+
+
+/**
+ * Respond with cache statistics (json).
+ **/
+enum MHD_Result dircache_request(struct MHD_Connection *conn,
+				 const char* url);
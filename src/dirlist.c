@@ -0,0 +1,343 @@
+/* Copyright (C) 2026 John Törnblom
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation; either version 3, or (at your option) any
+later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; see the file COPYING. If not, see
+<http://www.gnu.org/licenses/>.  */
+
+#include <fnmatch.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <microhttpd.h>
+
+#include "dirlist.h"
+
+
+/**
+ * Check if an entry is a directory (or a mount point).
+ **/
+static int
+dirlist_isdir(const dirlist_entry_t* e) {
+  return e->mode == 'd' || e->mode == 'm';
+}
+
+
+/**
+ * Compare two entries according to the sort options. The order is total,
+ * which keeps pagination stable across requests.
+ **/
+static int
+dirlist_compare(const dirlist_entry_t* a, const dirlist_entry_t* b,
+		const dirlist_opts_t* opts) {
+  int r = 0;
+
+  // directories go first regardless of the sort order
+  if(opts->dirsfirst && (r=dirlist_isdir(b) - dirlist_isdir(a))) {
+    return r;
+  }
+
+  switch(opts->sort) {
+  case DIRLIST_SORT_MTIME:
+    r = (a->mtime > b->mtime) - (a->mtime < b->mtime);
+    break;
+
+  case DIRLIST_SORT_SIZE:
+    r = (a->size > b->size) - (a->size < b->size);
+    break;
+
+  default:
+    break;
+  }
+
+  if(!r) {
+    r = strcasecmp(a->name, b->name);
+  }
+  if(!r) {
+    r = strcmp(a->name, b->name);
+  }
+
+  return opts->desc ? -r : r;
+}
+
+
+/**
+ * Merge sort, since qsort_r() is not portable between glibc and the BSDs.
+ **/
+static void
+dirlist_sort(dirlist_entry_t* e, dirlist_entry_t* tmp, size_t n,
+	     const dirlist_opts_t* opts) {
+  size_t mid = n / 2;
+  size_t i = 0;
+  size_t j = mid;
+  size_t k = 0;
+
+  if(n < 2) {
+    return;
+  }
+
+  dirlist_sort(e, tmp, mid, opts);
+  dirlist_sort(e + mid, tmp, n - mid, opts);
+
+  while(i < mid && j < n) {
+    if(dirlist_compare(&e[j], &e[i], opts) < 0) {
+      tmp[k++] = e[j++];
+    } else {
+      tmp[k++] = e[i++];
+    }
+  }
+  while(i < mid) {
+    tmp[k++] = e[i++];
+  }
+  while(j < n) {
+    tmp[k++] = e[j++];
+  }
+
+  memcpy(e, tmp, n * sizeof(dirlist_entry_t));
+}
+
+
+/**
+ * Parse a cursor on the form "<isdir>:<key>:<name>" into an entry that
+ * sorts at the same position as the last entry of the previous page.
+ **/
+static int
+dirlist_parse_cursor(const char* cursor, dirlist_entry_t* e) {
+  unsigned long long key;
+  int isdir;
+  int n = 0;
+
+  if(sscanf(cursor, "%d:%llu:%n", &isdir, &key, &n) != 2 || !n) {
+    return -1;
+  }
+
+  e->name = (char*)cursor + n;
+  e->mode = isdir ? 'd' : '-';
+  e->mtime = (time_t)key;
+  e->size = key;
+
+  return 0;
+}
+
+
+size_t
+dirlist_json_string(char* buf, const char* s) {
+  char* p = buf;
+
+  *p++ = '"';
+  for(; *s; s++) {
+    if(*s == '"' || *s == '\\') {
+      *p++ = '\\';
+      *p++ = *s;
+    } else if((unsigned char)*s < 0x20) {
+      p += sprintf(p, "\\u%04x", (unsigned char)*s);
+    } else {
+      *p++ = *s;
+    }
+  }
+  *p++ = '"';
+
+  return p - buf;
+}
+
+
+bool
+dirlist_parse_opts(struct MHD_Connection *conn, dirlist_opts_t* opts) {
+  bool given = false;
+  const char* s;
+
+  memset(opts, 0, sizeof(dirlist_opts_t));
+  opts->limit = SIZE_MAX;
+
+  if((s=MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "sort"))) {
+    if(!strcmp(s, "mtime")) {
+      opts->sort = DIRLIST_SORT_MTIME;
+    } else if(!strcmp(s, "size")) {
+      opts->sort = DIRLIST_SORT_SIZE;
+    }
+    given = true;
+  }
+  if((s=MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "order"))) {
+    opts->desc = !strcmp(s, "desc");
+    given = true;
+  }
+  if((s=MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND,
+				    "dirsfirst"))) {
+    opts->dirsfirst = strcmp(s, "0");
+    given = true;
+  }
+  if((s=MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "offset"))) {
+    opts->offset = strtoull(s, 0, 10);
+    opts->paginate = true;
+  }
+  if((s=MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "limit"))) {
+    opts->limit = strtoull(s, 0, 10);
+    opts->paginate = true;
+  }
+  if((s=MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "cursor"))) {
+    opts->cursor = s;
+    opts->paginate = true;
+  }
+  if((s=MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "glob"))) {
+    opts->glob = s;
+    given = true;
+  }
+  if((s=MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND,
+				    "exclude"))) {
+    opts->exclude = s;
+    given = true;
+  }
+
+  return given || opts->paginate;
+}
+
+
+bool
+dirlist_match(const dirlist_opts_t* opts, const char* name) {
+  size_t len = strlen(name);
+  const char* s;
+  size_t n;
+
+  if(opts->glob && fnmatch(opts->glob, name, 0)) {
+    return false;
+  }
+
+  // comma separated list of names
+  for(s=opts->exclude; s && *s; s+=n) {
+    s += (*s == ',');
+    n = strcspn(s, ",");
+    if(n == len && !strncmp(s, name, n)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+int
+dirlist_add(dirlist_t* dl, const char* name, char mode, time_t mtime,
+	    uint64_t size) {
+  dirlist_entry_t* e;
+  size_t capacity;
+
+  if(dl->count == dl->capacity) {
+    capacity = dl->capacity ? dl->capacity * 2 : 256;
+    if(!(e=realloc(dl->entries, capacity * sizeof(dirlist_entry_t)))) {
+      return -1;
+    }
+    dl->entries = e;
+    dl->capacity = capacity;
+  }
+
+  e = &dl->entries[dl->count];
+  if(!(e->name=strdup(name))) {
+    return -1;
+  }
+  e->mode = mode;
+  e->mtime = mtime;
+  e->size = size;
+  dl->count++;
+
+  return 0;
+}
+
+
+char*
+dirlist_render(dirlist_t* dl, const dirlist_opts_t* opts, size_t* size) {
+  dirlist_entry_t* tmp;
+  dirlist_entry_t* e;
+  char cursor[NAME_MAX + 64];
+  dirlist_entry_t c;
+  size_t first = 0;
+  size_t last = 0;
+  char* buf;
+  char* p;
+
+  if(dl->count) {
+    if(!(tmp=malloc(dl->count * sizeof(dirlist_entry_t)))) {
+      return 0;
+    }
+    dirlist_sort(dl->entries, tmp, dl->count, opts);
+    free(tmp);
+  }
+
+  // resume after the position of the cursor, even if that entry is gone
+  if(opts->cursor && !dirlist_parse_cursor(opts->cursor, &c)) {
+    while(first < dl->count &&
+	  dirlist_compare(&dl->entries[first], &c, opts) <= 0) {
+      first++;
+    }
+  }
+
+  first = (opts->offset < dl->count - first) ? first + opts->offset : dl->count;
+  last = (opts->limit < dl->count - first) ? first + opts->limit : dl->count;
+
+  *size = 128 + 6 * sizeof(cursor);
+  for(size_t i=first; i<last; i++) {
+    *size += 96 + 6 * strlen(dl->entries[i].name);
+  }
+
+  if(!(buf=p=malloc(*size))) {
+    return 0;
+  }
+
+  if(opts->paginate) {
+    p += sprintf(p, "{\"total\": %zu, \"next\": ", dl->count);
+    if(last < dl->count && last > first) {
+      e = &dl->entries[last-1];
+      snprintf(cursor, sizeof(cursor), "%d:%llu:%s", dirlist_isdir(e),
+	       opts->sort == DIRLIST_SORT_SIZE ? (unsigned long long)e->size :
+	       opts->sort == DIRLIST_SORT_MTIME ? (unsigned long long)e->mtime :
+	       0ULL, e->name);
+      p += dirlist_json_string(p, cursor);
+    } else {
+      p += sprintf(p, "null");
+    }
+    p += sprintf(p, ", \"entries\": ");
+  }
+
+  *p++ = '[';
+  for(size_t i=first; i<last; i++) {
+    e = &dl->entries[i];
+    if(i != first) {
+      *p++ = ',';
+    }
+    p += sprintf(p, "{\"name\": ");
+    p += dirlist_json_string(p, e->name);
+    p += sprintf(p, ",\"mode\": \"%c\",\"mtime\": %lld,\"size\": %llu}",
+		 e->mode, (long long)e->mtime, (unsigned long long)e->size);
+  }
+  *p++ = ']';
+
+  if(opts->paginate) {
+    *p++ = '}';
+  }
+
+  *size = p - buf;
+
+  return buf;
+}
+
+
+void
+dirlist_free(dirlist_t* dl) {
+  for(size_t i=0; i<dl->count; i++) {
+    free(dl->entries[i].name);
+  }
+  free(dl->entries);
+  memset(dl, 0, sizeof(dirlist_t));
+}
@@ -0,0 +1,110 @@
+/* Copyright (C) 2026 John Törnblom
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation; either version 3, or (at your option) any
+later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; see the file COPYING. If not, see
+<http://www.gnu.org/licenses/>.  */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <microhttpd.h>
+
+
+/**
+ * Options for sorting, filtering and paginating a directory listing,
+ * parsed from the query string of a request.
+ **/
+typedef struct dirlist_opts {
+  enum {
+    DIRLIST_SORT_NAME,
+    DIRLIST_SORT_MTIME,
+    DIRLIST_SORT_SIZE,
+  } sort;
+  bool desc;
+  bool dirsfirst;
+  bool paginate;
+  size_t offset;
+  size_t limit;
+  const char* cursor;
+  const char* glob;
+  const char* exclude;
+} dirlist_opts_t;
+
+
+/**
+ * A single entry in a directory listing.
+ **/
+typedef struct dirlist_entry {
+  char* name;
+  char mode;
+  time_t mtime;
+  uint64_t size;
+} dirlist_entry_t;
+
+
+/**
+ * A directory listing.
+ **/
+typedef struct dirlist {
+  dirlist_entry_t* entries;
+  size_t count;
+  size_t capacity;
+} dirlist_t;
+
+
+/**
+ * Parse listing options from the query string of a request. Returns true if
+ * any option was given, i.e., the listing has to be buffered and processed
+ * rather than streamed in directory order.
+ **/
+bool dirlist_parse_opts(struct MHD_Connection *conn, dirlist_opts_t* opts);
+
+
+/**
+ * Check if an entry with the given name passes the glob and exclude filters.
+ **/
+bool dirlist_match(const dirlist_opts_t* opts, const char* name);
+
+
+/**
+ * Append an entry to a listing.
+ **/
+int dirlist_add(dirlist_t* dl, const char* name, char mode, time_t mtime,
+		uint64_t size);
+
+
+/**
+ * Sort and paginate a listing, and render it as JSON into a buffer that the
+ * caller has to free. Without pagination, the result is an array of entries.
+ * With pagination (limit, offset or cursor), the result is an object on the
+ * form:
+ *
+ *   {"total": N, "next": "<cursor>"|null, "entries": [...]}
+ **/
+char* dirlist_render(dirlist_t* dl, const dirlist_opts_t* opts, size_t* size);
+
+
+/**
+ * Write a JSON string literal, and return the number of bytes written.
+ * The buffer must hold at least 6 bytes per input byte, plus 2.
+ **/
+size_t dirlist_json_string(char* buf, const char* s);
+
+
+/**
+ * Free resources held by a listing.
+ **/
+void dirlist_free(dirlist_t* dl);
@@ -16,10 +16,13 @@ along with this program; see the file COPYING. If not, see
 
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <sys/types.h>
 #include <sys/select.h>
@@ -30,8 +33,14 @@ along with this program; see the file COPYING. If not, see
 #include <microhttpd.h>
 
 
+#include "archive.h"
+#include "compress.h"
+#include "dircache.h"
+#include "dirlist.h"
 #include "fs.h"
 #include "mime.h"
+#include "range.h"
+#include "task.h"
 #include "websrv.h"
 
 
@@ -40,6 +49,16 @@ along with this program; see the file COPYING. If not, see
 #endif
 
 
+/**
+ * Serve whole files and single ranges straight from the file descriptor,
+ * so that libmicrohttpd may use sendfile(2). Build with FS_SENDFILE=0 to
+ * always read through stdio, e.g., to compare the two.
+ **/
+#ifndef FS_SENDFILE
+#define FS_SENDFILE 1
+#endif
+
+
 /**
  * File not found (404)
  **/
@@ -87,10 +106,20 @@ typedef struct dir_read_sm {
     char path[PATH_MAX];
     DIR* dir;
     dev_t dev;
+    bool stat;
   } props;
 } dir_read_sm_t;
 
 
+/**
+ * Space reserved in the output buffer for rendering a single directory
+ * entry. Entries are only read from the directory while at least this
+ * much space remains, so a rendered entry never needs to be split. Names
+ * are escaped in JSON listings, which takes up to 6 bytes per character.
+ **/
+#define DIR_ENTRY_MAX (6 * NAME_MAX + 256)
+
+
 
 /**
  * Obtain the character encoding for a file mode.
@@ -153,7 +182,64 @@ normalize_path(char *path) {
 
 
 /**
- * Read the contents of a directory, and render it as JSON.
+ * Obtain the character encoding for the file type of a directory entry,
+ * or 0 if the type is unknown.
+ **/
+static char
+dtypechar(const struct dirent *entry) {
+  switch(entry->d_type) {
+  case DT_DIR:  return 'd';
+  case DT_REG:  return '-';
+  case DT_LNK:  return 'l';
+  case DT_BLK:  return 'b';
+  case DT_CHR:  return 'c';
+  case DT_FIFO: return 'p';
+  case DT_SOCK: return 's';
+  default:      return 0;
+  }
+}
+
+
+/**
+ * Render a single directory entry as JSON. Returns -1 if the entry should
+ * be skipped.
+ **/
+static int
+dir_render_json(dir_read_sm_t* sm, struct dirent *entry, char *buf,
+		size_t max) {
+  struct stat st = {0};
+  char mode = 0;
+  char* p = buf;
+
+  // name-only listings only stat entries of unknown type
+  if(!sm->props.stat) {
+    mode = dtypechar(entry);
+  }
+  if(!mode) {
+    if(fstatat(dirfd(sm->props.dir), entry->d_name, &st, 0)) {
+      return -1;
+    }
+    mode = modechar(&st, sm->props.dev);
+  }
+
+  // the caller leaves DIR_ENTRY_MAX bytes, enough for an escaped name
+  p += sprintf(p, ",{\"name\": ");
+  p += dirlist_json_string(p, entry->d_name);
+  p += snprintf(p, max - (p - buf),
+		","\
+		"\"mode\": \"%c\","\
+		"\"mtime\": %ld,"\
+		"\"size\": %ld"\
+		"}",
+		mode, (long)st.st_mtim.tv_sec, (long)st.st_size);
+
+  return p - buf;
+}
+
+
+/**
+ * Read the contents of a directory, and render it as JSON. As many entries
+ * as fit are rendered into each buffer.
  *
  * Implemented as a state machine:
  *
@@ -164,50 +250,47 @@ static ssize_t
 dir_read_json(void *cls, uint64_t pos, char *buf, size_t max) {
   dir_read_sm_t* sm = (dir_read_sm_t*)cls;
   struct dirent *entry;
-  struct stat st;
+  size_t len = 0;
+  int n;
 
-  if(max < 512) {
+  if(max < DIR_ENTRY_MAX) {
     return 0;
   }
 
   switch(sm->state) {
   case DIR_READ_HEAD:
     sm->state = DIR_READ_BODY;
-    return snprintf(buf, max,
+    len += snprintf(buf, max,
 		    "[{"			\
 		    "\"name\": \".\","		\
 		    "\"mode\": \"d\","		\
 		    "\"mtime\": 0,"		\
 		    "\"size\": 0"		\
 		    "}");
+    // fall through
 
   case DIR_READ_BODY:
-    if(!(entry=readdir(sm->props.dir))) {
-      sm->state = DIR_READ_TAIL;
-      return 0;
-    }
-    if(!strcmp(entry->d_name, ".") ||
-       !strcmp(entry->d_name, "..")) {
-      return 0;
+    while(max - len >= DIR_ENTRY_MAX) {
+      if(!(entry=readdir(sm->props.dir))) {
+	sm->state = DIR_READ_TAIL;
+	break;
+      }
+      if(!strcmp(entry->d_name, ".") ||
+	 !strcmp(entry->d_name, "..")) {
+	continue;
+      }
+      if((n=dir_render_json(sm, entry, buf+len, max-len)) > 0) {
+	len += n;
+      }
     }
-
-    if(fstatat(dirfd(sm->props.dir), entry->d_name, &st, 0)) {
-      return 0;
+    if(sm->state != DIR_READ_TAIL || max - len < 2) {
+      return len;
     }
-
-    return snprintf(buf, max,
-		    ",{"\
-		    "\"name\": \"%s\","\
-		    "\"mode\": \"%c\","\
-		    "\"mtime\": %ld,"\
-		    "\"size\": %ld"\
-		    "}",
-		    entry->d_name, modechar(&st, sm->props.dev),
-		    st.st_mtim.tv_sec, st.st_size);
+    // fall through
 
   case DIR_READ_TAIL:
     sm->state = DIR_READ_NULL;
-    return snprintf(buf, max, "]");
+    return len + snprintf(buf+len, max-len, "]");
 
   case DIR_READ_NULL:
   default:
@@ -217,7 +300,8 @@ dir_read_json(void *cls, uint64_t pos, char *buf, size_t max) {
 
 
 /**
- * Read the contents of a directory, and render it as HTML.
+ * Read the contents of a directory, and render it as HTML. As many entries
+ * as fit are rendered into each buffer.
  *
  * Implemented as a state machine:
  *
@@ -227,10 +311,11 @@ dir_read_json(void *cls, uint64_t pos, char *buf, size_t max) {
 static ssize_t
 dir_read_html(void *cls, uint64_t pos, char *buf, size_t max) {
   dir_read_sm_t* sm = (dir_read_sm_t*)cls;
+  size_t plen = strlen(sm->props.path);
   struct dirent *entry;
-  size_t len = strlen(sm->props.path);
+  size_t len = 0;
 
-  if(max < 512) {
+  if(max < DIR_ENTRY_MAX) {
     return 0;
   }
 
@@ -249,18 +334,20 @@ dir_read_html(void *cls, uint64_t pos, char *buf, size_t max) {
 		    , sm->props.path, sm->props.path);
 
   case DIR_READ_BODY:
-    if(!(entry=readdir(sm->props.dir))) {
-      sm->state = DIR_READ_TAIL;
-      return 0;
-    }
-    if(!strcmp(entry->d_name, ".") ||
-       !strcmp(entry->d_name, "..")) {
-      return 0;
+    while(max - len >= DIR_ENTRY_MAX + NAME_MAX + plen) {
+      if(!(entry=readdir(sm->props.dir))) {
+	sm->state = DIR_READ_TAIL;
+	break;
+      }
+      if(!strcmp(entry->d_name, ".") ||
+	 !strcmp(entry->d_name, "..")) {
+	continue;
+      }
+      len += snprintf(buf+len, max-len, "<li><a href=\"/fs%s%s%s\">%s</a></li>",
+		      sm->props.path, (sm->props.path[plen - 1] == '/') ? "" : "/",
+		      entry->d_name, entry->d_name);
     }
-
-    return snprintf(buf, max, "<li><a href=\"/fs%s%s%s\">%s</a></li>",
-		    sm->props.path, (sm->props.path[len - 1] == '/') ? "" : "/",
-            entry->d_name, entry->d_name);
+    return len;
 
   case DIR_READ_TAIL:
     sm->state = DIR_READ_NULL;
@@ -284,27 +371,242 @@ dir_close(void *cls) {
 }
 
 
+/**
+ * Build the key that identifies a buffered directory listing in the cache.
+ * Strings are prefixed with their length to keep the key unambiguous.
+ **/
+static int
+dir_cache_key(char* key, size_t size, const char* path,
+	      const dirlist_opts_t* opts, bool need_stat) {
+  const char* cursor = opts->cursor ? opts->cursor : "";
+  const char* glob = opts->glob ? opts->glob : "";
+  const char* exclude = opts->exclude ? opts->exclude : "";
+  char dir[PATH_MAX];
+  size_t len;
+
+  strncpy(dir, path, sizeof(dir) - 1);
+  dir[sizeof(dir) - 1] = 0;
+  normalize_path(dir);
+
+  len = snprintf(key, size, "%s?%d:%d:%d:%d:%d:%zu:%zu:%zu:%s%zu:%s%zu:%s",
+		 dir, opts->sort, opts->desc, opts->dirsfirst, opts->paginate,
+		 need_stat, opts->offset, opts->limit, strlen(cursor), cursor,
+		 strlen(glob), glob, strlen(exclude), exclude);
+
+  return len < size ? 0 : -1;
+}
+
+
+/**
+ * State of a buffered directory listing that is rendered on a helper thread
+ * while its connection is suspended. The response is queued once the
+ * connection is resumed.
+ **/
+typedef struct dir_request_state {
+  websrv_state_t base;
+  char path[PATH_MAX];
+  struct stat dirst;
+  dirlist_opts_t opts;
+  bool need_stat;
+  const char* encoding;
+  char key[PATH_MAX * 2];
+  bool cache;
+  unsigned int status;
+  struct MHD_Response *resp;
+} dir_request_state_t;
+
+
+/**
+ * Release the state of a buffered directory listing.
+ **/
+static void
+dir_request_free(websrv_state_t* state) {
+  dir_request_state_t *st = (dir_request_state_t*)state;
+
+  if(st->resp) {
+    MHD_destroy_response(st->resp);
+  }
+  free(st);
+}
+
+
+/**
+ * Read, sort and render a buffered directory listing. Runs on a helper
+ * thread, and records the response in the request state.
+ **/
+static void
+dir_request_job(void* arg) {
+  dir_request_state_t *st = arg;
+  struct MHD_Response *resp;
+  struct dirent *entry;
+  dirlist_t dl = {0};
+  struct stat est;
+  size_t size;
+  char* buf;
+  char mode;
+  int err = 0;
+  DIR* dir;
+
+  if(!(dir=opendir(st->path))) {
+    st->status = MHD_HTTP_NOT_FOUND;
+    st->resp = MHD_create_response_from_buffer(strlen(PAGE_404), PAGE_404,
+					       MHD_RESPMEM_PERSISTENT);
+    return;
+  }
+
+  while(!err && (entry=readdir(dir))) {
+    if(!strcmp(entry->d_name, ".") ||
+       !strcmp(entry->d_name, "..")) {
+      continue;
+    }
+    if(!dirlist_match(&st->opts, entry->d_name)) {
+      continue;
+    }
+
+    memset(&est, 0, sizeof(est));
+    if(!(mode=st->need_stat ? 0 : dtypechar(entry))) {
+      if(fstatat(dirfd(dir), entry->d_name, &est, 0)) {
+	continue;
+      }
+      mode = modechar(&est, st->dirst.st_dev);
+    }
+    err = dirlist_add(&dl, entry->d_name, mode, est.st_mtim.tv_sec,
+		      est.st_size);
+  }
+
+  closedir(dir);
+
+  resp = 0;
+  if(!err && (buf=dirlist_render(&dl, &st->opts, &size))) {
+    if(st->cache) {
+      resp = dircache_insert(st->key, &st->dirst, buf, size, st->encoding);
+    } else if((resp=compress_buffer_response(st->encoding, buf, size))) {
+      MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE,
+			      "application/json");
+    }
+  }
+  dirlist_free(&dl);
+
+  if(!resp) {
+    if((resp=MHD_create_response_from_buffer(strlen(PAGE_500), PAGE_500,
+                                             MHD_RESPMEM_PERSISTENT))) {
+      MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE, "text/html");
+    }
+    st->status = MHD_HTTP_INTERNAL_SERVER_ERROR;
+    st->resp = resp;
+    return;
+  }
+
+  st->status = MHD_HTTP_OK;
+  st->resp = resp;
+}
+
+
+/**
+ * Queue the response of a buffered directory listing once its connection
+ * has been resumed.
+ **/
+static enum MHD_Result
+dir_request_resume(struct MHD_Connection *conn, websrv_state_t* state) {
+  dir_request_state_t *st = (dir_request_state_t*)state;
+  enum MHD_Result ret = MHD_NO;
+
+  if(st->resp) {
+    ret = websrv_queue_response(conn, st->status, st->resp);
+    MHD_destroy_response(st->resp);
+    st->resp = 0;
+  }
+
+  return ret;
+}
+
+
+/**
+ * Respond to a directory listing request that needs to be sorted, filtered
+ * or paginated, and therefore buffered in memory. Rendered listings are
+ * cached, since clients tend to list the same directories over and over.
+ * Listings that are not cached are rendered on a helper thread, since large
+ * directories may take a while to read and stat.
+ **/
+static enum MHD_Result
+dir_request_buffered(struct MHD_Connection *conn, const char* path,
+		     const struct stat* dirst, const dirlist_opts_t* opts,
+		     bool need_stat, websrv_state_t** state) {
+  enum MHD_Result ret = MHD_NO;
+  struct MHD_Response *resp;
+  dir_request_state_t *st;
+
+  if(!(st=calloc(1, sizeof(dir_request_state_t)))) {
+    return MHD_NO;
+  }
+
+  st->base.free_cb = dir_request_free;
+  strncpy(st->path, path, sizeof(st->path) - 1);
+  st->dirst = *dirst;
+  st->opts = *opts;
+
+  // sorting on mtime or size needs those attributes
+  st->need_stat = need_stat || opts->sort != DIRLIST_SORT_NAME;
+
+  st->encoding = compress_negotiate(conn, "application/json",
+				    MHD_SIZE_UNKNOWN);
+  st->cache = !dir_cache_key(st->key, sizeof(st->key), path, opts,
+			     st->need_stat);
+  if(st->cache && (resp=dircache_lookup(st->key, dirst, st->encoding))) {
+    free(st);
+    ret = websrv_queue_response(conn, MHD_HTTP_OK, resp);
+    MHD_destroy_response(resp);
+    return ret;
+  }
+
+  // the option strings point into the connection, which outlives the job
+  *state = &st->base;
+  if(!task_suspend(conn, dir_request_job, st)) {
+    return MHD_YES;
+  }
+
+  dir_request_job(st);
+
+  return dir_request_resume(conn, &st->base);
+}
+
+
 /**
  * Respond to a directory listing request.
  **/
 static enum MHD_Result
-dir_request(struct MHD_Connection *conn, const char* path) {
+dir_request(struct MHD_Connection *conn, const char* path,
+	    websrv_state_t** state) {
   MHD_ContentReaderCallback dir_read_cb = &dir_read_html;
   const char* mime = "text/html";
   enum MHD_Result ret = MHD_NO;
   struct MHD_Response *resp;
+  dirlist_opts_t opts;
+  const char* encoding;
   dir_read_sm_t* sm;
+  const char* archive;
   const char* fmt;
+  const char* stat_arg;
   struct stat st;
   DIR *dir = 0;
 
+  if((archive=MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND,
+					 "archive"))) {
+    return archive_request(conn, path, archive);
+  }
+
   fmt = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "fmt");
+  stat_arg = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "stat");
   if(fmt && !strcmp(fmt, "json")) {
     dir_read_cb = &dir_read_json;
     mime = "application/json";
   }
 
   if(!stat(path, &st)) {
+    if(dir_read_cb == &dir_read_json && dirlist_parse_opts(conn, &opts)) {
+      return dir_request_buffered(conn, path, &st, &opts,
+				  !stat_arg || strcmp(stat_arg, "0"), state);
+    }
     dir = opendir(path);
   }
 
@@ -331,12 +633,19 @@ dir_request(struct MHD_Connection *conn, const char* path) {
   sm->state = DIR_READ_HEAD;
   sm->props.dir = dir;
   sm->props.dev = st.st_dev;
+  sm->props.stat = !stat_arg || strcmp(stat_arg, "0");
   strncpy(sm->props.path, path, sizeof(sm->props.path));
   normalize_path(sm->props.path);
 
-  if((resp=MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 32 * PAGE_SIZE,
-					     dir_read_cb, sm,
-					     &dir_close))) {
+  if((encoding=compress_negotiate(conn, mime, MHD_SIZE_UNKNOWN))) {
+    resp = compress_create_response(0, encoding, 32 * PAGE_SIZE, dir_read_cb,
+				    sm, &dir_close);
+  } else {
+    resp = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 32 * PAGE_SIZE,
+					     dir_read_cb, sm, &dir_close);
+  }
+
+  if(resp) {
     MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE, mime);
     ret = websrv_queue_response (conn, MHD_HTTP_OK, resp);
     MHD_destroy_response(resp);
@@ -390,51 +699,105 @@ file_close(void *cls) {
 
 
 /**
- * Parse range header.
+ * Read parts of a file on disk at an absolute offset, used for
+ * multipart/byteranges responses.
  **/
-static int
-parse_range(const char* range, uint64_t size, uint64_t* start, uint64_t* end) {
-  char* p;
+static ssize_t
+file_pread(void *cls, uint64_t pos, char *buf, size_t max) {
+  int fd = (int)(intptr_t)cls;
+  ssize_t len;
+
+  while((len=pread(fd, buf, max, (off_t)pos)) < 0 && errno == EINTR);
+
+  return len;
+}
+
+
+/**
+ * Close a file on disk that was read with file_pread().
+ **/
+static void
+file_pclose(void *cls) {
+  close((int)(intptr_t)cls);
+}
 
-  // multipart ranges are not supported, serve the whole file instead
-  if(!range || strncmp("bytes=", range, 6) || strchr(range, ',')) {
-    return -1;
+
+/**
+ * Create a response that reads a file through stdio on helper threads, used
+ * when the file cannot be handed to libmicrohttpd as a raw file descriptor.
+ * Ownership of the file descriptor is transferred, also when the function
+ * fails.
+ **/
+static struct MHD_Response*
+file_create_stdio_response(struct MHD_Connection *conn, int fd,
+			   uint64_t start, uint64_t size) {
+  struct MHD_Response *resp;
+  file_read_sm_t *sm;
+
+  if(!(sm=calloc(1, sizeof(file_read_sm_t)))) {
+    close(fd);
+    return 0;
   }
-  range += 6;
 
-  // a suffix range, e.g. "-500", means the last 500 bytes
-  if(*range == '-') {
-    *end = size - 1;
-    *start = strtoull(range + 1, &p, 10);
-    if(*p) {
-      return -1;
-    }
-    if(!*start) {
-      return 1;
-    }
-    *start = (*start < size) ? size - *start : 0;
+  if(!(sm->file=fdopen(fd, "rb"))) {
+    close(fd);
+    free(sm);
     return 0;
   }
+  sm->start = start;
 
-  *start = strtoull(range, &p, 10);
-  if(*p != '-') {
-    return -1;
+  if(!(resp=task_create_response(conn, size, 32 * PAGE_SIZE, &file_read, sm,
+				 &file_close))) {
+    file_close(sm);
   }
 
-  // an absent last-pos, e.g. "500-", means the rest of the file
-  if(!*++p) {
-    *end = size - 1;
-  } else {
-    *end = strtoull(p, &p, 10);
-    if(*p) {
-      return -1;
-    }
-    if(*end >= size) {
-      *end = size - 1;
-    }
+  return resp;
+}
+
+
+/**
+ * Create a response that compresses a file while it is being read on helper
+ * threads. Ownership of the file descriptor is transferred, also when the
+ * function fails.
+ **/
+static struct MHD_Response*
+file_create_compressed_response(struct MHD_Connection *conn, int fd,
+				const char* encoding) {
+  struct MHD_Response *resp;
+  file_read_sm_t *sm;
+
+  if(!(sm=calloc(1, sizeof(file_read_sm_t)))) {
+    close(fd);
+    return 0;
+  }
+
+  if(!(sm->file=fdopen(fd, "rb"))) {
+    close(fd);
+    free(sm);
+    return 0;
+  }
+
+  if(!(resp=compress_create_response(conn, encoding, 32 * PAGE_SIZE,
+				     &file_read, sm, &file_close))) {
+    file_close(sm);
   }
 
-  return (*start > *end);
+  return resp;
+}
+
+
+/**
+ * Add cache validators for a file to a response.
+ **/
+static void
+file_add_validators(struct MHD_Response *resp, const char* etag,
+		    const struct stat* st) {
+  char date[64];
+
+  websrv_http_date(st->st_mtim.tv_sec, date, sizeof(date));
+  MHD_add_response_header(resp, MHD_HTTP_HEADER_ETAG, etag);
+  MHD_add_response_header(resp, MHD_HTTP_HEADER_LAST_MODIFIED, date);
+  MHD_add_response_header(resp, MHD_HTTP_HEADER_CACHE_CONTROL, "no-cache");
 }
 
 
@@ -446,22 +809,23 @@ file_request(struct MHD_Connection *conn, const char* path) {
   unsigned int status = MHD_HTTP_OK;
   struct MHD_Response *resp = 0;
   enum MHD_Result ret = MHD_NO;
-  file_read_sm_t *sm = 0;
+  const char* encoding = 0;
   const char* range = 0;
   const char* mime = 0;
-  uint64_t start = 0;
+  range_t ranges[RANGE_MAX];
   uint64_t size = 0;
-  uint64_t end = 0;
   struct stat st;
-  FILE *file = 0;
+  char etag[128];
   char buf[128];
+  int nranges;
+  int fd = -1;
 
-  if(!stat(path, &st)) {
-    mime = mime_get_type(path);
-    file = fopen(path, "rb");
+  if((fd=open(path, O_RDONLY)) >= 0 && fstat(fd, &st)) {
+    close(fd);
+    fd = -1;
   }
 
-  if(!file) {
+  if(fd < 0) {
     if((resp=MHD_create_response_from_buffer(strlen(PAGE_404), PAGE_404,
 					     MHD_RESPMEM_PERSISTENT))) {
       ret = websrv_queue_response(conn, MHD_HTTP_NOT_FOUND, resp);
@@ -470,35 +834,59 @@ file_request(struct MHD_Connection *conn, const char* path) {
     return ret;
   }
 
+  if(!(mime=mime_get_type(path))) {
+    mime = mime_sniff(fd, &st);
+  }
   size = (uint64_t)st.st_size;
 
+  // ranges refer to the file as stored, so range requests are not compressed
+  range = MHD_lookup_connection_value(conn, MHD_HEADER_KIND,
+				      MHD_HTTP_HEADER_RANGE);
+  if(!range) {
+    encoding = compress_negotiate(conn, mime, size);
+  }
+
+  // weak, since the content may change within the mtime resolution, and
+  // distinct for each content coding
+  snprintf(etag, sizeof(etag), "W/\"%llx-%llx-%llx.%lx%s%s\"",
+	   (unsigned long long)st.st_ino, (unsigned long long)st.st_size,
+	   (unsigned long long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec,
+	   encoding ? "-" : "", encoding ? encoding : "");
+
+  if(websrv_not_modified(conn, etag, st.st_mtim.tv_sec)) {
+    close(fd);
+    if((resp=MHD_create_response_from_buffer(0, "", MHD_RESPMEM_PERSISTENT))) {
+      file_add_validators(resp, etag, &st);
+      ret = websrv_queue_response(conn, MHD_HTTP_NOT_MODIFIED, resp);
+      MHD_destroy_response(resp);
+    }
+    return ret;
+  }
+
   // empty file, nothing to range over
   if(!size) {
-    fclose(file);
+    close(fd);
     if((resp=MHD_create_response_from_buffer(0, "", MHD_RESPMEM_PERSISTENT))) {
       if(mime) {
 	MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE, mime);
       }
       MHD_add_response_header(resp, MHD_HTTP_HEADER_ACCEPT_RANGES, "bytes");
+      file_add_validators(resp, etag, &st);
       ret = websrv_queue_response(conn, MHD_HTTP_OK, resp);
       MHD_destroy_response(resp);
     }
     return ret;
   }
 
-  end = size - 1;
-  range = MHD_lookup_connection_value(conn, MHD_HEADER_KIND,
-				      MHD_HTTP_HEADER_RANGE);
-
-  switch(parse_range(range, size, &start, &end)) {
-  case 0:
-    status = MHD_HTTP_PARTIAL_CONTENT;
-    break;
+  if(range && !websrv_if_range(conn, etag, st.st_mtim.tv_sec)) {
+    range = 0;
+  }
 
-  case 1: // unsatisfiable
-    fclose(file);
+  switch((nranges=range_parse(range, size, ranges))) {
+  case 0: // unsatisfiable
+    close(fd);
     if((resp=MHD_create_response_from_buffer(0, "", MHD_RESPMEM_PERSISTENT))) {
-      snprintf(buf, sizeof(buf), "bytes */%ld", size);
+      snprintf(buf, sizeof(buf), "bytes */%llu", (unsigned long long)size);
       MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_RANGE, buf);
       MHD_add_response_header(resp, MHD_HTTP_HEADER_ACCEPT_RANGES, "bytes");
       ret = websrv_queue_response(conn, MHD_HTTP_RANGE_NOT_SATISFIABLE, resp);
@@ -506,14 +894,39 @@ file_request(struct MHD_Connection *conn, const char* path) {
     }
     return ret;
 
-  default: // no (usable) range header, serve the whole file
-    start = 0;
-    end = size - 1;
+  case -1: // no (usable) range header, serve the whole file
+    ranges[0].start = 0;
+    ranges[0].end = size - 1;
+    break;
+
+  default:
+    status = MHD_HTTP_PARTIAL_CONTENT;
     break;
   }
 
-  if(!(sm=calloc(1, sizeof(file_read_sm_t)))) {
-    fclose(file);
+  // Several ranges are streamed as multipart/byteranges, and compressed or
+  // multipart bodies are produced on helper threads. Otherwise, let
+  // libmicrohttpd send straight from the file descriptor, which allows
+  // it to use sendfile(2). It falls back on pread(2) by itself for
+  // filesystems that do not support sendfile, and we fall back on stdio
+  // if the fd response cannot be created at all.
+  if(encoding) {
+    resp = file_create_compressed_response(conn, fd, encoding);
+  } else if(nranges > 1) {
+    resp = range_create_multipart_response(conn, ranges, nranges, size, mime,
+					   &file_pread, (void*)(intptr_t)fd,
+					   &file_pclose);
+    if(!resp) {
+      close(fd);
+    }
+    mime = 0; // carried by each part instead
+  } else if(!FS_SENDFILE || !(resp=MHD_create_response_from_fd_at_offset64(
+		ranges[0].end - ranges[0].start + 1, fd, ranges[0].start))) {
+    resp = file_create_stdio_response(conn, fd, ranges[0].start,
+				      ranges[0].end - ranges[0].start + 1);
+  }
+
+  if(!resp) {
     if((resp=MHD_create_response_from_buffer(strlen(PAGE_500), PAGE_500,
                                              MHD_RESPMEM_PERSISTENT))) {
       MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE, "text/html");
@@ -523,42 +936,43 @@ file_request(struct MHD_Connection *conn, const char* path) {
     return ret;
   }
 
-  sm->file = file;
-  sm->start = start;
-
-  if((resp=MHD_create_response_from_callback(end - start + 1, 32 * PAGE_SIZE,
-					     &file_read, sm, &file_close))) {
-    if(mime) {
-      MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE, mime);
-    }
-
-    MHD_add_response_header(resp, MHD_HTTP_HEADER_ACCEPT_RANGES, "bytes");
-    if(status == MHD_HTTP_PARTIAL_CONTENT) {
-      snprintf(buf, sizeof(buf), "bytes %ld-%ld/%ld", start, end, size);
-      MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_RANGE, buf);
-    }
+  if(mime) {
+    MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE, mime);
+  }
 
-    ret = websrv_queue_response(conn, status, resp);
-    MHD_destroy_response(resp);
-    return ret;
+  MHD_add_response_header(resp, MHD_HTTP_HEADER_ACCEPT_RANGES, "bytes");
+  file_add_validators(resp, etag, &st);
+  if(!encoding && compress_mime(mime)) {
+    MHD_add_response_header(resp, MHD_HTTP_HEADER_VARY,
+			    MHD_HTTP_HEADER_ACCEPT_ENCODING);
+  }
+  if(nranges == 1) {
+    range_content_range(&ranges[0], size, buf, sizeof(buf));
+    MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_RANGE, buf);
   }
 
-  fclose(file);
-  free(sm);
+  ret = websrv_queue_response(conn, status, resp);
+  MHD_destroy_response(resp);
 
-  return MHD_NO;
+  return ret;
 }
 
 
 enum MHD_Result
-fs_request(struct MHD_Connection *conn, const char* url) {
+fs_request(struct MHD_Connection *conn, const char* url,
+	   websrv_state_t** state) {
   enum MHD_Result ret = MHD_NO;
   struct MHD_Response *resp;
   const char* path = url+3;
   struct stat st = {0};
 
+  // resumed after a directory listing was rendered on a helper thread
+  if(*state) {
+    return dir_request_resume(conn, *state);
+  }
+
   if(!strlen(path)) {
-    return dir_request(conn, "/");
+    return dir_request(conn, "/", state);
   }
 
   if(stat(path, &st)) {
@@ -571,7 +985,7 @@ fs_request(struct MHD_Connection *conn, const char* url) {
   }
 
   if(S_ISDIR(st.st_mode)) {
-    return dir_request(conn, path);
+    return dir_request(conn, path, state);
   } else {
     return file_request(conn, path);
   }
@@ -18,12 +18,14 @@ along with this program; see the file COPYING. If not, see
 
 #include <microhttpd.h>
 
+#include "websrv.h"
+
 
 /**
  * Respond to a file system request.
  **/
 enum MHD_Result fs_request(struct MHD_Connection *conn,
-			   const char* url);
+			   const char* url, websrv_state_t** state);
 
 
 /**
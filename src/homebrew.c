@@ -0,0 +1,825 @@
+/* Copyright (C) 2026 John Törnblom
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation; either version 3, or (at your option) any
+later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; see the file COPYING. If not, see
+<http://www.gnu.org/licenses/>.  */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include <microhttpd.h>
+
+#include "dirlist.h"
+#include "homebrew.h"
+#include "task.h"
+#include "websrv.h"
+
+
+/**
+ * Maximum number of bytes held by cached icons.
+ **/
+#ifndef HOMEBREW_ICON_CACHE_BYTES
+#define HOMEBREW_ICON_CACHE_BYTES (8 * 1024 * 1024)
+#endif
+
+
+/**
+ * Icons larger than this are left out of batched responses.
+ **/
+#ifndef HOMEBREW_ICON_MAX_SIZE
+#define HOMEBREW_ICON_MAX_SIZE (1024 * 1024)
+#endif
+
+
+/**
+ * Maximum number of icons in a batched response.
+ **/
+#ifndef HOMEBREW_ICONS_MAX
+#define HOMEBREW_ICONS_MAX 256
+#endif
+
+
+/**
+ * Bad Request (400)
+ **/
+#define PAGE_400                          \
+  "<html>"                                \
+  "  <head>"                              \
+  "    <title>Bad request</title>"        \
+  "  </head>"                             \
+  "  <body>Bad request</body>"            \
+  "</html>"
+
+
+/**
+ * Name of the file that marks a homebrew as a javascript extension.
+ **/
+#define HOMEBREW_JS "homebrew.js"
+
+
+/**
+ * Location of the icon of a homebrew, relative to its folder.
+ **/
+#define HOMEBREW_ICON "sce_sys/icon0.png"
+
+
+/**
+ * Names of launchable executables, in order of preference, i.e., if both
+ * homebrew.js and eboot.elf exist, homebrew.js is used.
+ **/
+static const char* g_exec_names[] = {
+  HOMEBREW_JS,
+  "eboot.elf",
+  0
+};
+
+
+/**
+ * A subfolder of an auto-scan folder, along with the identity and mtime of
+ * the folder when it was last scanned. Executables are only added, removed
+ * or renamed by changing the folder, so the scan is not repeated as long as
+ * its mtime remains the same.
+ **/
+typedef struct homebrew_entry {
+  char* name;
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtim;
+  const char* exec;
+  bool has_js;
+
+  struct homebrew_entry* next;
+} homebrew_entry_t;
+
+
+/**
+ * A folder that is scanned for homebrew, along with its subfolders, sorted
+ * by name.
+ **/
+typedef struct homebrew_root {
+  const char* path;
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtim;
+  homebrew_entry_t* entry_seq;
+} homebrew_root_t;
+
+
+/**
+ * Folders that are scanned for homebrew.
+ **/
+static homebrew_root_t g_roots[] = {
+  {"/data/homebrew"},
+  {"/mnt/usb0/homebrew"},
+  {"/mnt/usb1/homebrew"},
+  {"/mnt/usb2/homebrew"},
+  {"/mnt/usb3/homebrew"},
+  {"/mnt/usb4/homebrew"},
+  {"/mnt/usb5/homebrew"},
+  {"/mnt/usb6/homebrew"},
+  {"/mnt/ext0/homebrew"},
+  {"/mnt/ext1/homebrew"},
+};
+
+
+/**
+ * The content of an icon, along with the identity, size and mtime of the
+ * file it was read from.
+ **/
+typedef struct homebrew_icon {
+  char* path;
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtim;
+  size_t size;
+  uint8_t* data;
+
+  struct homebrew_icon* next;
+} homebrew_icon_t;
+
+
+/**
+ * Icons requested by a client, parsed from the query string.
+ **/
+typedef struct homebrew_icons_args {
+  const char* paths[HOMEBREW_ICONS_MAX];
+  struct stat st[HOMEBREW_ICONS_MAX];
+  size_t count;
+  bool overflow;
+} homebrew_icons_args_t;
+
+
+/**
+ * State of a request that is served on a helper thread while its connection
+ * is suspended. The response is queued once the connection is resumed.
+ **/
+typedef struct homebrew_request_state {
+  websrv_state_t base;
+  struct MHD_Connection *conn;
+  homebrew_icons_args_t* args;
+  unsigned int status;
+  struct MHD_Response *resp;
+} homebrew_request_state_t;
+
+
+/**
+ * Cached icons, ordered from most to least recently used.
+ **/
+static homebrew_icon_t* g_icon_seq = 0;
+static size_t g_icon_bytes = 0;
+
+
+/**
+ * Lock protecting the icon cache above. Icons are read from disk without
+ * holding it.
+ **/
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * Lock serializing refreshes of the index, which scan the file system and
+ * therefore only happen on helper threads.
+ **/
+static pthread_mutex_t g_index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * Check if a file was last seen with the given identity and mtime.
+ **/
+static bool
+homebrew_unchanged(const struct stat* st, dev_t dev, ino_t ino,
+		   const struct timespec* mtim) {
+  return st->st_dev == dev && st->st_ino == ino &&
+    st->st_mtim.tv_sec == mtim->tv_sec &&
+    st->st_mtim.tv_nsec == mtim->tv_nsec;
+}
+
+
+/**
+ * Free a list of entries.
+ **/
+static void
+homebrew_free(homebrew_entry_t* e) {
+  homebrew_entry_t* next;
+
+  for(; e; e=next) {
+    next = e->next;
+    free(e->name);
+    free(e);
+  }
+}
+
+
+/**
+ * Rebuild the list of subfolders of an auto-scan folder. Entries of
+ * subfolders that remain are kept, so that they are not scanned again.
+ **/
+static void
+homebrew_scan_root(homebrew_root_t* root) {
+  homebrew_entry_t* seq = 0;
+  homebrew_entry_t** link;
+  homebrew_entry_t* e;
+  struct dirent* ent;
+  DIR* dir;
+
+  if(!(dir=opendir(root->path))) {
+    homebrew_free(root->entry_seq);
+    root->entry_seq = 0;
+    return;
+  }
+
+  while((ent=readdir(dir))) {
+    if(ent->d_name[0] == '.') {
+      continue;
+    }
+    if(ent->d_type != DT_DIR && ent->d_type != DT_UNKNOWN) {
+      continue;
+    }
+
+    for(link=&root->entry_seq; (e=*link); link=&e->next) {
+      if(!strcmp(e->name, ent->d_name)) {
+	*link = e->next;
+	break;
+      }
+    }
+    if(!e) {
+      if(!(e=calloc(1, sizeof(homebrew_entry_t)))) {
+	continue;
+      }
+      if(!(e->name=strdup(ent->d_name))) {
+	free(e);
+	continue;
+      }
+    }
+
+    for(link=&seq; *link && strcmp((*link)->name, e->name) < 0;
+	link=&(*link)->next) {
+    }
+    e->next = *link;
+    *link = e;
+  }
+  closedir(dir);
+
+  homebrew_free(root->entry_seq);
+  root->entry_seq = seq;
+}
+
+
+/**
+ * Look for executables in a subfolder, unless it is unchanged since the
+ * last time.
+ **/
+static void
+homebrew_scan_entry(homebrew_root_t* root, homebrew_entry_t* e) {
+  char path[PATH_MAX];
+  struct stat st;
+  int len;
+
+  len = snprintf(path, sizeof(path), "%s/%s/", root->path, e->name);
+  if(len < 0 || len >= sizeof(path) || stat(path, &st) ||
+     !S_ISDIR(st.st_mode)) {
+    e->exec = 0;
+    e->has_js = false;
+    e->ino = 0;
+    return;
+  }
+
+  if(homebrew_unchanged(&st, e->dev, e->ino, &e->mtim)) {
+    return;
+  }
+
+  e->dev = st.st_dev;
+  e->ino = st.st_ino;
+  e->mtim = st.st_mtim;
+  e->exec = 0;
+  e->has_js = false;
+
+  for(int i=0; g_exec_names[i]; i++) {
+    if(snprintf(path + len, sizeof(path) - len, "%s", g_exec_names[i]) >=
+       sizeof(path) - len || stat(path, &st)) {
+      continue;
+    }
+    if(!e->exec) {
+      e->exec = g_exec_names[i];
+    }
+    if(!strcmp(g_exec_names[i], HOMEBREW_JS)) {
+      e->has_js = true;
+    }
+  }
+}
+
+
+/**
+ * Bring the index up to date with the file system.
+ **/
+static void
+homebrew_refresh(void) {
+  homebrew_root_t* root;
+  struct stat st;
+
+  for(size_t i=0; i<sizeof(g_roots)/sizeof(g_roots[0]); i++) {
+    root = &g_roots[i];
+
+    // e.g., an unplugged USB drive
+    if(stat(root->path, &st) || !S_ISDIR(st.st_mode)) {
+      homebrew_free(root->entry_seq);
+      root->entry_seq = 0;
+      root->ino = 0;
+      continue;
+    }
+
+    if(!homebrew_unchanged(&st, root->dev, root->ino, &root->mtim)) {
+      root->dev = st.st_dev;
+      root->ino = st.st_ino;
+      root->mtim = st.st_mtim;
+      homebrew_scan_root(root);
+    }
+
+    for(homebrew_entry_t* e=root->entry_seq; e; e=e->next) {
+      homebrew_scan_entry(root, e);
+    }
+  }
+}
+
+
+/**
+ * Render an entry of the index as a JSON object, and return the number of
+ * bytes written. The icon is checked every time, since it may be rewritten
+ * in place without changing the mtime of its folder.
+ **/
+static size_t
+homebrew_render_entry(char* buf, homebrew_root_t* root, homebrew_entry_t* e) {
+  char path[PATH_MAX];
+  char etag[128];
+  struct stat st;
+  char* p = buf;
+
+  snprintf(path, sizeof(path), "%s/%s", root->path, e->name);
+  p += sprintf(p, "{\"dir\": ");
+  p += dirlist_json_string(p, path);
+
+  p += sprintf(p, ", \"exec\": ");
+  p += dirlist_json_string(p, e->exec);
+
+  snprintf(path, sizeof(path), "%s/%s/%s", root->path, e->name, e->exec);
+  p += sprintf(p, ", \"path\": ");
+  p += dirlist_json_string(p, path);
+
+  p += sprintf(p, ", \"homebrew_js\": %s", e->has_js ? "true" : "false");
+
+  snprintf(path, sizeof(path), "%s/%s/%s", root->path, e->name,
+	   HOMEBREW_ICON);
+  if(stat(path, &st) || !S_ISREG(st.st_mode)) {
+    p += sprintf(p, ", \"icon\": null, \"icon_etag\": null}");
+    return p - buf;
+  }
+
+  // same as the ETag that file_request() sends for the icon
+  snprintf(etag, sizeof(etag), "W/\"%llx-%llx-%llx.%lx\"",
+	   (unsigned long long)st.st_ino, (unsigned long long)st.st_size,
+	   (unsigned long long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec);
+
+  p += sprintf(p, ", \"icon\": ");
+  p += dirlist_json_string(p, path);
+  p += sprintf(p, ", \"icon_etag\": ");
+  p += dirlist_json_string(p, etag);
+  *p++ = '}';
+
+  return p - buf;
+}
+
+
+/**
+ * Release the state of a request.
+ **/
+static void
+homebrew_request_free(websrv_state_t* state) {
+  homebrew_request_state_t *st = (homebrew_request_state_t*)state;
+
+  if(st->resp) {
+    MHD_destroy_response(st->resp);
+  }
+  free(st->args);
+  free(st);
+}
+
+
+/**
+ * Queue the response of a request once its connection has been resumed.
+ **/
+static enum MHD_Result
+homebrew_respond(struct MHD_Connection *conn, websrv_state_t* state) {
+  homebrew_request_state_t *st = (homebrew_request_state_t*)state;
+  enum MHD_Result ret = MHD_NO;
+
+  if(st->resp) {
+    ret = websrv_queue_response(conn, st->status, st->resp);
+    MHD_destroy_response(st->resp);
+    st->resp = 0;
+  }
+
+  return ret;
+}
+
+
+/**
+ * Run a request on a helper thread, and suspend its connection until the
+ * response is ready. If no helper is available, the request is run on the
+ * calling thread instead.
+ **/
+static enum MHD_Result
+homebrew_suspend(struct MHD_Connection *conn, homebrew_icons_args_t* args,
+		 task_fn_t* fn, websrv_state_t** state) {
+  homebrew_request_state_t *st;
+
+  if(!(st=calloc(1, sizeof(homebrew_request_state_t)))) {
+    free(args);
+    return MHD_NO;
+  }
+
+  st->base.free_cb = homebrew_request_free;
+  st->conn = conn;
+  st->args = args;
+  *state = &st->base;
+
+  if(!task_suspend(conn, fn, st)) {
+    return MHD_YES;
+  }
+
+  fn(st);
+
+  return homebrew_respond(conn, &st->base);
+}
+
+
+/**
+ * Refresh and render the index. Runs on a helper thread, and records the
+ * response in the request state.
+ **/
+static void
+homebrew_index_job(void* arg) {
+  homebrew_request_state_t *st = arg;
+  unsigned int status = MHD_HTTP_OK;
+  struct MHD_Response *resp;
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  homebrew_entry_t* e;
+  size_t size = 4;
+  char etag[32];
+  char* buf;
+  char* p;
+
+  pthread_mutex_lock(&g_index_lock);
+  homebrew_refresh();
+
+  for(size_t i=0; i<sizeof(g_roots)/sizeof(g_roots[0]); i++) {
+    for(e=g_roots[i].entry_seq; e; e=e->next) {
+      size += 6 * (3 * (strlen(g_roots[i].path) + strlen(e->name)) + 128) +
+	128;
+    }
+  }
+  if(!(buf=malloc(size))) {
+    pthread_mutex_unlock(&g_index_lock);
+    return;
+  }
+
+  p = buf;
+  *p++ = '[';
+  for(size_t i=0; i<sizeof(g_roots)/sizeof(g_roots[0]); i++) {
+    for(e=g_roots[i].entry_seq; e; e=e->next) {
+      if(!e->exec) {
+	continue;
+      }
+      if(p > buf + 1) {
+	*p++ = ',';
+      }
+      p += homebrew_render_entry(p, &g_roots[i], e);
+    }
+  }
+  *p++ = ']';
+  *p++ = '\n';
+  pthread_mutex_unlock(&g_index_lock);
+
+  // FNV-1a of the document, so that unchanged indices can be revalidated
+  for(char* s=buf; s<p; s++) {
+    hash = (hash ^ (uint8_t)*s) * 0x100000001b3ULL;
+  }
+  snprintf(etag, sizeof(etag), "\"%016llx\"", (unsigned long long)hash);
+
+  if(websrv_not_modified(st->conn, etag, -1)) {
+    status = MHD_HTTP_NOT_MODIFIED;
+    free(buf);
+    resp = MHD_create_response_from_buffer(0, "", MHD_RESPMEM_PERSISTENT);
+  } else if(!(resp=MHD_create_response_from_buffer(p - buf, buf,
+						    MHD_RESPMEM_MUST_FREE))) {
+    free(buf);
+  }
+
+  if(resp) {
+    MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE,
+			    "application/json");
+    MHD_add_response_header(resp, MHD_HTTP_HEADER_CACHE_CONTROL, "no-cache");
+    MHD_add_response_header(resp, MHD_HTTP_HEADER_ETAG, etag);
+  }
+
+  st->status = status;
+  st->resp = resp;
+}
+
+
+enum MHD_Result
+homebrew_index_request(struct MHD_Connection *conn, const char* url,
+		       websrv_state_t** state) {
+  if(*state) {
+    return homebrew_respond(conn, *state);
+  }
+
+  return homebrew_suspend(conn, 0, homebrew_index_job, state);
+}
+
+
+/**
+ * Collect the path arguments of a batched icon request.
+ **/
+static enum MHD_Result
+homebrew_icons_arg(void *cls, enum MHD_ValueKind kind, const char *key,
+		   const char *value) {
+  homebrew_icons_args_t* args = cls;
+
+  if(strcmp(key, "path")) {
+    return MHD_YES;
+  }
+  if(args->count >= HOMEBREW_ICONS_MAX) {
+    args->overflow = true;
+    return MHD_NO;
+  }
+
+  args->paths[args->count++] = value ? value : "";
+
+  return MHD_YES;
+}
+
+
+/**
+ * Copy the content of an icon into buf if it is in the cache. Returns the
+ * number of bytes copied, or 0 if the icon is not cached. The caller must
+ * hold g_lock.
+ **/
+static size_t
+homebrew_icon_lookup(const char* path, const struct stat* st, uint8_t* buf) {
+  homebrew_icon_t** link;
+  homebrew_icon_t* icon;
+
+  for(link=&g_icon_seq; (icon=*link); link=&icon->next) {
+    if(!strcmp(icon->path, path) && icon->size == st->st_size &&
+       homebrew_unchanged(st, icon->dev, icon->ino, &icon->mtim)) {
+      *link = icon->next;
+      icon->next = g_icon_seq;
+      g_icon_seq = icon;
+      memcpy(buf, icon->data, icon->size);
+      return icon->size;
+    }
+  }
+
+  return 0;
+}
+
+
+/**
+ * Add an icon that was read from the file system to the cache. The caller
+ * must hold g_lock.
+ **/
+static void
+homebrew_icon_insert(const char* path, const struct stat* st,
+		     const uint8_t* buf, size_t len) {
+  homebrew_icon_t** link;
+  homebrew_icon_t* icon;
+
+  // drop stale copies of the icon, and the least recently used ones until
+  // there is room for it
+  for(link=&g_icon_seq; (icon=*link); ) {
+    if(!strcmp(icon->path, path)) {
+      *link = icon->next;
+      g_icon_bytes -= icon->size;
+      free(icon->path);
+      free(icon->data);
+      free(icon);
+    } else {
+      link = &icon->next;
+    }
+  }
+  while(g_icon_seq && g_icon_bytes + len > HOMEBREW_ICON_CACHE_BYTES) {
+    for(link=&g_icon_seq; (*link)->next; link=&(*link)->next) {
+    }
+    icon = *link;
+    *link = 0;
+    g_icon_bytes -= icon->size;
+    free(icon->path);
+    free(icon->data);
+    free(icon);
+  }
+  if(g_icon_bytes + len > HOMEBREW_ICON_CACHE_BYTES) {
+    return;
+  }
+
+  if(!(icon=calloc(1, sizeof(homebrew_icon_t)))) {
+    return;
+  }
+  if(!(icon->path=strdup(path)) || !(icon->data=malloc(len))) {
+    free(icon->path);
+    free(icon);
+    return;
+  }
+
+  memcpy(icon->data, buf, len);
+  icon->size = len;
+  icon->dev = st->st_dev;
+  icon->ino = st->st_ino;
+  icon->mtim = st->st_mtim;
+  icon->next = g_icon_seq;
+  g_icon_seq = icon;
+  g_icon_bytes += len;
+}
+
+
+/**
+ * Copy the content of an icon into buf, either from the cache or from the
+ * file system, in which case it is also added to the cache. Returns the
+ * number of bytes copied, or 0 if the icon could not be read. The file is
+ * read without holding g_lock.
+ **/
+static size_t
+homebrew_icon_load(const char* path, const struct stat* st, uint8_t* buf) {
+  ssize_t len;
+  int fd;
+
+  pthread_mutex_lock(&g_lock);
+  len = homebrew_icon_lookup(path, st, buf);
+  pthread_mutex_unlock(&g_lock);
+  if(len) {
+    return len;
+  }
+
+  if((fd=open(path, O_RDONLY)) < 0) {
+    return 0;
+  }
+  len = pread(fd, buf, st->st_size, 0);
+  close(fd);
+  if(len != st->st_size) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&g_lock);
+  homebrew_icon_insert(path, st, buf, len);
+  pthread_mutex_unlock(&g_lock);
+
+  return len;
+}
+
+
+/**
+ * Store a 32-bit little-endian integer.
+ **/
+static void
+homebrew_put_u32(uint8_t* p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+
+/**
+ * Stat and read the requested icons. Runs on a helper thread, and records
+ * the response in the request state.
+ **/
+static void
+homebrew_icons_job(void* arg) {
+  homebrew_request_state_t *rst = arg;
+  homebrew_icons_args_t* args = rst->args;
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  struct stat* st = args->st;
+  struct MHD_Response *resp;
+  size_t size;
+  size_t off;
+  size_t len;
+  char etag[32];
+  uint8_t* buf;
+
+  // the blob starts with the number of icons, followed by the offset and
+  // size of each icon, where a size of zero means that it is unavailable
+  size = 4 + 8 * args->count;
+  for(size_t i=0; i<args->count; i++) {
+    if(args->paths[i][0] != '/' || stat(args->paths[i], &st[i]) ||
+       !S_ISREG(st[i].st_mode) ||
+       st[i].st_size > HOMEBREW_ICON_MAX_SIZE) {
+      st[i].st_size = 0;
+      st[i].st_ino = 0;
+      st[i].st_mtim.tv_sec = 0;
+      st[i].st_mtim.tv_nsec = 0;
+    }
+    size += st[i].st_size;
+
+    // the ETag is derived from the validators of the icons, so that
+    // unchanged icons are revalidated without being read
+    for(const char* s=args->paths[i]; *s; s++) {
+      hash = (hash ^ (uint8_t)*s) * 0x100000001b3ULL;
+    }
+    hash = (hash ^ st[i].st_ino) * 0x100000001b3ULL;
+    hash = (hash ^ st[i].st_size) * 0x100000001b3ULL;
+    hash = (hash ^ st[i].st_mtim.tv_sec) * 0x100000001b3ULL;
+    hash = (hash ^ st[i].st_mtim.tv_nsec) * 0x100000001b3ULL;
+  }
+  snprintf(etag, sizeof(etag), "W/\"%016llx\"", (unsigned long long)hash);
+
+  if(websrv_not_modified(rst->conn, etag, -1)) {
+    if((resp=MHD_create_response_from_buffer(0, "", MHD_RESPMEM_PERSISTENT))) {
+      MHD_add_response_header(resp, MHD_HTTP_HEADER_ETAG, etag);
+      MHD_add_response_header(resp, MHD_HTTP_HEADER_CACHE_CONTROL,
+			      "no-cache");
+    }
+    rst->status = MHD_HTTP_NOT_MODIFIED;
+    rst->resp = resp;
+    return;
+  }
+
+  if(!(buf=malloc(size))) {
+    return;
+  }
+
+  homebrew_put_u32(buf, args->count);
+  off = 4 + 8 * args->count;
+
+  for(size_t i=0; i<args->count; i++) {
+    len = st[i].st_size ? homebrew_icon_load(args->paths[i], &st[i],
+					     buf + off) : 0;
+    homebrew_put_u32(buf + 4 + 8 * i, off);
+    homebrew_put_u32(buf + 8 + 8 * i, len);
+    off += len;
+  }
+
+  if(!(resp=MHD_create_response_from_buffer(off, buf,
+					    MHD_RESPMEM_MUST_FREE))) {
+    free(buf);
+    return;
+  }
+
+  MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE,
+			  "application/octet-stream");
+  MHD_add_response_header(resp, MHD_HTTP_HEADER_CACHE_CONTROL, "no-cache");
+  MHD_add_response_header(resp, MHD_HTTP_HEADER_ETAG, etag);
+  rst->status = MHD_HTTP_OK;
+  rst->resp = resp;
+}
+
+
+enum MHD_Result
+homebrew_icons_request(struct MHD_Connection *conn, const char* url,
+		       websrv_state_t** state) {
+  enum MHD_Result ret = MHD_NO;
+  homebrew_icons_args_t* args;
+  struct MHD_Response *resp;
+
+  if(*state) {
+    return homebrew_respond(conn, *state);
+  }
+
+  if(!(args=calloc(1, sizeof(homebrew_icons_args_t)))) {
+    return MHD_NO;
+  }
+
+  MHD_get_connection_values(conn, MHD_GET_ARGUMENT_KIND, &homebrew_icons_arg,
+			    args);
+  if(!args->count || args->overflow) {
+    free(args);
+    if((resp=MHD_create_response_from_buffer(strlen(PAGE_400), PAGE_400,
+					     MHD_RESPMEM_PERSISTENT))) {
+      MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE, "text/html");
+      ret = websrv_queue_response(conn, MHD_HTTP_BAD_REQUEST, resp);
+      MHD_destroy_response(resp);
+    }
+    return ret;
+  }
+
+  // the path arguments point into the connection, which outlives the job
+  return homebrew_suspend(conn, args, homebrew_icons_job, state);
+}
@@ -0,0 +1,42 @@
+/* Copyright (C) 2026 John Törnblom
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation; either version 3, or (at your option) any
+later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; see the file COPYING. If not, see
+<http://www.gnu.org/licenses/>.  */
+
+#pragma once
+
+#include <microhttpd.h>
+
+#include "websrv.h"
+
+
+/**
+ * Respond with an index of the homebrew found in the auto-scan folders
+ * (json), i.e., one entry per subfolder that holds a launchable executable.
+ **/
+enum MHD_Result homebrew_index_request(struct MHD_Connection *conn,
+				       const char* url,
+				       websrv_state_t** state);
+
+
+/**
+ * Respond with the content of several icons, given as path arguments in the
+ * query string, packed into a single binary blob. The blob starts with a
+ * table of little-endian 32-bit integers: the number of icons, followed by
+ * the offset and size of each icon in the order they were requested. Icons
+ * that could not be read have a size of zero.
+ **/
+enum MHD_Result homebrew_icons_request(struct MHD_Connection *conn,
+				       const char* url,
+				       websrv_state_t** state);
@@ -39,7 +39,7 @@ main(int argc, char** argv) {
   signal(SIGCHLD, SIG_IGN);
 
   while(1) {
-    mdns_discovery_start();
+    mdns_discovery_start(port);
     websrv_listen(port);
     sleep(3);
   }
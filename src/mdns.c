@@ -14,88 +14,875 @@ You should have received a copy of the GNU General Public License
 along with this program; see the file COPYING. If not, see
 <http://www.gnu.org/licenses/>.  */
 
+#include <fcntl.h>
+#include <ifaddrs.h>
 #include <limits.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <microdns/microdns.h>
 
+#include "dirlist.h"
 #include "mdns.h"
+#include "pipe.h"
+#include "task.h"
+#include "version.h"
 #include "websrv.h"
 
 
 /**
- * Data structure used to keep track of services.
+ * Comma-separated list of service types to discover.
  **/
-typedef struct service_seq {
+#ifndef MDNS_SERVICE_TYPES
+#define MDNS_SERVICE_TYPES \
+  "_smb._tcp.local,_nfs._tcp.local,_http._tcp.local,_ftp._tcp.local"
+#endif
+
+
+/**
+ * Maximum number of service types in the list above.
+ **/
+#define MDNS_SERVICE_TYPES_MAX 16
+
+
+/**
+ * Number of seconds between queries while discovery is active.
+ **/
+#ifndef MDNS_QUERY_INTERVAL
+#define MDNS_QUERY_INTERVAL 30
+#endif
+
+
+/**
+ * Number of seconds after the last request before discovery idles down,
+ * unless there are clients subscribed to events.
+ **/
+#ifndef MDNS_IDLE_TIMEOUT
+#define MDNS_IDLE_TIMEOUT 120
+#endif
+
+
+/**
+ * Number of milliseconds a refresh request waits for responses to the query
+ * it sent.
+ **/
+#ifndef MDNS_REFRESH_WAIT
+#define MDNS_REFRESH_WAIT 300
+#endif
+
+
+/**
+ * Number of milliseconds a request waits for discovery to wake up from
+ * idle, before it is served with what is already known.
+ **/
+#ifndef MDNS_WAKE_WAIT
+#define MDNS_WAKE_WAIT 2000
+#endif
+
+
+/**
+ * Number of seconds between keep-alive comments sent to event subscribers,
+ * which is also how long it may take to notice that one has gone away.
+ **/
+#ifndef MDNS_KEEPALIVE
+#define MDNS_KEEPALIVE 15
+#endif
+
+
+/**
+ * Service type that the web server is advertised as.
+ **/
+#define MDNS_HTTP_TYPE "_http._tcp.local"
+
+
+/**
+ * Number of seconds that others may cache the advertisement of the web
+ * server.
+ **/
+#ifndef MDNS_ANNOUNCE_TTL
+#define MDNS_ANNOUNCE_TTL 120
+#endif
+
+
+/**
+ * Number of seconds between unsolicited announcements of the web server.
+ **/
+#ifndef MDNS_ANNOUNCE_INTERVAL
+#define MDNS_ANNOUNCE_INTERVAL (MDNS_ANNOUNCE_TTL / 2)
+#endif
+
+
+/**
+ * API capabilities, advertised in the TXT record of the web server.
+ **/
+#ifdef __SCE__
+#define MDNS_FEATURES "fs,upload,archive,search,homebrew,mdns,smb,launch"
+#else
+#define MDNS_FEATURES "fs,upload,archive,search,homebrew,mdns"
+#endif
+
+
+/**
+ * Number of buckets in the service table. Must be a power of two.
+ **/
+#ifndef MDNS_TABLE_SIZE
+#define MDNS_TABLE_SIZE 64
+#endif
+
+
+/**
+ * Number of one-second slots in the timer wheel that expires services.
+ * Services that live longer than this wrap around, and are skipped until
+ * their slot comes up in the round they expire.
+ **/
+#ifndef MDNS_WHEEL_SIZE
+#define MDNS_WHEEL_SIZE 256
+#endif
+
+
+/**
+ * Upper bound on the size of a rendered service event.
+ **/
+#define MDNS_EVENT_SIZE (sizeof(mdns_service_t) * 6 + 256)
+
+
+/**
+ * Data structure used to keep track of services. Each service is linked
+ * into a bucket of the service table, and into the slot of the timer wheel
+ * for the second it expires.
+ **/
+typedef struct mdns_service {
   char domain[256];
   char target[256];
   char prot[256];
   char addr[INET_ADDRSTRLEN];
   uint16_t port;
-  time_t ttl;
-  struct service_seq* next;
-} service_seq_t;
+  time_t expires;
+
+  struct mdns_service* next;
+  struct mdns_service* timer_next;
+  struct mdns_service** timer_link;
+} mdns_service_t;
+
+
+/**
+ * A client subscribed to service events, i.e., the write end of a pipe that
+ * is streamed to the client.
+ **/
+typedef struct mdns_subscriber {
+  int fd;
+  struct mdns_subscriber* next;
+} mdns_subscriber_t;
 
 
 /**
- * Global state variables.
+ * An immutable rendering of the service table (json), shared by responses
+ * until the last one of them has been sent.
+ **/
+typedef struct mdns_snapshot {
+  unsigned int refs;
+  size_t size;
+  char data[];
+} mdns_snapshot_t;
+
+
+/**
+ * State of a request that waits for responses to a query. The connection is
+ * suspended while waiting, and resumed by the timer.
+ **/
+typedef struct mdns_request_state {
+  websrv_state_t base;
+  struct MHD_Connection *conn;
+  task_timer_t timer;
+  struct mdns_request_state* next;
+} mdns_request_state_t;
+
+
+/**
+ * Global state variables, protected by g_lock. g_last_request and
+ * g_listening are also read without it, and are accessed atomically.
  **/
 static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
 static pthread_t g_thread;
 static bool g_running = false;
-static service_seq_t* g_service_seq = 0;
+static bool g_listening = false;
+static struct mdns_ctx* g_ctx = 0;
+static time_t g_announce = 0;
+static time_t g_last_request = 0;
+static time_t g_keepalive = 0;
+static mdns_service_t* g_table[MDNS_TABLE_SIZE];
+static mdns_service_t* g_wheel[MDNS_WHEEL_SIZE];
+static time_t g_wheel_time = 0;
+static mdns_subscriber_t* g_subscriber_seq = 0;
+static mdns_request_state_t* g_waiter_seq = 0;
+
+
+/**
+ * Service types to discover, parsed from MDNS_SERVICE_TYPES.
+ **/
+static pthread_once_t g_types_once = PTHREAD_ONCE_INIT;
+static char g_types_buf[] = MDNS_SERVICE_TYPES;
+static const char* g_types[MDNS_SERVICE_TYPES_MAX];
+static unsigned int g_ntypes = 0;
+
+
+/**
+ * Names and port that the web server is advertised with, e.g.,
+ * "websrv on ps5._http._tcp.local" and "ps5.local".
+ **/
+static char g_instance[128];
+static char g_hostname[80];
+static uint16_t g_http_port = 0;
+
+
+/**
+ * The most recent snapshot, protected by g_snapshot_lock. Readers only hold
+ * it while taking a reference, so they never wait for the discovery thread.
+ **/
+static pthread_mutex_t g_snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static mdns_snapshot_t* g_snapshot = 0;
 
 
 /**
- * Remove unresponsive services.
+ * Obtain the current time in seconds from a monotonic clock.
+ **/
+static time_t
+mdns_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec;
+}
+
+
+/**
+ * Compute the bucket of a service in the service table (FNV-1a).
+ **/
+static size_t
+mdns_bucket(const char* domain) {
+  uint32_t h = 0x811c9dc5;
+
+  for(; *domain; domain++) {
+    h = (h ^ (uint8_t)*domain) * 0x01000193;
+  }
+
+  return h & (MDNS_TABLE_SIZE - 1);
+}
+
+
+/**
+ * Derive the names that the web server is advertised with from the host
+ * name, reduced to letters, digits and dashes.
  **/
 static void
-mdns_purge_services(void) {
-  service_seq_t* prev = 0;
-  service_seq_t* curr = 0;
+mdns_names_init(void) {
+  char host[64] = {0};
+
+#ifdef MDNS_HOSTNAME
+  strncpy(host, MDNS_HOSTNAME, sizeof(host) - 1);
+#else
+  if(gethostname(host, sizeof(host) - 1)) {
+    host[0] = 0;
+  }
+#endif
+
+  host[strcspn(host, ".")] = 0;
+  for(char* p=host; *p; p++) {
+    if(!(*p >= 'a' && *p <= 'z') && !(*p >= 'A' && *p <= 'Z') &&
+       !(*p >= '0' && *p <= '9')) {
+      *p = '-';
+    }
+  }
+  if(!host[0] || !strcasecmp(host, "localhost")) {
+    strcpy(host, "ps5");
+  }
+
+  snprintf(g_hostname, sizeof(g_hostname), "%s.local", host);
+  snprintf(g_instance, sizeof(g_instance), "websrv on %s." MDNS_HTTP_TYPE,
+	   host);
+}
+
+
+/**
+ * Split the list of service types, and derive the advertised names.
+ **/
+static void
+mdns_types_init(void) {
+  char* saveptr = 0;
+  char* type;
+
+  mdns_names_init();
+
+  for(type=strtok_r(g_types_buf, ", ", &saveptr);
+      type && g_ntypes < MDNS_SERVICE_TYPES_MAX;
+      type=strtok_r(0, ", ", &saveptr)) {
+    g_types[g_ntypes++] = type;
+  }
+}
+
+
+/**
+ * Obtain the IPv4 address to advertise, i.e., the address of the interface
+ * a query arrived on if known, or else the first one that is not loopback.
+ **/
+static bool
+mdns_local_addr(const struct sockaddr* ip, struct in_addr* addr) {
+  struct ifaddrs *ifaddr;
+  bool found = false;
+
+  if(ip && ip->sa_family == AF_INET &&
+     ((const struct sockaddr_in*)ip)->sin_addr.s_addr) {
+    *addr = ((const struct sockaddr_in*)ip)->sin_addr;
+    return true;
+  }
+
+  if(getifaddrs(&ifaddr)) {
+    return false;
+  }
+
+  for(struct ifaddrs *ifa=ifaddr; ifa && !found; ifa=ifa->ifa_next) {
+    if(!ifa->ifa_addr || ifa->ifa_addr->sa_family != AF_INET ||
+       !strncmp("lo", ifa->ifa_name, 2)) {
+      continue;
+    }
+    *addr = ((struct sockaddr_in*)ifa->ifa_addr)->sin_addr;
+    found = (ntohl(addr->s_addr) >> 24) != 0;
+  }
+
+  freeifaddrs(ifaddr);
+
+  return found;
+}
+
+
+/**
+ * Advertise the web server with PTR, SRV, TXT and A records. A ttl of zero
+ * tells others to forget about it.
+ **/
+static void
+mdns_advertise(struct mdns_ctx* ctx, const struct sockaddr* ip, uint32_t ttl) {
+  struct rr_data_txt txt[3];
+  struct mdns_hdr hdr = {0};
+  struct rr_entry rr[4];
+  struct in_addr addr;
+  char err[128];
+  int r;
+
+  if(!ctx || !g_http_port || !mdns_local_addr(ip, &addr)) {
+    return;
+  }
+
+  memset(txt, 0, sizeof(txt));
+  snprintf(txt[0].txt, sizeof(txt[0].txt), "version=%s", VERSION_TAG);
+  snprintf(txt[1].txt, sizeof(txt[1].txt), "api=%d", API_VERSION);
+  snprintf(txt[2].txt, sizeof(txt[2].txt), "features=%s", MDNS_FEATURES);
+  txt[0].next = &txt[1];
+  txt[1].next = &txt[2];
+
+  memset(rr, 0, sizeof(rr));
+  for(int i=0; i<4; i++) {
+    rr[i].rr_class = RR_IN;
+    rr[i].ttl = ttl;
+    rr[i].msbit = i > 0; // cache-flush the records that are unique to us
+    rr[i].next = i < 3 ? &rr[i + 1] : 0;
+  }
+
+  rr[0].name = MDNS_HTTP_TYPE;
+  rr[0].type = RR_PTR;
+  rr[0].data.PTR.domain = g_instance;
+
+  rr[1].name = g_instance;
+  rr[1].type = RR_SRV;
+  rr[1].data.SRV.port = g_http_port;
+  rr[1].data.SRV.target = g_hostname;
+
+  rr[2].name = g_instance;
+  rr[2].type = RR_TXT;
+  rr[2].data.TXT = txt;
+
+  rr[3].name = g_hostname;
+  rr[3].type = RR_A;
+  rr[3].data.A.addr = addr;
+  inet_ntop(AF_INET, &addr, rr[3].data.A.addr_str,
+	    sizeof(rr[3].data.A.addr_str));
+
+  hdr.flags = FLAG_QR | FLAG_AA;
+  hdr.num_ans_rr = 4;
+
+  if((r=mdns_entries_send(ctx, &hdr, rr)) < 0) {
+    mdns_strerror(r, err, sizeof(err));
+    fprintf(stderr, "mdns_entries_send: %s\n", err);
+  }
+}
+
+
+/**
+ * Callback function used by libmicrodns when a query for one of the record
+ * types of the web server arrives, or with a NULL service when it is time
+ * for an unsolicited announcement.
+ **/
+static void
+mdns_announce_cb(void *cookie, const struct sockaddr *ip, const char *service,
+		 enum rr_type type) {
+  if(service && strcasecmp(service, MDNS_HTTP_TYPE) &&
+     strcasecmp(service, g_instance) && strcasecmp(service, g_hostname)) {
+    return;
+  }
+
+  mdns_advertise(cookie, ip, MDNS_ANNOUNCE_TTL);
+}
+
+
+/**
+ * Check if discovery should idle down, i.e., no one has asked for services
+ * for a while. The caller must hold g_lock.
+ **/
+static bool
+mdns_idle(time_t now) {
+  return !g_subscriber_seq &&
+    now - __atomic_load_n(&g_last_request, __ATOMIC_SEQ_CST) > MDNS_IDLE_TIMEOUT;
+}
+
+
+/**
+ * Render a service as a single-line JSON object, and return the number of
+ * bytes written. The buffer must hold at least 6 bytes per byte of the
+ * service strings, plus 128.
+ **/
+static size_t
+mdns_render_service(char* buf, const mdns_service_t* ss) {
+  char* ptr = buf;
+
+  ptr += sprintf(ptr, "{\"domain\":");
+  ptr += dirlist_json_string(ptr, ss->domain);
+  ptr += sprintf(ptr, ",\"protocol\":");
+  ptr += dirlist_json_string(ptr, ss->prot);
+  ptr += sprintf(ptr, ",\"hostname\":");
+  ptr += dirlist_json_string(ptr, ss->target);
+  ptr += sprintf(ptr, ",\"address\":");
+  ptr += dirlist_json_string(ptr, ss->addr);
+  ptr += sprintf(ptr, ",\"port\": %d}", ss->port);
+
+  return ptr - buf;
+}
+
+
+/**
+ * Write an event to a subscriber. Subscribers that have gone away, or that
+ * do not keep up with events, are dropped and have their stream closed.
+ * Returns false if the subscriber was dropped. The caller must hold g_lock.
+ **/
+static bool
+mdns_notify_one(mdns_subscriber_t** link, const char* buf, size_t size) {
+  mdns_subscriber_t* sub = *link;
+
+  if(write(sub->fd, buf, size) == size) {
+    return true;
+  }
+
+  *link = sub->next;
+  close(sub->fd);
+  free(sub);
+
+  return false;
+}
+
+
+/**
+ * Write an event to all subscribers. The caller must hold g_lock.
+ **/
+static void
+mdns_notify(const char* buf, size_t size) {
+  mdns_subscriber_t** link = &g_subscriber_seq;
+
+  while(*link) {
+    if(mdns_notify_one(link, buf, size)) {
+      link = &(*link)->next;
+    }
+  }
+}
+
+
+/**
+ * Render an event about a service that was added or changed (event "add"),
+ * or removed (event "remove"), and return the number of bytes written.
+ **/
+static size_t
+mdns_render_event(char* buf, const char* event, const mdns_service_t* ss) {
+  char* ptr = buf;
+
+  ptr += sprintf(ptr, "event: %s\ndata: ", event);
+  if(!strcmp(event, "remove")) {
+    ptr += sprintf(ptr, "{\"domain\":");
+    ptr += dirlist_json_string(ptr, ss->domain);
+    *ptr++ = '}';
+  } else {
+    ptr += mdns_render_service(ptr, ss);
+  }
+  ptr += sprintf(ptr, "\n\n");
+
+  return ptr - buf;
+}
+
+
+/**
+ * Notify all subscribers about a service. The caller must hold g_lock.
+ **/
+static void
+mdns_notify_service(const char* event, const mdns_service_t* ss) {
+  char buf[MDNS_EVENT_SIZE];
+
+  if(g_subscriber_seq) {
+    mdns_notify(buf, mdns_render_event(buf, event, ss));
+  }
+}
+
+
+/**
+ * Send a query for all service types, so that responders answer right
+ * away rather than at the next query interval. The caller must hold g_lock.
+ **/
+static void
+mdns_query(void) {
+  struct rr_entry qns[MDNS_SERVICE_TYPES_MAX];
+  struct mdns_hdr hdr = {0};
+  char err[128];
+  int r;
+
+  if(!g_ctx || !g_ntypes) {
+    return;
+  }
+
+  memset(qns, 0, sizeof(qns));
+  hdr.num_qn = g_ntypes;
+  for(unsigned int i=0; i<g_ntypes; i++) {
+    qns[i].name = (char*)g_types[i];
+    qns[i].type = RR_PTR;
+    qns[i].rr_class = RR_IN;
+    qns[i].msbit = 1;
+    qns[i].next = i + 1 < g_ntypes ? &qns[i + 1] : 0;
+  }
+
+  if((r=mdns_entries_send(g_ctx, &hdr, qns)) < 0) {
+    mdns_strerror(r, err, sizeof(err));
+    fprintf(stderr, "mdns_entries_send: %s\n", err);
+  }
+}
+
+
+/**
+ * Resume a request once it has waited for responses to a query.
+ **/
+static void
+mdns_wait_done(void* arg) {
+  mdns_request_state_t* st = arg;
+
+  MHD_resume_connection(st->conn);
+}
+
+
+/**
+ * Resume a request that waited for discovery to wake up, unless the
+ * discovery thread has already taken it over.
+ **/
+static void
+mdns_wake_timeout(void* arg) {
+  mdns_request_state_t* st = arg;
+  bool waiting = false;
 
   pthread_mutex_lock(&g_lock);
+  for(mdns_request_state_t** it=&g_waiter_seq; *it; it=&(*it)->next) {
+    if(*it == st) {
+      *it = st->next;
+      waiting = true;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&g_lock);
 
-  curr = g_service_seq;
-  while(curr) {
-    if(curr->ttl > time(0)) {
-      prev = curr;
-      curr = curr->next;
-    } else if(prev) {
-      prev->next = curr->next;
-      free(curr);
-      curr = prev->next;
-    } else {
-      g_service_seq = curr->next;
-      free(curr);
-      curr = g_service_seq;
+  if(waiting) {
+    mdns_wait_done(st);
+  }
+}
+
+
+/**
+ * Give requests that waited for discovery to wake up a moment to receive
+ * responses to the query that is sent when listening starts.
+ **/
+static void
+mdns_wake_waiters(void) {
+  mdns_request_state_t* next;
+  mdns_request_state_t* st;
+
+  pthread_mutex_lock(&g_lock);
+  st = g_waiter_seq;
+  g_waiter_seq = 0;
+  pthread_mutex_unlock(&g_lock);
+
+  for(; st; st=next) {
+    next = st->next;
+    task_timer_stop(&st->timer);
+    if(task_timer_start(&st->timer, MDNS_REFRESH_WAIT, mdns_wait_done, st)) {
+      mdns_wait_done(st);
     }
   }
+}
 
+
+/**
+ * Note that a client asked for services, and wake up discovery if it has
+ * idled down. If discovery is already active and query is true, a query is
+ * sent right away. If st is given, a timer that resumes its connection once
+ * responses have had a chance to arrive is started, and true is returned.
+ * The lock is only taken when discovery needs to wake up, or to query.
+ **/
+static bool
+mdns_touch(bool query, mdns_request_state_t* st) {
+  time_t now = mdns_now();
+  bool wait = false;
+
+  __atomic_store_n(&g_last_request, now, __ATOMIC_SEQ_CST);
+  if(!query && __atomic_load_n(&g_listening, __ATOMIC_SEQ_CST)) {
+    return false;
+  }
+
+  pthread_mutex_lock(&g_lock);
+  if(!g_running) {
+    // nothing will answer
+  } else if(!g_listening) {
+    // the discovery thread notices within a second that it should stop
+    // serving, and sends a query as soon as it starts listening
+    if(st && !task_timer_start(&st->timer, MDNS_WAKE_WAIT, mdns_wake_timeout,
+			       st)) {
+      st->next = g_waiter_seq;
+      g_waiter_seq = st;
+      wait = true;
+    }
+  } else if(query) {
+    mdns_query();
+    wait = st && !task_timer_start(&st->timer, MDNS_REFRESH_WAIT,
+				   mdns_wait_done, st);
+  }
   pthread_mutex_unlock(&g_lock);
+
+  return wait;
+}
+
+
+/**
+ * Drop a reference to a snapshot, and free it when there are none left.
+ **/
+static void
+mdns_snapshot_unref(void* cls) {
+  mdns_snapshot_t* snap = cls;
+
+  if(snap && !__atomic_sub_fetch(&snap->refs, 1, __ATOMIC_ACQ_REL)) {
+    free(snap);
+  }
+}
+
+
+/**
+ * Render the service table and publish it as the current snapshot.
+ * The caller must hold g_lock.
+ **/
+static void
+mdns_publish(void) {
+  mdns_snapshot_t* snap;
+  mdns_snapshot_t* old;
+  mdns_service_t* ss;
+  size_t size = 16;
+  char *ptr;
+
+  for(size_t i=0; i<MDNS_TABLE_SIZE; i++) {
+    for(ss=g_table[i]; ss; ss=ss->next) {
+      size += 6 * (strlen(ss->domain) + strlen(ss->prot) +
+		   strlen(ss->target) + strlen(ss->addr)) + 128;
+    }
+  }
+
+  // keep serving the previous snapshot if memory is short
+  if(!(snap=malloc(sizeof(mdns_snapshot_t) + size))) {
+    return;
+  }
+
+  ptr = snap->data;
+  ptr += sprintf(ptr, "[\n");
+  for(size_t i=0; i<MDNS_TABLE_SIZE; i++) {
+    for(ss=g_table[i]; ss; ss=ss->next) {
+      if(ptr > snap->data + 2) {
+	ptr += sprintf(ptr, ",\n");
+      }
+      ptr += sprintf(ptr, "  ");
+      ptr += mdns_render_service(ptr, ss);
+    }
+  }
+  ptr += sprintf(ptr, "\n]\n");
+
+  snap->size = ptr - snap->data;
+  snap->refs = 1;
+
+  pthread_mutex_lock(&g_snapshot_lock);
+  old = g_snapshot;
+  g_snapshot = snap;
+  pthread_mutex_unlock(&g_snapshot_lock);
+
+  mdns_snapshot_unref(old);
+}
+
+
+/**
+ * Schedule a service to expire at the given time.
+ * The caller must hold g_lock.
+ **/
+static void
+mdns_timer_set(mdns_service_t* ss, time_t expires) {
+  mdns_service_t** slot;
+
+  if(ss->timer_link) {
+    *ss->timer_link = ss->timer_next;
+    if(ss->timer_next) {
+      ss->timer_next->timer_link = ss->timer_link;
+    }
+  }
+
+  // the wheel has already passed the current second
+  if(expires <= g_wheel_time) {
+    expires = g_wheel_time + 1;
+  }
+
+  slot = &g_wheel[expires % MDNS_WHEEL_SIZE];
+  ss->expires = expires;
+  ss->timer_link = slot;
+  ss->timer_next = *slot;
+  if(*slot) {
+    (*slot)->timer_link = &ss->timer_next;
+  }
+  *slot = ss;
+}
+
+
+/**
+ * Remove a service from the service table and the timer wheel, and free it.
+ * The caller must hold g_lock.
+ **/
+static void
+mdns_remove_service(mdns_service_t* ss) {
+  mdns_service_t** link;
+
+  *ss->timer_link = ss->timer_next;
+  if(ss->timer_next) {
+    ss->timer_next->timer_link = ss->timer_link;
+  }
+
+  for(link=&g_table[mdns_bucket(ss->domain)]; *link; link=&(*link)->next) {
+    if(*link == ss) {
+      *link = ss->next;
+      break;
+    }
+  }
+
+  free(ss);
+}
+
+
+/**
+ * Advance the timer wheel to the given time, and remove services that have
+ * become unresponsive. Only the slots of the seconds that passed since the
+ * last call are visited. Returns true if any service was removed.
+ * The caller must hold g_lock.
+ **/
+static bool
+mdns_expire_services(time_t now) {
+  mdns_service_t* next;
+  mdns_service_t* ss;
+  bool changed = false;
+  time_t ticks;
+
+  if(!g_wheel_time) {
+    g_wheel_time = now;
+    return false;
+  }
+  if((ticks=now - g_wheel_time) <= 0) {
+    return false;
+  }
+  if(ticks > MDNS_WHEEL_SIZE) {
+    ticks = MDNS_WHEEL_SIZE;
+  }
+
+  for(time_t t=now - ticks + 1; t<=now; t++) {
+    for(ss=g_wheel[t % MDNS_WHEEL_SIZE]; ss; ss=next) {
+      next = ss->timer_next;
+      if(ss->expires <= now) {
+	mdns_notify_service("remove", ss);
+	mdns_remove_service(ss);
+	changed = true;
+      }
+    }
+  }
+  g_wheel_time = now;
+
+  return changed;
 }
 
 
 /**
  * Callback function used by libmicrodns to determine when to stop listening
- * for mDNS traffic.
+ * for (or serving) mDNS traffic, i.e., when discovery is stopped, or should
+ * switch between listening and serving. Since it is invoked periodically,
+ * it also expires services that are no longer announced, keeps event
+ * streams alive, and repeats the announcement of the web server.
  **/
 static bool
 mdns_stop_cb(void *ctx) {
+  time_t now = mdns_now();
   bool stop;
 
   pthread_mutex_lock(&g_lock);
-  stop = !g_running;
+  stop = !g_running || mdns_idle(now) == g_listening;
+  if(!stop && now >= g_announce) {
+    mdns_advertise(g_ctx, 0, MDNS_ANNOUNCE_TTL);
+    g_announce = now + MDNS_ANNOUNCE_INTERVAL;
+  }
+  if(mdns_expire_services(now)) {
+    mdns_publish();
+  }
+  if(g_subscriber_seq && now >= g_keepalive) {
+    mdns_notify(": keepalive\n\n", 13);
+    g_keepalive = now + MDNS_KEEPALIVE;
+  }
   pthread_mutex_unlock(&g_lock);
 
   return stop;
 }
 
 
+/**
+ * Copy a string into a fixed-size buffer, and return true if it changed.
+ **/
+static bool
+mdns_update_str(char* buf, size_t size, const char* s) {
+  if(!strncmp(buf, s, size - 1)) {
+    return false;
+  }
+
+  strncpy(buf, s, size - 1);
+  buf[size - 1] = 0;
+
+  return true;
+}
+
+
 /**
  * Callback function used my libmicrodns when services are discovered.
  **/
@@ -105,10 +892,13 @@ mdns_discovery_cb(void *stc, int status, const struct rr_entry *entries) {
   const char* target = 0;
   const char* addr = 0;
   const char* prot = 0;
+  mdns_service_t* ss;
+  bool changed = false;
   uint16_t port = 0;
   uint32_t ttl = 0;
-  service_seq_t* ss;
   char err[128];
+  size_t bucket;
+  time_t now;
 
   if(status < 0) {
     mdns_strerror(status, err, sizeof(err));
@@ -145,58 +935,160 @@ mdns_discovery_cb(void *stc, int status, const struct rr_entry *entries) {
     return;
   }
 
-  mdns_purge_services();
+  // the web server hears its own announcements
+  if(!strcasecmp(domain, g_instance)) {
+    return;
+  }
+
+  now = mdns_now();
+  bucket = mdns_bucket(domain);
 
   pthread_mutex_lock(&g_lock);
 
-  for(ss=g_service_seq; ss; ss=ss->next) {
-    if(!strncmp(ss->domain, domain, sizeof(ss->domain))) {
+  changed = mdns_expire_services(now);
+
+  for(ss=g_table[bucket]; ss; ss=ss->next) {
+    if(!strncmp(ss->domain, domain, sizeof(ss->domain) - 1)) {
       break;
     }
   }
 
   if(!ss) {
-    if((ss=malloc(sizeof(service_seq_t)))) {
-      strncpy(ss->domain, domain, sizeof(ss->domain));
-      ss->next = g_service_seq;
-      g_service_seq = ss;
+    if(!(ss=calloc(1, sizeof(mdns_service_t)))) {
+      pthread_mutex_unlock(&g_lock);
+      return;
     }
+    mdns_update_str(ss->domain, sizeof(ss->domain), domain);
+    ss->next = g_table[bucket];
+    g_table[bucket] = ss;
+    changed = true;
+  }
+
+  // a renewed announcement only moves the expiry, which is not part of the
+  // snapshot, so the snapshot is only rendered again on actual changes
+  changed |= mdns_update_str(ss->target, sizeof(ss->target), target);
+  changed |= mdns_update_str(ss->prot, sizeof(ss->prot), prot);
+  changed |= mdns_update_str(ss->addr, sizeof(ss->addr), addr);
+  if(ss->port != port) {
+    ss->port = port;
+    changed = true;
   }
+  mdns_timer_set(ss, now + ttl);
 
-  strncpy(ss->target, target, sizeof(ss->target));
-  strncpy(ss->prot, prot, sizeof(ss->prot));
-  strncpy(ss->addr, addr, sizeof(ss->addr));
-  ss->port = port;
-  ss->ttl = time(0) + ttl;
+  if(changed) {
+    mdns_notify_service("add", ss);
+    mdns_publish();
+  }
 
   pthread_mutex_unlock(&g_lock);
 }
 
 
 /**
- * Thread for running mDNS service discovery.
+ * Wait on g_cond for at most the given number of seconds.
+ * The caller must hold g_lock.
+ **/
+static void
+mdns_wait(time_t seconds) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += seconds;
+  pthread_cond_timedwait(&g_cond, &g_lock, &ts);
+}
+
+
+/**
+ * Alternate between listening for services while someone is interested in
+ * them, and answering queries for the web server otherwise. libmicrodns
+ * only does one of the two at a time, so queries that arrive while
+ * listening go unanswered, and are covered by periodic announcements
+ * instead.
+ **/
+static int
+mdns_run(struct mdns_ctx *ctx) {
+  char err[128];
+  bool listen;
+  int r;
+
+  while(1) {
+    pthread_mutex_lock(&g_lock);
+    if(!g_running) {
+      pthread_mutex_unlock(&g_lock);
+      return 0;
+    }
+    listen = !mdns_idle(mdns_now());
+    __atomic_store_n(&g_listening, listen, __ATOMIC_SEQ_CST);
+    g_announce = 0;
+    pthread_mutex_unlock(&g_lock);
+
+    if(listen) {
+      mdns_wake_waiters();
+    }
+
+    if(listen) {
+      r = mdns_listen(ctx, g_types, g_ntypes, RR_PTR, MDNS_QUERY_INTERVAL,
+		      mdns_stop_cb, mdns_discovery_cb, 0);
+    } else {
+      r = mdns_serve(ctx, mdns_stop_cb, 0);
+    }
+
+    if(r < 0) {
+      mdns_strerror(r, err, sizeof(err));
+      fprintf(stderr, "%s: %s\n", listen ? "mdns_listen" : "mdns_serve", err);
+      return r;
+    }
+  }
+}
+
+
+/**
+ * Thread for running mDNS service discovery, and advertising the web server.
  **/
 static void*
 mdns_discovery_thread(void* args) {
-  const char* proto = (const char*)args;
+  const enum rr_type types[] = {RR_PTR, RR_SRV, RR_TXT, RR_A};
   struct mdns_ctx *ctx;
   char err[128];
   int r;
 
-  if((r=mdns_init(&ctx, MDNS_ADDR_IPV4, MDNS_PORT)) < 0) {
-    mdns_strerror(r, err, sizeof(err));
-    fprintf(stderr, "mdns_init: %s\n", err);
+  pthread_mutex_lock(&g_lock);
+  while(g_running) {
+    pthread_mutex_unlock(&g_lock);
 
-  } else if((r=mdns_listen(ctx, &proto, 1, RR_PTR, 30,
-                           mdns_stop_cb, mdns_discovery_cb, 0)) < 0) {
-    mdns_strerror(r, err, sizeof(err));
-    fprintf(stderr, "mdns_listen: %s\n", err);
-  }
+    ctx = 0;
+    if((r=mdns_init(&ctx, MDNS_ADDR_IPV4, MDNS_PORT)) < 0) {
+      mdns_strerror(r, err, sizeof(err));
+      fprintf(stderr, "mdns_init: %s\n", err);
 
-  mdns_destroy(ctx);
+    } else {
+      for(int i=0; r >= 0 && i<sizeof(types)/sizeof(types[0]); i++) {
+	r = mdns_announce(ctx, types[i], mdns_announce_cb, ctx);
+      }
 
-  pthread_mutex_lock(&g_lock);
-  g_running = false;
+      pthread_mutex_lock(&g_lock);
+      g_ctx = ctx;
+      pthread_mutex_unlock(&g_lock);
+
+      if(r >= 0 && !(r=mdns_run(ctx))) {
+	mdns_advertise(ctx, 0, 0);
+      }
+    }
+
+    pthread_mutex_lock(&g_lock);
+    g_ctx = 0;
+    __atomic_store_n(&g_listening, false, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&g_lock);
+
+    mdns_destroy(ctx);
+
+    pthread_mutex_lock(&g_lock);
+
+    // back off before trying again, e.g., while the network is down
+    if(r < 0 && g_running) {
+      mdns_wait(5);
+    }
+  }
   pthread_mutex_unlock(&g_lock);
 
   return 0;
@@ -210,6 +1102,7 @@ mdns_discovery_stop(void) {
   pthread_mutex_lock(&g_lock);
   stop = g_running;
   g_running = false;
+  pthread_cond_signal(&g_cond);
   pthread_mutex_unlock(&g_lock);
 
   if(!stop) {
@@ -221,63 +1114,87 @@ mdns_discovery_stop(void) {
 
 
 int
-mdns_discovery_start(void) {
+mdns_discovery_start(uint16_t http_port) {
   bool start;
+  int err;
+
+  pthread_once(&g_types_once, mdns_types_init);
 
   pthread_mutex_lock(&g_lock);
   start = !g_running;
   g_running = true;
+  g_http_port = http_port;
   pthread_mutex_unlock(&g_lock);
 
   if(!start) {
     return -1;
   }
 
-  return pthread_create(&g_thread, 0, mdns_discovery_thread, "_smb._tcp.local");
+  if((err=pthread_create(&g_thread, 0, mdns_discovery_thread, 0))) {
+    pthread_mutex_lock(&g_lock);
+    g_running = false;
+    pthread_mutex_unlock(&g_lock);
+  }
+
+  return err;
+}
+
+
+/**
+ * Release the state of a request.
+ **/
+static void
+mdns_request_free(websrv_state_t* state) {
+  free(state);
 }
 
 
 enum MHD_Result
-mdns_request(struct MHD_Connection *conn, const char* url) {
+mdns_request(struct MHD_Connection *conn, const char* url,
+	     websrv_state_t** state) {
+  static const char empty[] = "[\n\n]\n";
   enum MHD_Result ret = MHD_NO;
+  mdns_request_state_t* st;
   struct MHD_Response *resp;
-  service_seq_t* ss;
-  size_t size = 0;
-  size_t cnt = 0;
-  char *buf;
-  char *ptr;
+  mdns_snapshot_t* snap;
+  const char* s;
+  bool refresh;
 
-  pthread_mutex_lock(&g_lock);
+  // give responders a moment to answer a fresh query, with the connection
+  // suspended until the timer resumes it
+  if(!*state) {
+    s = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "refresh");
+    refresh = s && strcmp(s, "0");
 
-  // esimate needed memory
-  for(ss=g_service_seq; ss; ss=ss->next) {
-    cnt++;
-  }
-  size = cnt*(sizeof(service_seq_t) + 100);
-  size += 100;
+    if(!(st=calloc(1, sizeof(mdns_request_state_t)))) {
+      return MHD_NO;
+    }
+    st->base.free_cb = mdns_request_free;
+    st->conn = conn;
+    *state = &st->base;
 
-  if(!(buf=ptr=malloc(size))) {
-    return ret;
+    MHD_suspend_connection(conn);
+    if(mdns_touch(refresh, st)) {
+      return MHD_YES;
+    }
+    MHD_resume_connection(conn);
   }
 
-  ptr += sprintf(buf, "[\n");
-  for(ss=g_service_seq; ss; ss=ss->next) {
-    if(ss != g_service_seq) {
-      ptr += sprintf(ptr, ",\n");
-    }
-    ptr += sprintf(ptr, "  {\"domain\":\"%s\",", ss->domain);
-    ptr += sprintf(ptr, "\"protocol\":\"%s\",", ss->prot);
-    ptr += sprintf(ptr, "\"hostname\":\"%s\",", ss->target);
-    ptr += sprintf(ptr, "\"address\":\"%s\",", ss->addr);
-    ptr += sprintf(ptr, "\"port\": %d}", ss->port);
+  pthread_mutex_lock(&g_snapshot_lock);
+  if((snap=g_snapshot)) {
+    __atomic_add_fetch(&snap->refs, 1, __ATOMIC_RELAXED);
   }
-  ptr += sprintf(ptr, "\n]\n");
+  pthread_mutex_unlock(&g_snapshot_lock);
 
-  pthread_mutex_unlock(&g_lock);
+  if(!snap) {
+    resp = MHD_create_response_from_buffer(strlen(empty), (void*)empty,
+					   MHD_RESPMEM_PERSISTENT);
+  } else if(!(resp=MHD_create_response_from_buffer_with_free_callback_cls(
+		 snap->size, snap->data, &mdns_snapshot_unref, snap))) {
+    mdns_snapshot_unref(snap);
+  }
 
-  size = ptr-buf;
-  if((resp=MHD_create_response_from_buffer(size, buf,
-					   MHD_RESPMEM_MUST_FREE))) {
+  if(resp) {
     MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE,
                             "application/json");
     ret = websrv_queue_response(conn, MHD_HTTP_OK, resp);
@@ -287,3 +1204,57 @@ mdns_request(struct MHD_Connection *conn, const char* url) {
   return ret;
 }
 
+
+enum MHD_Result
+mdns_events_request(struct MHD_Connection *conn, const char* url) {
+  enum MHD_Result ret = MHD_NO;
+  struct MHD_Response *resp;
+  char buf[MDNS_EVENT_SIZE];
+  mdns_subscriber_t* sub;
+  mdns_service_t* ss;
+  bool alive = true;
+  int fds[2];
+
+  if(!(sub=calloc(1, sizeof(mdns_subscriber_t)))) {
+    return MHD_NO;
+  }
+  if(pipe(fds)) {
+    free(sub);
+    return MHD_NO;
+  }
+
+  // a subscriber that does not keep up is dropped rather than blocking
+  // the discovery thread
+  if(fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK) < 0 ||
+     !(resp=pipe_create_response(conn, fds[0]))) {
+    close(fds[0]);
+    close(fds[1]);
+    free(sub);
+    return MHD_NO;
+  }
+
+  MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE,
+			  "text/event-stream");
+  MHD_add_response_header(resp, MHD_HTTP_HEADER_CACHE_CONTROL, "no-cache");
+
+  sub->fd = fds[1];
+  mdns_touch(false, 0);
+
+  pthread_mutex_lock(&g_lock);
+  sub->next = g_subscriber_seq;
+  g_subscriber_seq = sub;
+
+  // start with the services that are already known
+  for(size_t i=0; alive && i<MDNS_TABLE_SIZE; i++) {
+    for(ss=g_table[i]; alive && ss; ss=ss->next) {
+      alive = mdns_notify_one(&g_subscriber_seq, buf,
+			      mdns_render_event(buf, "add", ss));
+    }
+  }
+  pthread_mutex_unlock(&g_lock);
+
+  ret = websrv_queue_response(conn, MHD_HTTP_OK, resp);
+  MHD_destroy_response(resp);
+
+  return ret;
+}
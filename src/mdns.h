@@ -16,13 +16,18 @@ along with this program; see the file COPYING. If not, see
 
 #pragma once
 
+#include <stdint.h>
+
 #include <microhttpd.h>
 
+#include "websrv.h"
+
 
 /**
- * Start the mDNS service discovery.
+ * Start the mDNS service discovery, and advertise the web server listening
+ * on the given port as an _http._tcp service.
  **/
-int mdns_discovery_start(void);
+int mdns_discovery_start(uint16_t http_port);
 
 
 /**
@@ -32,8 +37,18 @@ int mdns_discovery_stop(void);
 
 
 /**
- * Respond to a mDNS discovery request.
+ * Respond to a mDNS discovery request. Requests that wait for responses to a
+ * query are suspended, and state keeps track of them until the response is
+ * queued when this function is invoked again.
  **/
-enum MHD_Result mdns_request(struct MHD_Connection *conn,
-                             const char* url);
+enum MHD_Result mdns_request(struct MHD_Connection *conn, const char* url,
+                             websrv_state_t** state);
+
 
+/**
+ * Respond with a stream of Server-Sent Events about services that are added
+ * or changed (event "add", with the service as data), and removed (event
+ * "remove", with the domain of the service as data).
+ **/
+enum MHD_Result mdns_events_request(struct MHD_Connection *conn,
+                                    const char* url);
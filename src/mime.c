@@ -14,13 +14,58 @@ You should have received a copy of the GNU General Public License
 along with this program; see the file COPYING. If not, see
 <http://www.gnu.org/licenses/>.  */
 
+#include <ctype.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "mime.h"
 
 
 /**
- * A map of file ext to mime type.
+ * Upper bound on the length of extensions in the map below, including
+ * compound extensions.
  **/
-static struct {
+#define MIME_EXT_MAX 15
+
+
+/**
+ * Number of entries in the map below.
+ **/
+#define MIME_COUNT (sizeof(g_ext2mime) / sizeof(g_ext2mime[0]))
+
+
+/**
+ * Number of bytes inspected at the start of a file when sniffing its type.
+ **/
+#ifndef MIME_SNIFF_SIZE
+#define MIME_SNIFF_SIZE 512
+#endif
+
+
+/**
+ * Number of sniffed files remembered. Must be a power of two.
+ **/
+#ifndef MIME_SNIFF_CACHE_SIZE
+#define MIME_SNIFF_CACHE_SIZE 256
+#endif
+
+
+/**
+ * Plain text, as reported for files that look like UTF-8.
+ **/
+#define MIME_TEXT "text/plain; charset=utf-8"
+
+
+/**
+ * A map of file ext to mime type. Extensions are lower case, and entries
+ * must be kept sorted by extension (as ordered by strcmp).
+ **/
+static const struct {
   const char* ext;
   const char* mime;
 } g_ext2mime[] = {
@@ -984,6 +1029,9 @@ static struct {
   {"taglet", "application/vnd.mynfc"},
   {"tao", "application/vnd.tao.intent-module-archive"},
   {"tar", "application/x-tar"},
+  {"tar.bz2", "application/x-gtar"},
+  {"tar.gz", "application/x-gtar"},
+  {"tar.xz", "application/x-gtar"},
   {"tbk", "application/x-toolbook"},
   {"tbz", "application/x-gtar"},
   {"tbz2", "application/x-gtar"},
@@ -1228,28 +1276,271 @@ static struct {
   {"zir", "application/vnd.zul"},
   {"zirz", "application/vnd.zul"},
   {"zmm", "application/vnd.HandHeld-Entertainment+xml"},
-  {0, 0}
 };
 
 
+/**
+ * Lookup a lower case extension with a binary search, where each step
+ * selects the next half without a conditional branch.
+ **/
+static const char*
+mime_lookup(const char* ext) {
+  size_t n = MIME_COUNT;
+  size_t base = 0;
+  size_t half;
+
+  while(n > 1) {
+    half = n / 2;
+    base += (strcmp(g_ext2mime[base + half].ext, ext) <= 0) * half;
+    n -= half;
+  }
+
+  return strcmp(g_ext2mime[base].ext, ext) ? 0 : g_ext2mime[base].mime;
+}
+
+
 const char*
 mime_get_type(const char *filename) {
-  const char* ext = 0;
+  char ext[MIME_EXT_MAX + 1];
+  const char* name = filename;
+  const char* mime;
+  const char* p;
+  size_t len;
+
+  for(p=filename; *p; p++) {
+    if(*p == '/') {
+      name = p + 1;
+    }
+  }
 
-  for(const char* p=filename; *p; p++) {
-    if(*p == '.') {
-      ext = p+1;
+  // try the longest extension first, so that e.g. .tar.gz beats .gz
+  for(p=name; (p=strchr(p, '.')); ) {
+    p++;
+    if((len=strlen(p)) > MIME_EXT_MAX) {
+      continue;
+    }
+    for(size_t i=0; i<=len; i++) {
+      ext[i] = tolower((unsigned char)p[i]);
+    }
+    if((mime=mime_lookup(ext))) {
+      return mime;
     }
   }
 
-  if(!ext) {
+  return 0;
+}
+
+
+/**
+ * Magic numbers found at fixed offsets, checked in order.
+ **/
+static const struct {
+  uint16_t off;
+  uint8_t len;
+  const char* magic;
+  const char* mime;
+} g_magic[] = {
+  {0, 4, "\x7f" "ELF", "application/x-elf"},
+  {0, 4, "\x4f\x15\x3d\x1d", "application/x-self"},
+  {0, 4, "\x54\x14\xf5\xee", "application/x-self"},
+  {0, 4, "\x7f" "CNT", "application/x-playstation-pkg"},
+  {0, 4, "\x7f" "FIH", "application/x-playstation-pkg"},
+  {0, 8, "\x89PNG\r\n\x1a\n", "image/png"},
+  {0, 3, "\xff\xd8\xff", "image/jpeg"},
+  {0, 6, "GIF87a", "image/gif"},
+  {0, 6, "GIF89a", "image/gif"},
+  {0, 4, "\x00\x00\x01\x00", "image/x-icon"},
+  {0, 3, "ID3", "audio/mpeg"},
+  {0, 4, "OggS", "audio/ogg"},
+  {0, 4, "fLaC", "audio/flac"},
+  {0, 4, "PK\x03\x04", "application/zip"},
+  {0, 4, "PK\x05\x06", "application/zip"},
+  {0, 2, "\x1f\x8b", "application/gzip"},
+  {0, 6, "7z\xbc\xaf\x27\x1c", "application/x-7z-compressed"},
+  {0, 6, "Rar!\x1a\x07", "application/vnd.rar"},
+  {0, 6, "\xfd" "7zXZ\x00", "application/x-xz"},
+  {0, 3, "BZh", "application/x-bzip2"},
+  {0, 4, "\x28\xb5\x2f\xfd", "application/zstd"},
+  {0, 5, "%PDF-", "application/pdf"},
+  {257, 5, "ustar", "application/x-tar"},
+};
+
+
+/**
+ * Sniffed mime types, keyed by file identity and modification time.
+ **/
+static struct {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtim;
+  const char* mime;
+  bool valid;
+} g_sniff_cache[MIME_SNIFF_CACHE_SIZE];
+
+
+/**
+ * Lock protecting the cache above.
+ **/
+static pthread_mutex_t g_sniff_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * Check if the given buffer is UTF-8 text. If the buffer only holds the
+ * beginning of the file, a truncated sequence at its end is accepted.
+ **/
+static bool
+mime_sniff_text(const uint8_t* buf, size_t len, bool partial) {
+  size_t n;
+
+  for(size_t i=0; i<len; i+=n) {
+    if(buf[i] < 0x80) {
+      // allow tabs, line breaks, form feeds and escapes for terminal colors
+      if(buf[i] < 0x20 && !strchr("\t\n\r\f\x1b", buf[i])) {
+	return false;
+      }
+      if(buf[i] == 0x7f) {
+	return false;
+      }
+      n = 1;
+      continue;
+    }
+
+    if(buf[i] >= 0xc2 && buf[i] <= 0xdf) {
+      n = 2;
+    } else if(buf[i] >= 0xe0 && buf[i] <= 0xef) {
+      n = 3;
+    } else if(buf[i] >= 0xf0 && buf[i] <= 0xf4) {
+      n = 4;
+    } else {
+      return false;
+    }
+
+    for(size_t j=1; j<n; j++) {
+      if(i + j >= len) {
+	return partial;
+      }
+      if((buf[i + j] & 0xc0) != 0x80) {
+	return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+
+/**
+ * Guess the mime type of a file from the first bytes of its content.
+ **/
+static const char*
+mime_sniff_content(int fd, const struct stat* st) {
+  uint8_t buf[MIME_SNIFF_SIZE];
+  uint8_t id[5];
+  ssize_t len;
+
+  if((len=pread(fd, buf, sizeof(buf), 0)) <= 0) {
     return 0;
   }
 
-  for(int i=0; g_ext2mime[i].ext; i++) {
-    if(!strcmp(ext, g_ext2mime[i].ext)) {
-      return g_ext2mime[i].mime;
+  for(size_t i=0; i<sizeof(g_magic)/sizeof(g_magic[0]); i++) {
+    if(g_magic[i].off + g_magic[i].len <= len &&
+       !memcmp(buf + g_magic[i].off, g_magic[i].magic, g_magic[i].len)) {
+      return g_magic[i].mime;
     }
   }
+
+  if(len >= 12 && !memcmp(buf, "RIFF", 4)) {
+    if(!memcmp(buf + 8, "WEBP", 4)) {
+      return "image/webp";
+    }
+    if(!memcmp(buf + 8, "WAVE", 4)) {
+      return "audio/wav";
+    }
+    if(!memcmp(buf + 8, "AVI ", 4)) {
+      return "video/x-msvideo";
+    }
+  }
+
+  if(len >= 12 && !memcmp(buf + 4, "ftyp", 4)) {
+    if(!memcmp(buf + 8, "qt  ", 4)) {
+      return "video/quicktime";
+    }
+    if(!memcmp(buf + 8, "M4A ", 4)) {
+      return "audio/mp4";
+    }
+    return "video/mp4";
+  }
+
+  // EBML header, with the document type somewhere among its first elements
+  if(len >= 4 && !memcmp(buf, "\x1a\x45\xdf\xa3", 4)) {
+    for(ssize_t i=4; i+4<=len && i<64; i++) {
+      if(!memcmp(buf + i, "webm", 4)) {
+	return "video/webm";
+      }
+    }
+    return "video/x-matroska";
+  }
+
+  // MPEG transport stream, made of 188 byte packets with a sync byte
+  if(len > 376 && buf[0] == 0x47 && buf[188] == 0x47 && buf[376] == 0x47) {
+    return "video/mp2t";
+  }
+
+  // MPEG audio frame without an ID3 tag, i.e. a frame sync followed by a
+  // valid version and layer
+  if(len >= 2 && buf[0] == 0xff && (buf[1] & 0xe0) == 0xe0 &&
+     (buf[1] & 0x18) != 0x08 && (buf[1] & 0x06)) {
+    return "audio/mpeg";
+  }
+
+  // ISO9660 keeps its first volume descriptor at sector 16, past the bytes
+  // read above, so peek at its identifier separately
+  if(st->st_size >= 0x8006 && pread(fd, id, sizeof(id), 0x8001) == 5 &&
+     !memcmp(id, "CD001", 5)) {
+    return "application/x-iso9660-image";
+  }
+
+  if(mime_sniff_text(buf, len, st->st_size > len)) {
+    return MIME_TEXT;
+  }
+
   return 0;
 }
+
+
+const char*
+mime_sniff(int fd, const struct stat* st) {
+  uint64_t h = ((uint64_t)st->st_ino ^ st->st_dev) * 0x9e3779b97f4a7c15ULL;
+  size_t i = (h >> 32) & (MIME_SNIFF_CACHE_SIZE - 1);
+  const char* mime;
+
+  if(!S_ISREG(st->st_mode) || !st->st_size) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&g_sniff_lock);
+  if(g_sniff_cache[i].valid && g_sniff_cache[i].dev == st->st_dev &&
+     g_sniff_cache[i].ino == st->st_ino &&
+     g_sniff_cache[i].size == st->st_size &&
+     g_sniff_cache[i].mtim.tv_sec == st->st_mtim.tv_sec &&
+     g_sniff_cache[i].mtim.tv_nsec == st->st_mtim.tv_nsec) {
+    mime = g_sniff_cache[i].mime;
+    pthread_mutex_unlock(&g_sniff_lock);
+    return mime;
+  }
+  pthread_mutex_unlock(&g_sniff_lock);
+
+  mime = mime_sniff_content(fd, st);
+
+  pthread_mutex_lock(&g_sniff_lock);
+  g_sniff_cache[i].dev = st->st_dev;
+  g_sniff_cache[i].ino = st->st_ino;
+  g_sniff_cache[i].size = st->st_size;
+  g_sniff_cache[i].mtim = st->st_mtim;
+  g_sniff_cache[i].mime = mime;
+  g_sniff_cache[i].valid = true;
+  pthread_mutex_unlock(&g_sniff_lock);
+
+  return mime;
+}
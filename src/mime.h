@@ -16,8 +16,18 @@ along with this program; see the file COPYING. If not, see
 
 #pragma once
 
+#include <sys/stat.h>
+
 
 /**
  * Lookup the mime type of a file.
  **/
 const char* mime_get_type(const char *filename);
+
+
+/**
+ * Guess the mime type of an open regular file from its first bytes. Results
+ * are cached per inode and modification time. Returns NULL if the content is
+ * not recognized.
+ **/
+const char* mime_sniff(int fd, const struct stat* st);
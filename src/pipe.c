@@ -0,0 +1,270 @@
+/* Copyright (C) 2026 John Törnblom
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation; either version 3, or (at your option) any
+later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; see the file COPYING. If not, see
+<http://www.gnu.org/licenses/>.  */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+
+#include <microhttpd.h>
+
+#include "pipe.h"
+
+
+/**
+ * State for a pipe that is streamed to a http connection.
+ **/
+typedef struct pipe_watch {
+  struct MHD_Connection *conn;
+  int fd;
+  bool registered;
+  bool armed;
+  struct pipe_watch *next;
+} pipe_watch_t;
+
+
+/**
+ * Global state variables.
+ **/
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t g_once = PTHREAD_ONCE_INIT;
+static pthread_t g_thread;
+static pipe_watch_t* g_watch_seq = 0;
+static int g_pollfd = -1;
+
+
+/**
+ * Resume a suspended connection once its pipe has become readable.
+ **/
+static void
+pipe_watch_fire(pipe_watch_t* pw) {
+  pthread_mutex_lock(&g_lock);
+
+  // the response might have been destroyed while the event was in flight
+  for(pipe_watch_t* it=g_watch_seq; it; it=it->next) {
+    if(it == pw && pw->armed) {
+      pw->armed = false;
+      MHD_resume_connection(pw->conn);
+      break;
+    }
+  }
+
+  pthread_mutex_unlock(&g_lock);
+}
+
+
+/**
+ * Thread that waits for readiness events on all watched pipes.
+ **/
+static void*
+pipe_watch_thread(void* args) {
+#ifdef __linux__
+  struct epoll_event evs[32];
+#else
+  struct kevent evs[32];
+#endif
+  int n;
+
+  while(1) {
+#ifdef __linux__
+    n = epoll_wait(g_pollfd, evs, 32, -1);
+#else
+    n = kevent(g_pollfd, 0, 0, evs, 32, 0);
+#endif
+    if(n < 0) {
+      if(errno == EINTR) {
+	continue;
+      }
+      perror("pipe_watch_thread");
+      break;
+    }
+
+    for(int i=0; i<n; i++) {
+#ifdef __linux__
+      pipe_watch_fire(evs[i].data.ptr);
+#else
+      pipe_watch_fire(evs[i].udata);
+#endif
+    }
+  }
+
+  return 0;
+}
+
+
+/**
+ * Create the event queue and start the watcher thread.
+ **/
+static void
+pipe_watch_init(void) {
+#ifdef __linux__
+  g_pollfd = epoll_create1(EPOLL_CLOEXEC);
+#else
+  g_pollfd = kqueue();
+#endif
+  if(g_pollfd < 0) {
+    perror("pipe_watch_init");
+    return;
+  }
+
+  if(pthread_create(&g_thread, 0, pipe_watch_thread, 0)) {
+    perror("pthread_create");
+    close(g_pollfd);
+    g_pollfd = -1;
+  }
+}
+
+
+/**
+ * Ask the watcher thread to resume the connection once the pipe is readable.
+ **/
+static int
+pipe_watch_arm(pipe_watch_t* pw) {
+#ifdef __linux__
+  struct epoll_event ev = {.events = EPOLLIN | EPOLLONESHOT, .data.ptr = pw};
+  int op = pw->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+#else
+  struct kevent ev;
+#endif
+  int err;
+
+  pthread_mutex_lock(&g_lock);
+  pw->armed = true;
+#ifdef __linux__
+  err = epoll_ctl(g_pollfd, op, pw->fd, &ev);
+#else
+  EV_SET(&ev, pw->fd, EVFILT_READ, EV_ADD | EV_ONESHOT, 0, 0, pw);
+  err = kevent(g_pollfd, &ev, 1, 0, 0, 0);
+#endif
+  if(err) {
+    pw->armed = false;
+  } else {
+    pw->registered = true;
+  }
+  pthread_mutex_unlock(&g_lock);
+
+  return err;
+}
+
+
+/**
+ * Read data from a pipe.
+ **/
+static ssize_t
+pipe_read(void *cls, uint64_t pos, char *buf, size_t max) {
+  pipe_watch_t* pw = cls;
+  ssize_t len;
+
+  if((len=read(pw->fd, buf, max)) > 0) {
+    return len;
+  }
+  if(!len) {
+    return MHD_CONTENT_READER_END_OF_STREAM;
+  }
+  if(errno == EINTR) {
+    return 0;
+  }
+  if(errno != EAGAIN && errno != EWOULDBLOCK) {
+    return MHD_CONTENT_READER_END_WITH_ERROR;
+  }
+
+  // nothing to read yet, park the connection until there is
+  MHD_suspend_connection(pw->conn);
+  if(pipe_watch_arm(pw)) {
+    perror("pipe_watch_arm");
+    MHD_resume_connection(pw->conn);
+    return MHD_CONTENT_READER_END_WITH_ERROR;
+  }
+
+  return 0;
+}
+
+
+/**
+ * Stop watching a pipe, and close it.
+ **/
+static void
+pipe_close(void *cls) {
+  pipe_watch_t* pw = cls;
+
+  pthread_mutex_lock(&g_lock);
+  for(pipe_watch_t** it=&g_watch_seq; *it; it=&(*it)->next) {
+    if(*it == pw) {
+      *it = pw->next;
+      break;
+    }
+  }
+#ifdef __linux__
+  if(pw->registered) {
+    epoll_ctl(g_pollfd, EPOLL_CTL_DEL, pw->fd, 0);
+  }
+#endif
+  close(pw->fd);
+  pthread_mutex_unlock(&g_lock);
+
+  free(pw);
+}
+
+
+struct MHD_Response*
+pipe_create_response(struct MHD_Connection *conn, int fd) {
+  struct MHD_Response *resp;
+  pipe_watch_t* pw;
+  int flags;
+
+  pthread_once(&g_once, pipe_watch_init);
+
+  // without a watcher thread, fall back on blocking reads
+  if(g_pollfd < 0) {
+    return MHD_create_response_from_pipe(fd);
+  }
+
+  if((flags=fcntl(fd, F_GETFL)) < 0 ||
+     fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    return MHD_create_response_from_pipe(fd);
+  }
+
+  if(!(pw=calloc(1, sizeof(pipe_watch_t)))) {
+    return 0;
+  }
+
+  pw->conn = conn;
+  pw->fd = fd;
+
+  if(!(resp=MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 0x4000,
+					      &pipe_read, pw, &pipe_close))) {
+    free(pw);
+    return 0;
+  }
+
+  pthread_mutex_lock(&g_lock);
+  pw->next = g_watch_seq;
+  g_watch_seq = pw;
+  pthread_mutex_unlock(&g_lock);
+
+  return resp;
+}
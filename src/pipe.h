@@ -0,0 +1,31 @@
+/* Copyright (C) 2026 John Törnblom
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation; either version 3, or (at your option) any
+later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; see the file COPYING. If not, see
+<http://www.gnu.org/licenses/>.  */
+
+#pragma once
+
+#include <microhttpd.h>
+
+
+/**
+ * Create a response that streams data read from the given file descriptor
+ * (typically the read end of a pipe) until EOF. While the descriptor has no
+ * data available, the connection is suspended and later resumed by a shared
+ * watcher thread, so no worker thread is parked on a blocking read.
+ *
+ * The response takes ownership of the file descriptor.
+ **/
+struct MHD_Response* pipe_create_response(struct MHD_Connection *conn,
+					  int fd);
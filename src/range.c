@@ -0,0 +1,318 @@
+/* Copyright (C) 2026 John Törnblom
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation; either version 3, or (at your option) any
+later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; see the file COPYING. If not, see
+<http://www.gnu.org/licenses/>.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <microhttpd.h>
+
+#include "range.h"
+#include "task.h"
+
+
+/**
+ * Maximum number of range specifiers accepted in a header, before they are
+ * coalesced. Headers with more than that are ignored.
+ **/
+#define RANGE_SPEC_MAX (4 * RANGE_MAX)
+
+
+/**
+ * A part of a multipart/byteranges body, i.e., a header followed by data.
+ **/
+typedef struct range_part {
+  uint64_t pos;
+  size_t head_off;
+  size_t head_len;
+  uint64_t start;
+  uint64_t len;
+} range_part_t;
+
+
+/**
+ * State for a multipart/byteranges response.
+ **/
+typedef struct range_sm {
+  MHD_ContentReaderCallback read_cb;
+  MHD_ContentReaderFreeCallback free_cb;
+  void* cls;
+
+  int nparts;
+  range_part_t parts[RANGE_MAX + 1];
+  char* heads;
+} range_sm_t;
+
+
+/**
+ * Parse a single range specifier, e.g., "0-499", "500-" or "-500".
+ * Returns 0 on success, 1 if the range is unsatisfiable, and -1 if the
+ * specifier is malformed.
+ **/
+static int
+range_parse_spec(const char* s, const char* e, uint64_t size, range_t* r) {
+  char* p;
+
+  while(s < e && (*s == ' ' || *s == '\t')) {
+    s++;
+  }
+  while(e > s && (e[-1] == ' ' || e[-1] == '\t')) {
+    e--;
+  }
+  if(s == e) {
+    return -1;
+  }
+
+  // a suffix range, e.g. "-500", means the last 500 bytes
+  if(*s == '-') {
+    if(s + 1 == e || s[1] < '0' || s[1] > '9') {
+      return -1;
+    }
+    r->start = strtoull(s + 1, &p, 10);
+    if(p != e) {
+      return -1;
+    }
+    if(!r->start || !size) {
+      return 1;
+    }
+    r->start = (r->start < size) ? size - r->start : 0;
+    r->end = size - 1;
+    return 0;
+  }
+
+  if(*s < '0' || *s > '9') {
+    return -1;
+  }
+  r->start = strtoull(s, &p, 10);
+  if(*p != '-') {
+    return -1;
+  }
+
+  // an absent last-pos, e.g. "500-", means the rest of the resource
+  if(++p == e) {
+    r->end = size - 1;
+  } else {
+    if(*p < '0' || *p > '9') {
+      return -1;
+    }
+    r->end = strtoull(p, &p, 10);
+    if(p != e || r->end < r->start) {
+      return -1;
+    }
+    if(r->end >= size) {
+      r->end = size - 1;
+    }
+  }
+
+  return (r->start >= size);
+}
+
+
+int
+range_parse(const char* header, uint64_t size, range_t ranges[RANGE_MAX]) {
+  range_t specs[RANGE_SPEC_MAX];
+  const char* s;
+  const char* e;
+  range_t r;
+  int n = 0;
+  int i;
+  int j;
+
+  if(!header || strncmp("bytes=", header, 6) || !header[6]) {
+    return -1;
+  }
+
+  for(s=header+6; *s; s=*e ? e+1 : e) {
+    e = s + strcspn(s, ",");
+    switch(range_parse_spec(s, e, size, &r)) {
+    case 0:
+      if(n == RANGE_SPEC_MAX) {
+	return -1;
+      }
+      // insertion sort on the first byte position
+      for(i=n++; i > 0 && specs[i-1].start > r.start; i--) {
+	specs[i] = specs[i-1];
+      }
+      specs[i] = r;
+      break;
+
+    case 1:
+      break;
+
+    default:
+      return -1;
+    }
+  }
+
+  // coalesce overlapping and adjacent ranges
+  for(i=0, j=0; i<n; i++) {
+    if(j && specs[i].start <= ranges[j-1].end + 1) {
+      if(specs[i].end > ranges[j-1].end) {
+	ranges[j-1].end = specs[i].end;
+      }
+    } else if(j == RANGE_MAX) {
+      return -1;
+    } else {
+      ranges[j++] = specs[i];
+    }
+  }
+
+  return j;
+}
+
+
+void
+range_content_range(const range_t* r, uint64_t size, char* buf,
+		    size_t bufsize) {
+  snprintf(buf, bufsize, "bytes %llu-%llu/%llu", (unsigned long long)r->start,
+	   (unsigned long long)r->end, (unsigned long long)size);
+}
+
+
+/**
+ * Read parts of a multipart/byteranges body.
+ **/
+static ssize_t
+range_read(void *cls, uint64_t pos, char *buf, size_t max) {
+  range_sm_t* sm = cls;
+  range_part_t* part;
+  uint64_t off;
+  ssize_t len;
+
+  for(int i=0; i<sm->nparts; i++) {
+    part = &sm->parts[i];
+    if(pos >= part->pos + part->head_len + part->len) {
+      continue;
+    }
+
+    off = pos - part->pos;
+    if(off < part->head_len) {
+      len = part->head_len - off;
+      len = (len < max) ? len : max;
+      memcpy(buf, sm->heads + part->head_off + off, len);
+      return len;
+    }
+
+    off -= part->head_len;
+    if(part->len - off < max) {
+      max = part->len - off;
+    }
+    if((len=sm->read_cb(sm->cls, part->start + off, buf, max)) <= 0) {
+      return MHD_CONTENT_READER_END_WITH_ERROR;
+    }
+    return len;
+  }
+
+  return MHD_CONTENT_READER_END_OF_STREAM;
+}
+
+
+/**
+ * Release resources held by a multipart/byteranges response.
+ **/
+static void
+range_close(void *cls) {
+  range_sm_t* sm = cls;
+
+  if(sm->free_cb) {
+    sm->free_cb(sm->cls);
+  }
+  free(sm->heads);
+  free(sm);
+}
+
+
+struct MHD_Response*
+range_create_multipart_response(struct MHD_Connection *conn,
+				const range_t* ranges, int n, uint64_t size,
+				const char* mime,
+				MHD_ContentReaderCallback read_cb, void* cls,
+				MHD_ContentReaderFreeCallback free_cb) {
+  static unsigned int counter = 0;
+  struct MHD_Response *resp;
+  char content_range[128];
+  char boundary[64];
+  char ctype[128];
+  uint64_t pos = 0;
+  range_sm_t* sm;
+  size_t off = 0;
+  size_t max;
+
+  if(!(sm=calloc(1, sizeof(range_sm_t)))) {
+    return 0;
+  }
+
+  sm->read_cb = read_cb;
+  sm->free_cb = free_cb;
+  sm->cls = cls;
+
+  snprintf(boundary, sizeof(boundary), "websrv-%08lx%08x",
+	   (unsigned long)time(0), __atomic_add_fetch(&counter, 1,
+						      __ATOMIC_RELAXED));
+
+  max = (n + 1) * (sizeof(boundary) + sizeof(content_range) + 128 +
+		   (mime ? strlen(mime) : 0));
+  if(!(sm->heads=malloc(max))) {
+    free(sm);
+    return 0;
+  }
+
+  for(int i=0; i<n; i++) {
+    range_content_range(&ranges[i], size, content_range,
+			sizeof(content_range));
+    sm->parts[i].pos = pos;
+    sm->parts[i].head_off = off;
+    sm->parts[i].head_len = sprintf(sm->heads + off,
+				    "%s--%s\r\n%s%s%s"
+				    "Content-Range: %s\r\n\r\n",
+				    i ? "\r\n" : "", boundary,
+				    mime ? "Content-Type: " : "",
+				    mime ? mime : "", mime ? "\r\n" : "",
+				    content_range);
+    sm->parts[i].start = ranges[i].start;
+    sm->parts[i].len = ranges[i].end - ranges[i].start + 1;
+    off += sm->parts[i].head_len;
+    pos += sm->parts[i].head_len + sm->parts[i].len;
+  }
+
+  // the closing delimiter is a part without data
+  sm->parts[n].pos = pos;
+  sm->parts[n].head_off = off;
+  sm->parts[n].head_len = sprintf(sm->heads + off, "\r\n--%s--\r\n",
+				  boundary);
+  pos += sm->parts[n].head_len;
+  sm->nparts = n + 1;
+
+  if(conn) {
+    resp = task_create_response(conn, pos, 0x8000, &range_read, sm,
+				&range_close);
+  } else {
+    resp = MHD_create_response_from_callback(pos, 0x8000, &range_read, sm,
+					     &range_close);
+  }
+  if(!resp) {
+    free(sm->heads);
+    free(sm);
+    return 0;
+  }
+
+  snprintf(ctype, sizeof(ctype), "multipart/byteranges; boundary=%s",
+	   boundary);
+  MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE, ctype);
+
+  return resp;
+}
@@ -0,0 +1,75 @@
+/* Copyright (C) 2026 John Törnblom
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation; either version 3, or (at your option) any
+later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; see the file COPYING. If not, see
+<http://www.gnu.org/licenses/>.  */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <microhttpd.h>
+
+
+/**
+ * Maximum number of ranges served in a single response, after overlapping
+ * and adjacent ranges have been coalesced.
+ **/
+#define RANGE_MAX 16
+
+
+/**
+ * An inclusive byte range.
+ **/
+typedef struct range {
+  uint64_t start;
+  uint64_t end;
+} range_t;
+
+
+/**
+ * Parse a Range header of a resource with the given size into at most
+ * RANGE_MAX ranges, sorted and with overlapping and adjacent ranges
+ * coalesced. Returns the number of ranges, 0 if none of them can be
+ * satisfied, or -1 if the header is absent, malformed or asks for too many
+ * ranges, in which case the whole resource should be served.
+ **/
+int range_parse(const char* header, uint64_t size, range_t ranges[RANGE_MAX]);
+
+
+/**
+ * Format the Content-Range header value of a range.
+ **/
+void range_content_range(const range_t* r, uint64_t size, char* buf,
+			 size_t bufsize);
+
+
+/**
+ * Create a multipart/byteranges response for the given ranges. The body is
+ * streamed with read_cb, which is invoked with offsets into the resource
+ * rather than into the response body, and must return the number of bytes
+ * read, or a negative value on error. The Content-Type header is set by this
+ * function, and mime (if not NULL) is used for the parts. If conn is not
+ * NULL, read_cb and free_cb are invoked on helper threads, see
+ * task_create_response().
+ *
+ * Like MHD_create_response_from_callback(), free_cb is invoked with cls once
+ * the response is destroyed, but not when this function fails.
+ **/
+struct MHD_Response* range_create_multipart_response(struct MHD_Connection *conn,
+						     const range_t* ranges,
+						     int n, uint64_t size,
+						     const char* mime,
+						     MHD_ContentReaderCallback read_cb,
+						     void* cls,
+						     MHD_ContentReaderFreeCallback free_cb);
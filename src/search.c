@@ -0,0 +1,530 @@
+/* Copyright (C) 2026 John Törnblom
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation; either version 3, or (at your option) any
+later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; see the file COPYING. If not, see
+<http://www.gnu.org/licenses/>.  */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <pthread.h>
+#include <regex.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include <microhttpd.h>
+
+#include "dirlist.h"
+#include "pipe.h"
+#include "search.h"
+#include "task.h"
+#include "websrv.h"
+
+
+/**
+ * Maximum number of jobs that walk the file system for each search. Jobs
+ * run on the shared helper threads, see task.c.
+ **/
+#ifndef SEARCH_WORKERS
+#define SEARCH_WORKERS 4
+#endif
+
+
+/**
+ * Maximum number of directories queued for the jobs of a search. Beyond that,
+ * a job descends into subdirectories itself, which bounds the number of
+ * open directory file descriptors.
+ **/
+#define SEARCH_QUEUE_MAX 64
+
+
+/**
+ * Bad Request (400)
+ **/
+#define PAGE_400                          \
+  "<html>"                                \
+  "  <head>"                              \
+  "    <title>Bad request</title>"        \
+  "  </head>"                             \
+  "  <body>Bad request</body>"            \
+  "</html>"
+
+
+/**
+ * File not found (404)
+ **/
+#define PAGE_404                      \
+  "<html>"                            \
+    "<head>"                          \
+      "<title>File not found</title>" \
+    "</head>"                         \
+    "<body>File not found</body>"     \
+  "</html>"
+
+
+/**
+ * Internal Server Error (500)
+ **/
+#define PAGE_500                                 \
+  "<html>"                                       \
+  "  <head>"                                     \
+  "    <title>Internal server error</title>"     \
+  "  </head>"                                    \
+  "  <body>Internal server error</body>"         \
+  "</html>"
+
+
+/**
+ * A directory waiting to be searched.
+ **/
+typedef struct search_dir {
+  int fd;
+  int depth;
+  char* path;
+  struct search_dir* next;
+} search_dir_t;
+
+
+/**
+ * State shared by the jobs of a search.
+ **/
+typedef struct search {
+  pthread_mutex_t lock;
+  search_dir_t* queue;
+  size_t queued;
+  int jobs;
+  bool cancel;
+
+  pthread_mutex_t out_lock;
+  int out;
+  size_t matches;
+
+  struct {
+    const char* glob;
+    regex_t regex;
+    bool has_regex;
+    char type;
+    long long minsize;
+    long long maxsize;
+    long long after;
+    long long before;
+    int maxdepth;
+    size_t limit;
+    char* glob_buf;
+  } crit;
+} search_t;
+
+
+/**
+ * Check if a search has been cancelled, either because the client went
+ * away or because enough matches were found.
+ **/
+static bool
+search_cancelled(search_t* s) {
+  bool cancel;
+
+  pthread_mutex_lock(&s->lock);
+  cancel = s->cancel;
+  pthread_mutex_unlock(&s->lock);
+
+  return cancel;
+}
+
+
+/**
+ * Cancel a search, its jobs stop at the next directory entry.
+ **/
+static void
+search_cancel(search_t* s) {
+  pthread_mutex_lock(&s->lock);
+  s->cancel = true;
+  pthread_mutex_unlock(&s->lock);
+}
+
+
+/**
+ * Write a match to the client as a line of JSON.
+ **/
+static void
+search_emit(search_t* s, const char* path, char mode, const struct stat* st) {
+  char buf[6 * PATH_MAX + 128];
+  bool done = false;
+  ssize_t len;
+  size_t off;
+  char* p;
+
+  p = buf;
+  p += sprintf(p, "{\"path\": ");
+  p += dirlist_json_string(p, path);
+  p += sprintf(p, ",\"mode\": \"%c\",\"mtime\": %lld,\"size\": %lld}\n",
+	       mode, (long long)st->st_mtim.tv_sec, (long long)st->st_size);
+
+  pthread_mutex_lock(&s->out_lock);
+  for(off=0; off < p - buf; off += len) {
+    if((len=write(s->out, buf + off, (p - buf) - off)) < 0) {
+      if(errno == EINTR) {
+	len = 0;
+	continue;
+      }
+      // most likely EPIPE, i.e., the client has disconnected
+      done = true;
+      break;
+    }
+  }
+  if(++s->matches >= s->crit.limit) {
+    done = true;
+  }
+  pthread_mutex_unlock(&s->out_lock);
+
+  if(done) {
+    search_cancel(s);
+  }
+}
+
+
+/**
+ * Check if a directory entry matches the search criteria.
+ **/
+static bool
+search_match(search_t* s, const char* name, char mode, const struct stat* st) {
+  if(s->crit.type && s->crit.type != mode) {
+    return false;
+  }
+  if(s->crit.glob && fnmatch(s->crit.glob, name, 0)) {
+    return false;
+  }
+  if(s->crit.has_regex && regexec(&s->crit.regex, name, 0, 0, 0)) {
+    return false;
+  }
+  if(st->st_size < s->crit.minsize || st->st_size > s->crit.maxsize) {
+    return false;
+  }
+  if(st->st_mtim.tv_sec < s->crit.after ||
+     st->st_mtim.tv_sec >= s->crit.before) {
+    return false;
+  }
+
+  return true;
+}
+
+
+static void search_job(void* arg);
+
+
+/**
+ * Queue a directory, and start another job for it unless the search
+ * already has SEARCH_WORKERS of them. Only a running search spreads out,
+ * search_request() starts the first job. Returns -1 if the queue is full.
+ **/
+static int
+search_push(search_t* s, int fd, int depth, const char* path) {
+  search_dir_t* sd;
+
+  pthread_mutex_lock(&s->lock);
+  if(s->queued >= SEARCH_QUEUE_MAX) {
+    pthread_mutex_unlock(&s->lock);
+    return -1;
+  }
+  pthread_mutex_unlock(&s->lock);
+
+  if(!(sd=malloc(sizeof(search_dir_t)))) {
+    return -1;
+  }
+  if(!(sd->path=strdup(path))) {
+    free(sd);
+    return -1;
+  }
+  sd->fd = fd;
+  sd->depth = depth;
+
+  pthread_mutex_lock(&s->lock);
+  sd->next = s->queue;
+  s->queue = sd;
+  s->queued++;
+  if(s->jobs && s->jobs < SEARCH_WORKERS && !task_submit(search_job, s)) {
+    s->jobs++;
+  }
+  pthread_mutex_unlock(&s->lock);
+
+  return 0;
+}
+
+
+/**
+ * Search a directory, given as an open file descriptor. The descriptor is
+ * closed before returning.
+ **/
+static void
+search_dir(search_t* s, int fd, int depth, const char* path) {
+  char child[PATH_MAX];
+  struct dirent* entry;
+  struct stat st;
+  char mode;
+  DIR* dir;
+  int cfd;
+
+  if(!(dir=fdopendir(fd))) {
+    close(fd);
+    return;
+  }
+
+  while(!search_cancelled(s) && (entry=readdir(dir))) {
+    if(!strcmp(entry->d_name, ".") ||
+       !strcmp(entry->d_name, "..")) {
+      continue;
+    }
+
+    // symlinks are reported but not followed, to avoid loops
+    if(fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+      continue;
+    }
+    if(S_ISDIR(st.st_mode)) {
+      mode = 'd';
+    } else if(S_ISLNK(st.st_mode)) {
+      mode = 'l';
+    } else {
+      mode = '-';
+    }
+
+    if(snprintf(child, sizeof(child), "%s%s%s", path,
+		path[strlen(path)-1] == '/' ? "" : "/",
+		entry->d_name) >= sizeof(child)) {
+      continue;
+    }
+
+    if(search_match(s, entry->d_name, mode, &st)) {
+      search_emit(s, child, mode, &st);
+    }
+
+    if(mode != 'd' || depth + 1 >= s->crit.maxdepth) {
+      continue;
+    }
+    if((cfd=openat(dirfd(dir), entry->d_name,
+		   O_RDONLY | O_DIRECTORY | O_NOFOLLOW)) < 0) {
+      continue;
+    }
+    if(search_push(s, cfd, depth + 1, child)) {
+      search_dir(s, cfd, depth + 1, child);
+    }
+  }
+
+  closedir(dir);
+}
+
+
+/**
+ * Release resources held by a search.
+ **/
+static void
+search_destroy(search_t* s) {
+  search_dir_t* sd;
+
+  while((sd=s->queue)) {
+    s->queue = sd->next;
+    close(sd->fd);
+    free(sd->path);
+    free(sd);
+  }
+
+  if(s->crit.has_regex) {
+    regfree(&s->crit.regex);
+  }
+  if(s->out >= 0) {
+    close(s->out);
+  }
+
+  pthread_mutex_destroy(&s->lock);
+  pthread_mutex_destroy(&s->out_lock);
+  free(s->crit.glob_buf);
+  free(s);
+}
+
+
+/**
+ * Search one queued directory on a helper thread. The job then goes to the
+ * back of the line for the next one rather than holding on to the thread,
+ * so that a long search does not starve other requests. The last job to
+ * finish closes the output, which ends the http response.
+ **/
+static void
+search_job(void* arg) {
+  search_t* s = arg;
+  bool last = false;
+  search_dir_t* sd;
+
+  pthread_mutex_lock(&s->lock);
+  if(!s->cancel && (sd=s->queue)) {
+    s->queue = sd->next;
+    s->queued--;
+    pthread_mutex_unlock(&s->lock);
+
+    search_dir(s, sd->fd, sd->depth, sd->path);
+    free(sd->path);
+    free(sd);
+
+    pthread_mutex_lock(&s->lock);
+  }
+
+  if(s->cancel || !s->queue || task_submit(search_job, s)) {
+    last = !--s->jobs;
+  }
+  pthread_mutex_unlock(&s->lock);
+
+  if(last) {
+    search_destroy(s);
+  }
+}
+
+
+/**
+ * Parse an optional numeric query argument.
+ **/
+static long long
+search_arg_num(struct MHD_Connection *conn, const char* key, long long def) {
+  const char* s;
+
+  if(!(s=MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, key))) {
+    return def;
+  }
+
+  return strtoll(s, 0, 10);
+}
+
+
+/**
+ * Respond with a static page.
+ **/
+static enum MHD_Result
+search_respond(struct MHD_Connection *conn, unsigned int status,
+	       const char* page) {
+  enum MHD_Result ret = MHD_NO;
+  struct MHD_Response *resp;
+
+  if((resp=MHD_create_response_from_buffer(strlen(page), (void*)page,
+					   MHD_RESPMEM_PERSISTENT))) {
+    MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE, "text/html");
+    ret = websrv_queue_response(conn, status, resp);
+    MHD_destroy_response(resp);
+  }
+
+  return ret;
+}
+
+
+enum MHD_Result
+search_request(struct MHD_Connection *conn, const char* url) {
+  const char* path = url + strlen("/fs-search");
+  enum MHD_Result ret = MHD_NO;
+  struct MHD_Response *resp;
+  const char* regex;
+  const char* type;
+  const char* glob;
+  search_t* s;
+  int fds[2];
+  int fd;
+
+  if(!path[0]) {
+    path = "/";
+  }
+
+  glob = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "name");
+  regex = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "regex");
+  type = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "type");
+
+  if(!(s=calloc(1, sizeof(search_t)))) {
+    return search_respond(conn, MHD_HTTP_INTERNAL_SERVER_ERROR, PAGE_500);
+  }
+
+  pthread_mutex_init(&s->lock, 0);
+  pthread_mutex_init(&s->out_lock, 0);
+  s->out = -1;
+
+  if(glob && !(s->crit.glob=s->crit.glob_buf=strdup(glob))) {
+    search_destroy(s);
+    return search_respond(conn, MHD_HTTP_INTERNAL_SERVER_ERROR, PAGE_500);
+  }
+  if(regex) {
+    if(regcomp(&s->crit.regex, regex, REG_EXTENDED | REG_NOSUB)) {
+      search_destroy(s);
+      return search_respond(conn, MHD_HTTP_BAD_REQUEST, PAGE_400);
+    }
+    s->crit.has_regex = true;
+  }
+  if(type && !strcmp(type, "f")) {
+    s->crit.type = '-';
+  } else if(type && !strcmp(type, "d")) {
+    s->crit.type = 'd';
+  } else if(type && !strcmp(type, "l")) {
+    s->crit.type = 'l';
+  }
+
+  s->crit.minsize = search_arg_num(conn, "minsize", 0);
+  s->crit.maxsize = search_arg_num(conn, "maxsize", LLONG_MAX);
+  s->crit.after = search_arg_num(conn, "after", LLONG_MIN);
+  s->crit.before = search_arg_num(conn, "before", LLONG_MAX);
+  s->crit.maxdepth = (int)search_arg_num(conn, "maxdepth", INT_MAX);
+  s->crit.limit = (size_t)search_arg_num(conn, "limit", 0);
+  if(!s->crit.limit) {
+    s->crit.limit = SIZE_MAX;
+  }
+
+  if((fd=open(path, O_RDONLY | O_DIRECTORY)) < 0) {
+    search_destroy(s);
+    return search_respond(conn, MHD_HTTP_NOT_FOUND, PAGE_404);
+  }
+
+  if(s->crit.maxdepth <= 0 || search_push(s, fd, 0, path)) {
+    close(fd);
+    search_destroy(s);
+    return search_respond(conn, MHD_HTTP_BAD_REQUEST, PAGE_400);
+  }
+
+  if(pipe(fds)) {
+    search_destroy(s);
+    return search_respond(conn, MHD_HTTP_INTERNAL_SERVER_ERROR, PAGE_500);
+  }
+  s->out = fds[1];
+
+  if(!(resp=pipe_create_response(conn, fds[0]))) {
+    close(fds[0]);
+    search_destroy(s);
+    return MHD_NO;
+  }
+
+  // the first job searches the root directory, and starts more jobs as it
+  // queues subdirectories
+  pthread_mutex_lock(&s->lock);
+  if(task_submit(search_job, s)) {
+    pthread_mutex_unlock(&s->lock);
+    MHD_destroy_response(resp);
+    search_destroy(s);
+    return search_respond(conn, MHD_HTTP_INTERNAL_SERVER_ERROR, PAGE_500);
+  }
+  s->jobs = 1;
+  pthread_mutex_unlock(&s->lock);
+
+  MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE,
+			  "application/x-ndjson");
+  MHD_add_response_header(resp, MHD_HTTP_HEADER_CACHE_CONTROL, "no-cache");
+  ret = websrv_queue_response(conn, MHD_HTTP_OK, resp);
+  MHD_destroy_response(resp);
+
+  return ret;
+}
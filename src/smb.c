@@ -29,8 +29,12 @@ along with this program; see the file COPYING. If not, see
 #include <smb2/libsmb2.h>
 #include <smb2/libsmb2-raw.h>
 
+#include "dirlist.h"
 #include "mime.h"
+#include "range.h"
 #include "smb.h"
+#include "smbpool.h"
+#include "task.h"
 #include "websrv.h"
 
 
@@ -58,11 +62,29 @@ along with this program; see the file COPYING. If not, see
   "</html>"
 
 
+/**
+ * State of a request that is served on a helper thread while its connection
+ * is suspended. The response is queued once the connection is resumed.
+ **/
+typedef struct smb_request_state {
+  websrv_state_t base;
+  struct MHD_Connection *conn;
+  const char* url;
+  unsigned int status;
+  struct MHD_Response *resp;
+
+  // a server at its cap of sessions that the request is waiting for
+  char wait_server[300];
+  smbpool_waiter_t waiter;
+  int wait_err;
+} smb_request_state_t;
+
+
 /**
  * Arguments used by the shares callback function.
  **/
 typedef struct smb_request_shares_args {
-  struct MHD_Connection *conn;
+  smb_request_state_t *st;
   enum MHD_Result result;
   int finished;
 } smb_request_shares_args_t;
@@ -74,11 +96,60 @@ typedef struct smb_request_shares_args {
 typedef struct smb_request_dir_args {
   struct smb2_context *smb2;
   struct smb2dir* dir;
-  char* path;
   int state;
 } smb_request_dir_args_t;
 
 
+/**
+ * Number of reads kept in flight ahead of the http consumer.
+ **/
+#ifndef SMB_READAHEAD_DEPTH
+#define SMB_READAHEAD_DEPTH 4
+#endif
+
+
+/**
+ * Upper bound on the size of a single read, the server may impose a lower
+ * one.
+ **/
+#ifndef SMB_READAHEAD_CHUNK
+#define SMB_READAHEAD_CHUNK (1024 * 1024)
+#endif
+
+
+/**
+ * Number of bytes passed on to libmicrohttpd at a time. Reads happen on
+ * helper threads, so a block is a round-trip between those and the event
+ * loop that sends it.
+ **/
+#ifndef SMB_BLOCK_SIZE
+#define SMB_BLOCK_SIZE (256 * 1024)
+#endif
+
+
+/**
+ * Number of milliseconds to wait for a read to complete.
+ **/
+#define SMB_READ_TIMEOUT 10000
+
+
+/**
+ * A read in the read-ahead ring.
+ **/
+typedef struct smb_readahead_slot {
+  uint8_t* buf;
+  uint64_t offset;
+  uint32_t len;
+  uint32_t consumed;
+  enum {
+    SMB_SLOT_FREE,
+    SMB_SLOT_PENDING,
+    SMB_SLOT_DONE,
+    SMB_SLOT_FAILED,
+  } state;
+} smb_readahead_slot_t;
+
+
 /**
  * Arguments used by file callback functions.
  **/
@@ -86,29 +157,218 @@ typedef struct smb_request_file_args {
   struct smb2_context *smb2;
   struct smb2fh* file;
   size_t start;
+  uint64_t size;
+  int failed;
+
+  // the requested ranges, read-ahead stops at the end of the current one
+  range_t ranges[RANGE_MAX];
+  int nranges;
+  uint64_t end;
+
+  uint8_t* ring;
+  uint32_t chunk;
+  uint64_t next;
+  int head;
+  int count;
+  smb_readahead_slot_t slots[SMB_READAHEAD_DEPTH];
 } smb_request_file_args_t;
 
 
+/**
+ * Callback function invoked when an asynchronous read has completed.
+ **/
+static void
+smb_readahead_cb(struct smb2_context *smb2, int status, void *command_data,
+                 void *ctx) {
+  smb_readahead_slot_t* slot = (smb_readahead_slot_t*)ctx;
+
+  if(status < 0) {
+    slot->state = SMB_SLOT_FAILED;
+  } else {
+    slot->len = status;
+    slot->state = SMB_SLOT_DONE;
+  }
+}
+
+
+/**
+ * Process smb i/o for at most the given number of milliseconds.
+ **/
+static int
+smb_readahead_service(smb_request_file_args_t* args, int timeout) {
+  struct pollfd pfd;
+  int n;
+
+  pfd.fd = smb2_get_fd(args->smb2);
+  pfd.events = smb2_which_events(args->smb2);
+
+  if((n=poll(&pfd, 1, timeout)) < 0) {
+    return errno == EINTR ? 0 : -1;
+  }
+  if(!n) {
+    // only an error if we were waiting for something
+    return timeout ? -1 : 0;
+  }
+  if(smb2_service(args->smb2, pfd.revents) < 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/**
+ * Wait for all reads in flight to complete, and empty the ring.
+ **/
+static int
+smb_readahead_drain(smb_request_file_args_t* args) {
+  smb_readahead_slot_t* slot;
+  int pending;
+
+  do {
+    pending = 0;
+    for(int i=0; i<SMB_READAHEAD_DEPTH; i++) {
+      pending += (args->slots[i].state == SMB_SLOT_PENDING);
+    }
+    if(pending && smb_readahead_service(args, SMB_READ_TIMEOUT)) {
+      return -1;
+    }
+  } while(pending);
+
+  for(int i=0; i<SMB_READAHEAD_DEPTH; i++) {
+    slot = &args->slots[i];
+    slot->state = SMB_SLOT_FREE;
+    slot->consumed = 0;
+  }
+  args->head = 0;
+  args->count = 0;
+
+  return 0;
+}
+
+
+/**
+ * Restart the read-ahead at the given offset, up to the end of the range
+ * that contains it.
+ **/
+static void
+smb_readahead_seek(smb_request_file_args_t* args, uint64_t offset) {
+  args->next = offset;
+  args->end = offset;
+
+  for(int i=0; i<args->nranges; i++) {
+    if(offset >= args->ranges[i].start && offset <= args->ranges[i].end) {
+      args->end = args->ranges[i].end + 1;
+      break;
+    }
+  }
+}
+
+
+/**
+ * Issue reads until the ring is full, or the end of the range is reached.
+ **/
+static int
+smb_readahead_fill(smb_request_file_args_t* args) {
+  smb_readahead_slot_t* slot;
+  uint64_t len;
+
+  while(args->count < SMB_READAHEAD_DEPTH && args->next < args->end) {
+    slot = &args->slots[(args->head + args->count) % SMB_READAHEAD_DEPTH];
+    len = args->end - args->next;
+    if(len > args->chunk) {
+      len = args->chunk;
+    }
+
+    slot->offset = args->next;
+    slot->len = 0;
+    slot->consumed = 0;
+    slot->state = SMB_SLOT_PENDING;
+    if(smb2_pread_async(args->smb2, args->file, slot->buf, len, slot->offset,
+                        smb_readahead_cb, slot)) {
+      slot->state = SMB_SLOT_FREE;
+      return -1;
+    }
+
+    args->next += len;
+    args->count++;
+  }
+
+  // send the requests without waiting for any replies
+  return smb_readahead_service(args, 0);
+}
+
+
 /**
  * Callback function used to transmit smb file data to a http request.
+ * Reads are issued asynchronously ahead of the position requested by
+ * libmicrohttpd, so that several network round-trips overlap.
  **/
 static ssize_t
 smb_request_file_read_cb(void *ctx, uint64_t pos, char *buf, size_t max) {
   smb_request_file_args_t* args = (smb_request_file_args_t*)ctx;
-  int ret;
+  uint64_t offset = args->start + pos;
+  smb_readahead_slot_t* slot;
+  size_t len;
 
-  if(smb2_lseek(args->smb2, args->file, args->start+pos, SEEK_SET, 0) < 0) {
+  if(args->failed) {
     return MHD_CONTENT_READER_END_WITH_ERROR;
   }
 
-  ret = smb2_read(args->smb2, args->file, (uint8_t*)buf, max);
-  if(ret < 0) {
+  // restart the read-ahead when the position is not where the ring is at,
+  // e.g., at the start of a part in a multipart response, or after a short
+  // read
+  slot = &args->slots[args->head];
+  if(args->count && offset != slot->offset + slot->consumed) {
+    if(smb_readahead_drain(args)) {
+      args->failed = 1;
+      return MHD_CONTENT_READER_END_WITH_ERROR;
+    }
+  }
+  if(!args->count) {
+    smb_readahead_seek(args, offset);
+  }
+
+  if(smb_readahead_fill(args)) {
+    args->failed = 1;
     return MHD_CONTENT_READER_END_WITH_ERROR;
-  } else if(ret == 0){
+  }
+
+  slot = &args->slots[args->head];
+  if(!args->count) {
     return MHD_CONTENT_READER_END_OF_STREAM;
-  } else {
-    return ret;
   }
+
+  while(slot->state == SMB_SLOT_PENDING) {
+    if(smb_readahead_service(args, SMB_READ_TIMEOUT)) {
+      args->failed = 1;
+      return MHD_CONTENT_READER_END_WITH_ERROR;
+    }
+  }
+
+  if(slot->state == SMB_SLOT_FAILED) {
+    args->failed = 1;
+    return MHD_CONTENT_READER_END_WITH_ERROR;
+  }
+  if(!slot->len) {
+    return MHD_CONTENT_READER_END_OF_STREAM;
+  }
+
+  len = slot->len - slot->consumed;
+  if(len > max) {
+    len = max;
+  }
+  memcpy(buf, slot->buf + slot->consumed, len);
+  slot->consumed += len;
+
+  // recycle the slot once it has been consumed
+  if(slot->consumed == slot->len) {
+    slot->state = SMB_SLOT_FREE;
+    args->head = (args->head + 1) % SMB_READAHEAD_DEPTH;
+    args->count--;
+  }
+
+  return len;
 }
 
 
@@ -120,22 +380,57 @@ static void
 smb_request_file_close_cb(void *ctx) {
   smb_request_file_args_t* args = (smb_request_file_args_t*)ctx;
 
-  smb2_close(args->smb2, args->file);
-  smb2_destroy_context(args->smb2);
+  // replies to reads in flight must not land in freed memory
+  if(!args->failed && smb_readahead_drain(args)) {
+    args->failed = 1;
+  }
+
+  if(args->failed) {
+    smbpool_discard(args->smb2);
+  } else {
+    smb2_close(args->smb2, args->file);
+    smbpool_release(args->smb2);
+  }
+  free(args->ring);
   free(args);
 }
 
 
 /**
- * Callback function used to transmit smb dir data to a http request.
+ * Maximum number of bytes a single directory entry is rendered as. Names are
+ * up to 255 UTF-16 code units, i.e., three times as many bytes in UTF-8, and
+ * each byte takes up to six bytes when escaped.
+ **/
+#define SMB_DIR_ENTRY_MAX (6 * 3 * 255 + 128)
+
+
+/**
+ * Obtain the character encoding for the type of a directory entry.
+ **/
+static char
+smb_modechar(const struct smb2_stat_64* st) {
+  switch(st->smb2_type) {
+  case SMB2_TYPE_DIRECTORY:
+    return 'd';
+  case SMB2_TYPE_LINK:
+    return 'l';
+  case SMB2_TYPE_FILE:
+  default:
+    return '-';
+  }
+}
+
+
+/**
+ * Callback function used to transmit smb dir data to a http request. The
+ * attributes come with the directory query itself, so entries are rendered
+ * without any further round trips, as many as fit in the buffer.
  **/
 static ssize_t
 smb_request_dir_read_cb(void *ctx, uint64_t pos, char *buf, size_t max) {
   smb_request_dir_args_t* args = (smb_request_dir_args_t*)ctx;
   struct smb2dirent* ent;
-  struct smb2_stat_64 st;
-  char path[PATH_MAX];
-  char mode = '-';
+  size_t len = 0;
 
   if(args->state == 0) {
     args->state++;
@@ -151,42 +446,25 @@ smb_request_dir_read_cb(void *ctx, uint64_t pos, char *buf, size_t max) {
     return MHD_CONTENT_READER_END_OF_STREAM;
   }
 
-  if(!(ent=smb2_readdir(args->smb2, args->dir))) {
-    args->state++;
-    return 0;
-  }
-
-  if(!strcmp(".", ent->name)) {
-    return 0;
-  }
-
-  if(args->path[0]) {
-    snprintf(path, PATH_MAX, "%s/%s", args->path, ent->name);
-  } else {
-    snprintf(path, PATH_MAX, "%s", ent->name);
-  }
+  while(max - len >= SMB_DIR_ENTRY_MAX) {
+    if(!(ent=smb2_readdir(args->smb2, args->dir))) {
+      args->state++;
+      break;
+    }
 
-  if(smb2_stat(args->smb2, path, &st) < 0) {
-    return 0;
-  }
+    if(!strcmp(".", ent->name)) {
+      continue;
+    }
 
-  switch(st.smb2_type) {
-  case SMB2_TYPE_DIRECTORY:
-    mode = 'd';
-    break;
-  case SMB2_TYPE_FILE:
-    mode = '-';
-    break;
-  case SMB2_TYPE_LINK:
-    mode = 'l';
-    break;
-  default:
-    mode = '-';
-    break;
+    len += sprintf(buf + len, ",\n  {\"name\":");
+    len += dirlist_json_string(buf + len, ent->name);
+    len += sprintf(buf + len, ",\"mode\":\"%c\",\"mtime\":%llu,\"size\":%llu}",
+                   smb_modechar(&ent->st),
+                   (unsigned long long)ent->st.smb2_mtime,
+                   (unsigned long long)ent->st.smb2_size);
   }
 
-  return snprintf(buf, max, ",\n  {\"name\":\"%s\",\"mode\":\"%c\",\"mtime\":%lu,\"size\":%zu}",
-                  ent->name, mode, st.smb2_mtime, st.smb2_size);
+  return len;
 }
 
 
@@ -199,8 +477,7 @@ smb_request_dir_close_cb(void *ctx) {
   smb_request_dir_args_t* args = (smb_request_dir_args_t*)ctx;
 
   smb2_closedir(args->smb2, args->dir);
-  smb2_destroy_context(args->smb2);
-  free(args->path);
+  smbpool_release(args->smb2);
   free(args);
 }
 
@@ -220,16 +497,43 @@ errno_to_http_error(int err) {
   case ENOENT:
     return MHD_HTTP_NOT_FOUND;
 
+  case EBUSY:
+    return MHD_HTTP_SERVICE_UNAVAILABLE;
+
   default:
     return MHD_HTTP_INTERNAL_SERVER_ERROR;
   }
 }
 
+/**
+ * Record the response of a request, which takes over the reference to it.
+ **/
+static enum MHD_Result
+smb_respond(smb_request_state_t *st, unsigned int status,
+            struct MHD_Response *resp) {
+  st->status = status;
+  st->resp = resp;
+
+  return MHD_YES;
+}
+
+
+/**
+ * Postpone a request until a session with the given server is available.
+ **/
+static enum MHD_Result
+smb_request_defer(smb_request_state_t *st, const char* server) {
+  snprintf(st->wait_server, sizeof(st->wait_server), "%s", server);
+
+  return MHD_YES;
+}
+
+
 /**
  * Respond to a http request with an internal error.
  **/
 static enum MHD_Result
-smb_response_perror(struct MHD_Connection *conn, const char* s) {
+smb_response_perror(smb_request_state_t *st, const char* s) {
   enum MHD_Result ret = MHD_NO;
   struct MHD_Response *resp;
   const char* msg;
@@ -245,8 +549,7 @@ smb_response_perror(struct MHD_Connection *conn, const char* s) {
     if((resp=MHD_create_response_from_buffer(strlen(PAGE_500), PAGE_500,
                                              MHD_RESPMEM_PERSISTENT))) {
       MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE, "text/html");
-      ret = websrv_queue_response(conn, MHD_HTTP_INTERNAL_SERVER_ERROR, resp);
-      MHD_destroy_response(resp);
+      ret = smb_respond(st, MHD_HTTP_INTERNAL_SERVER_ERROR, resp);
     }
     return ret;
   }
@@ -257,8 +560,7 @@ smb_response_perror(struct MHD_Connection *conn, const char* s) {
   if((resp=MHD_create_response_from_buffer(strlen(buf), buf,
                                            MHD_RESPMEM_MUST_FREE))) {
     MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE, "text/plain");
-    ret = websrv_queue_response(conn, http_error, resp);
-    MHD_destroy_response(resp);
+    ret = smb_respond(st, http_error, resp);
   }
 
   return ret;
@@ -268,7 +570,7 @@ smb_response_perror(struct MHD_Connection *conn, const char* s) {
  * Respond to a http request with an internal error.
  **/
 static enum MHD_Result
-smb_response_error(struct MHD_Connection *conn, struct smb2_context *smb2) {
+smb_response_error(smb_request_state_t *st, struct smb2_context *smb2) {
   int nterr = smb2_get_nterror(smb2);
   int err = nterror_to_errno(nterr);
   enum MHD_Result ret = MHD_NO;
@@ -285,8 +587,7 @@ smb_response_error(struct MHD_Connection *conn, struct smb2_context *smb2) {
     if((resp=MHD_create_response_from_buffer(strlen(PAGE_500), PAGE_500,
                                              MHD_RESPMEM_PERSISTENT))) {
       MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE, "text/html");
-      ret = websrv_queue_response(conn, MHD_HTTP_INTERNAL_SERVER_ERROR, resp);
-      MHD_destroy_response(resp);
+      ret = smb_respond(st, MHD_HTTP_INTERNAL_SERVER_ERROR, resp);
     }
     return ret;
   }
@@ -297,8 +598,7 @@ smb_response_error(struct MHD_Connection *conn, struct smb2_context *smb2) {
   if((resp=MHD_create_response_from_buffer(strlen(buf), buf,
                                            MHD_RESPMEM_MUST_FREE))) {
     MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE, "text/plain");
-    ret = websrv_queue_response(conn, http_error, resp);
-    MHD_destroy_response(resp);
+    ret = smb_respond(st, http_error, resp);
   }
 
   return ret;
@@ -309,8 +609,7 @@ smb_response_error(struct MHD_Connection *conn, struct smb2_context *smb2) {
  * Create a response for a dir request.
  **/
 static struct MHD_Response*
-smb_create_dir_response(struct smb2_context *smb2, struct smb2dir* dir,
-                        const char* path) {
+smb_create_dir_response(struct smb2_context *smb2, struct smb2dir* dir) {
   smb_request_dir_args_t *args;
   struct MHD_Response *resp;
 
@@ -318,12 +617,8 @@ smb_create_dir_response(struct smb2_context *smb2, struct smb2dir* dir,
     return 0;
   }
 
-  if(!path) {
-    path = "";
-  }
   args->smb2  = smb2;
   args->dir   = dir;
-  args->path  = strdup(path);
   args->state = 0;
 
   resp = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 32*0x1000,
@@ -334,7 +629,6 @@ smb_create_dir_response(struct smb2_context *smb2, struct smb2dir* dir,
     MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE,
                             "application/json");
   } else {
-    free(args->path);
     free(args);
   }
 
@@ -343,137 +637,269 @@ smb_create_dir_response(struct smb2_context *smb2, struct smb2dir* dir,
 
 
 /**
- * Create a response for a file request.
+ * Create a response for a dir request that needs to be sorted, filtered or
+ * paginated, in the same way as local directory listings. The directory is
+ * read in full, and closed before returning.
  **/
 static struct MHD_Response*
-smb_create_file_response(struct smb2_context *smb2, struct smb2fh* file,
-                         const char* path, const char* range, size_t size) {
-  smb_request_file_args_t *args;
-  struct MHD_Response *resp;
-  const char* mime = 0;
-  size_t start = 0;
-  size_t end = size - 1;
-  char buf[100];
+smb_create_dir_response_buffered(struct smb2_context *smb2,
+                                 struct smb2dir* dir,
+                                 const dirlist_opts_t* opts) {
+  struct MHD_Response *resp = 0;
+  struct smb2dirent* ent;
+  dirlist_t dl = {0};
+  size_t size;
+  char* buf;
+  int err = 0;
 
-  if(range && !strncmp("bytes=", range, 6)) {
-    sscanf(range+6, "%lu-%lu", &start, &end);
-    if(end <= 0 || end >= size) {
-      end = size - 1;
+  while(!err && (ent=smb2_readdir(smb2, dir))) {
+    if(!strcmp(".", ent->name) || !strcmp("..", ent->name)) {
+      continue;
     }
-    if(start > end) {
-      start = 0;
+    if(!dirlist_match(opts, ent->name)) {
+      continue;
     }
+    err = dirlist_add(&dl, ent->name, smb_modechar(&ent->st),
+                      ent->st.smb2_mtime, ent->st.smb2_size);
   }
 
-  if(smb2_lseek(smb2, file, start, SEEK_SET, 0) < 0) {
-    return 0;
+  smb2_closedir(smb2, dir);
+
+  if(!err && (buf=dirlist_render(&dl, opts, &size))) {
+    if((resp=MHD_create_response_from_buffer(size, buf,
+                                             MHD_RESPMEM_MUST_FREE))) {
+      MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE,
+                              "application/json");
+    } else {
+      free(buf);
+    }
   }
+  dirlist_free(&dl);
+
+  return resp;
+}
+
 
-  if(!(args=malloc(sizeof(smb_request_file_args_t)))) {
+/**
+ * Create a response for a file request. With a single range, the body is the
+ * data in that range, and with several ranges, the body is multipart.
+ **/
+static struct MHD_Response*
+smb_create_file_response(struct MHD_Connection *conn,
+                         struct smb2_context *smb2, struct smb2fh* file,
+                         const char* path, const range_t* ranges, int nranges,
+                         size_t size) {
+  smb_request_file_args_t *args;
+  struct MHD_Response *resp;
+  const char* mime = mime_get_type(path);
+  size_t start = ranges[0].start;
+  size_t end = ranges[0].end;
+  char buf[100];
+
+  if(!(args=calloc(1, sizeof(smb_request_file_args_t)))) {
     return 0;
   }
 
   args->smb2 = smb2;
   args->file = file;
+  args->size = size;
+  args->nranges = nranges > 0 ? nranges : 1;
+  memcpy(args->ranges, ranges, args->nranges * sizeof(range_t));
+  args->chunk = smb2_get_max_read_size(smb2);
+  if(!args->chunk || args->chunk > SMB_READAHEAD_CHUNK) {
+    args->chunk = SMB_READAHEAD_CHUNK;
+  }
+
+  if(!(args->ring=malloc((size_t)args->chunk * SMB_READAHEAD_DEPTH))) {
+    free(args);
+    return 0;
+  }
+  for(int i=0; i<SMB_READAHEAD_DEPTH; i++) {
+    args->slots[i].buf = args->ring + (size_t)i * args->chunk;
+  }
+
+  if(nranges > 1) {
+    // the multipart reader asks for data at absolute offsets
+    args->start = 0;
+    if(!(resp=range_create_multipart_response(conn, ranges, nranges, size,
+                                              mime,
+                                              smb_request_file_read_cb, args,
+                                              smb_request_file_close_cb))) {
+      free(args->ring);
+      free(args);
+    }
+    return resp;
+  }
+
   args->start = start;
 
-  resp = MHD_create_response_from_callback(end-start+1, 32 * 1024,
-                                           smb_request_file_read_cb,
-                                           args,
-                                           smb_request_file_close_cb);
+  resp = task_create_response(conn, size ? end-start+1 : 0, SMB_BLOCK_SIZE,
+                              smb_request_file_read_cb, args,
+                              smb_request_file_close_cb);
   if(!resp) {
+    free(args->ring);
     free(args);
+    return 0;
   }
 
-  if((mime=mime_get_type(path))) {
+  if(mime) {
     MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE, mime);
   }
   MHD_add_response_header(resp, MHD_HTTP_HEADER_ACCEPT_RANGES, "bytes");
 
-  if(range) {
-    snprintf(buf, sizeof(buf), "bytes %zd-%zd/%zu", start, end, size);
+  if(nranges == 1) {
+    range_content_range(&ranges[0], size, buf, sizeof(buf));
     MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_RANGE, buf);
-
-    snprintf(buf, sizeof(buf), "%zu", end-start+1);
-    MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_LENGTH, buf);
   }
 
   return resp;
 }
 
 
+/**
+ * Add cache validators for a remote file to a response.
+ **/
+static void
+smb_add_validators(struct MHD_Response *resp, const char* etag,
+                   const struct smb2_stat_64* st) {
+  char date[64];
+
+  websrv_http_date(st->smb2_mtime, date, sizeof(date));
+  MHD_add_response_header(resp, MHD_HTTP_HEADER_ETAG, etag);
+  MHD_add_response_header(resp, MHD_HTTP_HEADER_LAST_MODIFIED, date);
+  MHD_add_response_header(resp, MHD_HTTP_HEADER_CACHE_CONTROL, "no-cache");
+}
+
+
 /**
  * Respond to a http request of a remote smb path.
  **/
 static enum MHD_Result
-smb_request_path(struct MHD_Connection *conn, const char* user,
-                 const char* pass, const char* uri) {
+smb_request_path(smb_request_state_t *st, const char* server,
+                 const char* share, const char* user, const char* pass,
+                 const char* uri) {
+  struct MHD_Connection *conn = st->conn;
   enum MHD_Result ret = MHD_NO;
   struct MHD_Response *resp = 0;
   struct smb2_context *smb2 = 0;
   struct smb2_url *url = 0;
   struct smb2fh* file = 0;
   struct smb2dir* dir = 0;
-  struct smb2_stat_64 st;
+  struct smb2_stat_64 sst;
+  range_t ranges[RANGE_MAX];
+  dirlist_opts_t opts;
   const char* range;
+  char etag[128] = "";
+  char buf[64];
+  int nranges;
 
-  if(!(smb2=smb2_init_context())) {
-    return smb_response_perror(conn, "smb2_init_context");
+  if(smbpool_acquire(server, share, user, pass, &smb2)) {
+    if(!smb2 && errno == EAGAIN) {
+      return smb_request_defer(st, server);
+    }
+    if(!smb2) {
+      return smb_response_perror(st, "smbpool_acquire");
+    }
+    if(pass && *pass == 0) {
+      ret = smb_request_path(st, server, share, user, 0, uri);
+    } else {
+      ret = smb_response_error(st, smb2);
+    }
+    smbpool_discard(smb2);
+    return ret;
   }
 
   if(!(url=smb2_parse_url(smb2, uri))) {
-    ret = smb_response_error(conn, smb2);
-    smb2_destroy_context(smb2);
+    ret = smb_response_error(st, smb2);
+    smbpool_release(smb2);
     return ret;
   }
 
-  smb2_set_user(smb2, user);
-  smb2_set_password(smb2, pass);
-  smb2_set_security_mode(smb2, SMB2_NEGOTIATE_SIGNING_ENABLED);
-
-  if(smb2_connect_share(smb2, url->server, url->share, user) < 0) {
-    if(pass && *pass == 0) {
-      ret = smb_request_path(conn, user, 0, uri);
-    } else {
-      ret = smb_response_error(conn, smb2);
-    }
+  if(smb2_stat(smb2, url->path, &sst) < 0) {
+    ret = smb_response_error(st, smb2);
+    smbpool_release(smb2);
     smb2_destroy_url(url);
-    smb2_destroy_context(smb2);
     return ret;
   }
 
-  if(smb2_stat(smb2, url->path, &st) < 0) {
-    ret = smb_response_error(conn, smb2);
-    smb2_destroy_context(smb2);
-    smb2_destroy_url(url);
-    return ret;
+  if(sst.smb2_type == SMB2_TYPE_FILE) {
+    // weak, since the content may change within the mtime resolution
+    snprintf(etag, sizeof(etag), "W/\"%llx-%llx-%llx.%llx\"",
+             (unsigned long long)sst.smb2_ino,
+             (unsigned long long)sst.smb2_size,
+             (unsigned long long)sst.smb2_mtime,
+             (unsigned long long)sst.smb2_mtime_nsec);
+
+    if(websrv_not_modified(conn, etag, sst.smb2_mtime)) {
+      smbpool_release(smb2);
+      smb2_destroy_url(url);
+      if((resp=MHD_create_response_from_buffer(0, "",
+                                               MHD_RESPMEM_PERSISTENT))) {
+        smb_add_validators(resp, etag, &sst);
+        ret = smb_respond(st, MHD_HTTP_NOT_MODIFIED, resp);
+      }
+      return ret;
+    }
   }
 
+  // a range is only honoured if the file still matches If-Range
   range = MHD_lookup_connection_value(conn, MHD_HEADER_KIND,
                                       MHD_HTTP_HEADER_RANGE);
-  if(range && strncmp("bytes=", range, 6)) {
+  if(range && !websrv_if_range(conn, etag, sst.smb2_mtime)) {
     range = 0;
   }
 
-  switch(st.smb2_type) {
+  if(sst.smb2_type != SMB2_TYPE_FILE || !sst.smb2_size) {
+    nranges = -1;
+  } else if(!(nranges=range_parse(range, sst.smb2_size, ranges))) {
+    smbpool_release(smb2);
+    smb2_destroy_url(url);
+    if((resp=MHD_create_response_from_buffer(0, "", MHD_RESPMEM_PERSISTENT))) {
+      snprintf(buf, sizeof(buf), "bytes */%llu",
+               (unsigned long long)sst.smb2_size);
+      MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_RANGE, buf);
+      MHD_add_response_header(resp, MHD_HTTP_HEADER_ACCEPT_RANGES, "bytes");
+      ret = smb_respond(st, MHD_HTTP_RANGE_NOT_SATISFIABLE, resp);
+    }
+    return ret;
+  }
+
+  // no (usable) range header, serve the whole file
+  if(nranges < 0) {
+    ranges[0].start = 0;
+    ranges[0].end = sst.smb2_size ? sst.smb2_size - 1 : 0;
+  }
+
+  switch(sst.smb2_type) {
   case SMB2_TYPE_DIRECTORY:
     if(!(dir=smb2_opendir(smb2, url->path))) {
-      ret = smb_response_error(conn, smb2);
-      smb2_destroy_context(smb2);
+      ret = smb_response_error(st, smb2);
+      smbpool_release(smb2);
       smb2_destroy_url(url);
       return ret;
     }
-    resp = smb_create_dir_response(smb2, dir, url->path);
+    if(dirlist_parse_opts(conn, &opts)) {
+      resp = smb_create_dir_response_buffered(smb2, dir, &opts);
+      dir = 0;
+      if(resp) {
+        smbpool_release(smb2);
+      }
+    } else {
+      resp = smb_create_dir_response(smb2, dir);
+    }
     break;
 
   case SMB2_TYPE_FILE:
     if(!(file=smb2_open(smb2, url->path, O_RDONLY))) {
-      ret = smb_response_error(conn, smb2);
-      smb2_destroy_context(smb2);
+      ret = smb_response_error(st, smb2);
+      smbpool_release(smb2);
       smb2_destroy_url(url);
       return ret;
     }
-    resp = smb_create_file_response(smb2, file, url->path, range, st.smb2_size);
+    if((resp=smb_create_file_response(conn, smb2, file, url->path, ranges,
+                                      nranges, sst.smb2_size))) {
+      smb_add_validators(resp, etag, &sst);
+    }
     break;
 
   case SMB2_TYPE_LINK:
@@ -484,13 +910,10 @@ smb_request_path(struct MHD_Connection *conn, const char* user,
   smb2_destroy_url(url);
 
   if(resp) {
-    if(range) {
-      ret = websrv_queue_response(conn, MHD_HTTP_PARTIAL_CONTENT, resp);
-    } else {
-      ret = websrv_queue_response(conn, MHD_HTTP_OK, resp);
+    if(nranges > 0) {
+      return smb_respond(st, MHD_HTTP_PARTIAL_CONTENT, resp);
     }
-    MHD_destroy_response(resp);
-    return ret;
+    return smb_respond(st, MHD_HTTP_OK, resp);
   }
 
   if(file) {
@@ -500,7 +923,7 @@ smb_request_path(struct MHD_Connection *conn, const char* user,
     smb2_closedir(smb2, dir);
   }
 
-  smb2_destroy_context(smb2);
+  smbpool_release(smb2);
 
   return ret;
 }
@@ -521,7 +944,7 @@ smb_request_shares_cb(struct smb2_context *smb2, int status, void *data,
   char *ptr;
 
   if(status) {
-    args->result = smb_response_error(args->conn, smb2);
+    args->result = smb_response_error(args->st, smb2);
     args->finished = 1;
     return;
   }
@@ -551,8 +974,7 @@ smb_request_shares_cb(struct smb2_context *smb2, int status, void *data,
 					   MHD_RESPMEM_MUST_FREE))) {
     MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE,
                             "application/json");
-    args->result = websrv_queue_response(args->conn, MHD_HTTP_OK, resp);
-    MHD_destroy_response(resp);
+    args->result = smb_respond(args->st, MHD_HTTP_OK, resp);
   } else {
     args->result = MHD_NO;
   }
@@ -564,46 +986,35 @@ smb_request_shares_cb(struct smb2_context *smb2, int status, void *data,
  * Respond to a http request of a remote smb shares listing.
  **/
 static enum MHD_Result
-smb_request_shares(struct MHD_Connection *conn, const char* user,
-                   const char* pass, const char* uri) {
-  smb_request_shares_args_t args = {conn, MHD_NO, 0};
+smb_request_shares(smb_request_state_t *st, const char* server,
+                   const char* user, const char* pass) {
+  smb_request_shares_args_t args = {st, MHD_NO, 0};
   enum MHD_Result ret = MHD_NO;
   struct smb2_context *smb2;
-  struct smb2_url *url;
   struct pollfd pfd;
+  int failed = 0;
 
-  if(!(smb2=smb2_init_context())) {
-    return smb_response_perror(conn, "smb2_init_context");
-  }
-
-  smb2_set_user(smb2, user);
-  smb2_set_password(smb2, pass);
-  smb2_set_security_mode(smb2, SMB2_NEGOTIATE_SIGNING_ENABLED);
-
-  if(!(url=smb2_parse_url(smb2, uri))) {
-    ret = smb_response_error(conn, smb2);
-    smb2_destroy_context(smb2);
-    return ret;
-  }
-
-  if(smb2_connect_share(smb2, url->server, "IPC$", user)) {
+  if(smbpool_acquire(server, "IPC$", user, pass, &smb2)) {
+    if(!smb2 && errno == EAGAIN) {
+      return smb_request_defer(st, server);
+    }
+    if(!smb2) {
+      return smb_response_perror(st, "smbpool_acquire");
+    }
     if(pass && *pass == 0 &&
        smb2_get_nterror(smb2) != 0xc000006d) {
-      ret = smb_request_shares(conn, user, 0, uri);
+      ret = smb_request_shares(st, server, user, 0);
     } else {
-      ret = smb_response_error(conn, smb2);
+      ret = smb_response_error(st, smb2);
     }
-    smb2_destroy_url(url);
-    smb2_destroy_context(smb2);
+    smbpool_discard(smb2);
     return ret;
   }
 
-  smb2_destroy_url(url);
-
   if(smb2_share_enum_async(smb2, SHARE_INFO_0,
                            smb_request_shares_cb, &args)) {
-    ret = smb_response_error(conn, smb2);
-    smb2_destroy_context(smb2);
+    ret = smb_response_error(st, smb2);
+    smbpool_discard(smb2);
     return ret;
   }
 
@@ -612,30 +1023,37 @@ smb_request_shares(struct MHD_Connection *conn, const char* user,
     pfd.events = smb2_which_events(smb2);
 
     if(poll(&pfd, 1, 5000) < 0) {
-      args.result = smb_response_perror(conn, "poll");
+      args.result = smb_response_perror(st, "poll");
+      failed = 1;
       break;
     }
     if(pfd.revents == 0) {
       continue;
     }
     if(smb2_service(smb2, pfd.revents) < 0) {
-      args.result = smb_response_error(conn, smb2);
+      args.result = smb_response_error(st, smb2);
       args.finished = 1;
+      failed = 1;
     }
   }
 
-  smb2_destroy_context(smb2);
+  if(failed) {
+    smbpool_discard(smb2);
+  } else {
+    smbpool_release(smb2);
+  }
 
   return args.result;
 }
 
 
 /**
- * Respond to a http request of a remote smb resource.
+ * Serve a request on a helper thread.
  **/
-enum MHD_Result
-smb_request(struct MHD_Connection *conn, const char* url) {
-  enum MHD_Result ret = MHD_NO;
+static void
+smb_request_run(void* arg) {
+  smb_request_state_t *st = arg;
+  struct MHD_Connection *conn = st->conn;
   struct MHD_Response *resp;
   const char* user;
   const char* pass;
@@ -643,21 +1061,23 @@ smb_request(struct MHD_Connection *conn, const char* url) {
   const char* port;
   const char* path;
   char uri[PATH_MAX];
+  char server[300];
+  char share[256];
+  size_t len;
 
   user = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "user");
   pass = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "pass");
   addr = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "addr");
   port = MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "port");
-  path = url+4;
+  path = st->url+4;
 
   if(!addr) {
     if((resp=MHD_create_response_from_buffer(strlen(PAGE_400), PAGE_400,
                                              MHD_RESPMEM_PERSISTENT))) {
       MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE, "text/html");
-      ret = websrv_queue_response(conn, MHD_HTTP_BAD_REQUEST, resp);
-      MHD_destroy_response(resp);
+      smb_respond(st, MHD_HTTP_BAD_REQUEST, resp);
     }
-    return ret;
+    return;
   }
   if(!user) {
     user = "";
@@ -669,14 +1089,125 @@ smb_request(struct MHD_Connection *conn, const char* url) {
     port = "445";
   }
 
+  snprintf(server, sizeof(server), "%s:%s", addr, port);
   if(!path[0]) {
-    snprintf(uri, PATH_MAX, "smb://%s:%s/%s", addr, port, path);
-    return smb_request_shares(conn, user, pass, uri);
-  } else {
-    snprintf(uri, PATH_MAX, "smb://%s:%s%s", addr, port, path);
-    return smb_request_path(conn, user, pass, uri);
+    smb_request_shares(st, server, user, pass);
+    return;
   }
 
-  return ret;
+  // sessions are bound to a share, i.e., the first component of the path
+  len = strcspn(path + 1, "/");
+  if(len >= sizeof(share)) {
+    len = sizeof(share) - 1;
+  }
+  memcpy(share, path + 1, len);
+  share[len] = 0;
+
+  snprintf(uri, PATH_MAX, "smb://%s%s", server, path);
+  smb_request_path(st, server, share, user, pass, uri);
 }
 
+
+static void smb_request_wake(void* arg, int err);
+
+
+/**
+ * Serve a request on a helper thread, and resume its connection once the
+ * response is ready. A request that has to wait for a session is parked
+ * without holding up the helper, and served again once it is woken up.
+ **/
+static void
+smb_request_job(void* arg) {
+  smb_request_state_t *st = arg;
+
+  while(1) {
+    st->wait_server[0] = 0;
+    if(st->wait_err) {
+      errno = EBUSY;
+      smb_response_perror(st, "smbpool_acquire");
+    } else {
+      smb_request_run(st);
+    }
+
+    if(!st->wait_server[0]) {
+      break;
+    }
+
+    // the state may be gone as soon as the request is parked
+    if(!smbpool_wait(st->wait_server, &st->waiter, smb_request_wake, st)) {
+      return;
+    }
+  }
+
+  MHD_resume_connection(st->conn);
+}
+
+
+/**
+ * Continue a request once a session is available, or the wait timed out.
+ **/
+static void
+smb_request_wake(void* arg, int err) {
+  smb_request_state_t *st = arg;
+
+  st->wait_err = err;
+  if(task_submit(smb_request_job, st)) {
+    errno = EBUSY;
+    smb_response_perror(st, "task_submit");
+    MHD_resume_connection(st->conn);
+  }
+}
+
+
+/**
+ * Release the state of a request.
+ **/
+static void
+smb_request_free(websrv_state_t* state) {
+  smb_request_state_t *st = (smb_request_state_t*)state;
+
+  if(st->resp) {
+    MHD_destroy_response(st->resp);
+  }
+  free(st);
+}
+
+
+/**
+ * Respond to a http request of a remote smb resource. Network i/o happens
+ * on a helper thread, and the response is queued once the connection has
+ * been resumed.
+ **/
+enum MHD_Result
+smb_request(struct MHD_Connection *conn, const char* url,
+            websrv_state_t** state) {
+  smb_request_state_t *st = (smb_request_state_t*)*state;
+  enum MHD_Result ret = MHD_NO;
+
+  if(!st) {
+    if(!(st=calloc(1, sizeof(smb_request_state_t)))) {
+      return MHD_NO;
+    }
+    st->base.free_cb = smb_request_free;
+    st->conn = conn;
+    st->url = url;
+    *state = &st->base;
+
+    MHD_suspend_connection(conn);
+    if(!task_submit(smb_request_job, st)) {
+      return MHD_YES;
+    }
+    MHD_resume_connection(conn);
+
+    errno = EBUSY;
+    smb_response_perror(st, "task_submit");
+  }
+
+  if(st->resp) {
+    ret = websrv_queue_response(conn, st->status, st->resp);
+    MHD_destroy_response(st->resp);
+    st->resp = 0;
+  }
+
+  return ret;
+}
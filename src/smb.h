@@ -18,10 +18,14 @@ along with this program; see the file COPYING. If not, see
 
 #include <microhttpd.h>
 
+#include "websrv.h"
+
 
 /**
- * Respond to a request for a remote smb resource.
+ * Respond to a request for a remote smb resource. The request is served by a
+ * helper thread while the connection is suspended, and state keeps track of
+ * it until the response is queued when this function is invoked again.
  **/
-enum MHD_Result smb_request(struct MHD_Connection *conn,
-                            const char* url);
+enum MHD_Result smb_request(struct MHD_Connection *conn, const char* url,
+                            websrv_state_t** state);
 
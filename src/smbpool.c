@@ -0,0 +1,437 @@
+/* Copyright (C) 2026 John Törnblom
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation; either version 3, or (at your option) any
+later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; see the file COPYING. If not, see
+<http://www.gnu.org/licenses/>.  */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <smb2/smb2.h>
+#include <smb2/libsmb2.h>
+
+#include "smbpool.h"
+
+
+/**
+ * Maximum number of sessions (busy or idle) with a single server.
+ **/
+#ifndef SMBPOOL_MAX_PER_SERVER
+#define SMBPOOL_MAX_PER_SERVER 4
+#endif
+
+
+/**
+ * Number of seconds an idle session is kept before it is closed.
+ **/
+#ifndef SMBPOOL_IDLE_TIMEOUT
+#define SMBPOOL_IDLE_TIMEOUT 60
+#endif
+
+
+/**
+ * Sessions that have been idle for longer than this number of seconds are
+ * probed with an echo request before they are reused.
+ **/
+#ifndef SMBPOOL_PROBE_AFTER
+#define SMBPOOL_PROBE_AFTER 5
+#endif
+
+
+/**
+ * Number of seconds a request waits for a session when a server is at its
+ * cap.
+ **/
+#ifndef SMBPOOL_WAIT_TIMEOUT
+#define SMBPOOL_WAIT_TIMEOUT 10
+#endif
+
+
+/**
+ * An authenticated session with a share.
+ **/
+typedef struct smbpool_session {
+  struct smb2_context *smb2;
+  char* server;
+  char* share;
+  char* user;
+  char* pass;
+  bool busy;
+  time_t idle_since;
+  struct smbpool_session* next;
+} smbpool_session_t;
+
+
+/**
+ * Global state variables.
+ **/
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static smbpool_session_t* g_session_seq = 0;
+static smbpool_waiter_t* g_waiter_seq = 0;
+
+
+/**
+ * Compare two strings that may be NULL.
+ **/
+static bool
+smbpool_streq(const char* a, const char* b) {
+  if(!a || !b) {
+    return a == b;
+  }
+  return !strcmp(a, b);
+}
+
+
+/**
+ * Free a session, and close its connection.
+ **/
+static void
+smbpool_session_free(smbpool_session_t* s) {
+  if(s->smb2) {
+    smb2_destroy_context(s->smb2);
+  }
+  free(s->server);
+  free(s->share);
+  free(s->user);
+  free(s->pass);
+  free(s);
+}
+
+
+/**
+ * Remove a session from the pool. The caller must hold g_lock.
+ **/
+static void
+smbpool_unlink(smbpool_session_t* s) {
+  for(smbpool_session_t** it=&g_session_seq; *it; it=&(*it)->next) {
+    if(*it == s) {
+      *it = s->next;
+      break;
+    }
+  }
+}
+
+
+/**
+ * Remove a waiter from the queue. Returns 0 if it was queued. The caller
+ * must hold g_lock.
+ **/
+static int
+smbpool_waiter_unlink(smbpool_waiter_t* w) {
+  for(smbpool_waiter_t** it=&g_waiter_seq; *it; it=&(*it)->next) {
+    if(*it == w) {
+      *it = w->next;
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+
+/**
+ * Give up waiting for a session.
+ **/
+static void
+smbpool_wait_timeout(void* arg) {
+  smbpool_waiter_t* w = arg;
+  int err;
+
+  pthread_mutex_lock(&g_lock);
+  err = smbpool_waiter_unlink(w);
+  pthread_mutex_unlock(&g_lock);
+
+  // whoever removes the waiter from the queue notifies it
+  if(!err) {
+    w->cb(w->arg, ETIMEDOUT);
+  }
+}
+
+
+/**
+ * Notify the first request that waits for a session with the given server.
+ **/
+static void
+smbpool_wake(const char* server) {
+  smbpool_waiter_t* w;
+
+  pthread_mutex_lock(&g_lock);
+  for(w=g_waiter_seq; w; w=w->next) {
+    if(!strcmp(w->server, server)) {
+      smbpool_waiter_unlink(w);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&g_lock);
+
+  if(w) {
+    task_timer_stop(&w->timer);
+    w->cb(w->arg, 0);
+  }
+}
+
+
+/**
+ * Move idle sessions that have timed out to the given list, so that they can
+ * be closed without holding g_lock. The caller must hold g_lock.
+ **/
+static void
+smbpool_reap(smbpool_session_t** reaped, time_t now) {
+  smbpool_session_t** it = &g_session_seq;
+  smbpool_session_t* s;
+
+  while((s=*it)) {
+    if(!s->busy && now - s->idle_since > SMBPOOL_IDLE_TIMEOUT) {
+      *it = s->next;
+      s->next = *reaped;
+      *reaped = s;
+    } else {
+      it = &s->next;
+    }
+  }
+}
+
+
+/**
+ * Open a new session for a placeholder that has been added to the pool.
+ **/
+static int
+smbpool_connect(smbpool_session_t* s, struct smb2_context **smb2) {
+  if(!(*smb2=smb2_init_context())) {
+    return -1;
+  }
+
+  smb2_set_user(*smb2, s->user);
+  smb2_set_password(*smb2, s->pass);
+  smb2_set_security_mode(*smb2, SMB2_NEGOTIATE_SIGNING_ENABLED);
+
+  if(smb2_connect_share(*smb2, s->server, s->share, s->user) < 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+
+int
+smbpool_acquire(const char* server, const char* share, const char* user,
+		const char* pass, struct smb2_context **smb2) {
+  smbpool_session_t* reaped = 0;
+  smbpool_session_t* victim;
+  smbpool_session_t* found;
+  smbpool_session_t* s;
+  time_t now;
+  int ret = -1;
+  int count;
+  int err;
+
+  *smb2 = 0;
+
+  pthread_mutex_lock(&g_lock);
+  while(1) {
+    now = time(0);
+    smbpool_reap(&reaped, now);
+
+    found = 0;
+    victim = 0;
+    count = 0;
+    for(s=g_session_seq; s; s=s->next) {
+      if(strcmp(s->server, server)) {
+	continue;
+      }
+      count++;
+      if(s->busy) {
+	continue;
+      }
+      if(!strcmp(s->share, share) && smbpool_streq(s->user, user) &&
+	 smbpool_streq(s->pass, pass)) {
+	found = s;
+	break;
+      }
+      victim = s;
+    }
+
+    if(found) {
+      found->busy = true;
+      pthread_mutex_unlock(&g_lock);
+
+      // make sure the server has not dropped the session while it was idle
+      if(now - found->idle_since <= SMBPOOL_PROBE_AFTER ||
+	 !smb2_echo(found->smb2)) {
+	*smb2 = found->smb2;
+	ret = 0;
+	break;
+      }
+
+      pthread_mutex_lock(&g_lock);
+      smbpool_unlink(found);
+      found->next = reaped;
+      reaped = found;
+      continue;
+    }
+
+    // make room by closing an idle session with other credentials or share
+    if(count >= SMBPOOL_MAX_PER_SERVER && victim) {
+      smbpool_unlink(victim);
+      victim->next = reaped;
+      reaped = victim;
+      count--;
+    }
+
+    if(count < SMBPOOL_MAX_PER_SERVER) {
+      if(!(s=calloc(1, sizeof(smbpool_session_t))) ||
+	 !(s->server=strdup(server)) || !(s->share=strdup(share)) ||
+	 (user && !(s->user=strdup(user))) ||
+	 (pass && !(s->pass=strdup(pass)))) {
+	pthread_mutex_unlock(&g_lock);
+	if(s) {
+	  smbpool_session_free(s);
+	}
+	errno = ENOMEM;
+	break;
+      }
+
+      // reserve a slot while the (slow) handshake is in progress
+      s->busy = true;
+      s->next = g_session_seq;
+      g_session_seq = s;
+      pthread_mutex_unlock(&g_lock);
+
+      if(!smbpool_connect(s, smb2)) {
+	s->smb2 = *smb2;
+	ret = 0;
+	break;
+      }
+
+      // the caller reports the error held by the context, then discards it
+      err = errno;
+      pthread_mutex_lock(&g_lock);
+      smbpool_unlink(s);
+      pthread_mutex_unlock(&g_lock);
+      smbpool_wake(s->server);
+      smbpool_session_free(s);
+      errno = err;
+      break;
+    }
+
+    // all sessions are busy, let the caller wait with smbpool_wait()
+    pthread_mutex_unlock(&g_lock);
+    errno = EAGAIN;
+    break;
+  }
+
+  while((s=reaped)) {
+    reaped = s->next;
+    smbpool_session_free(s);
+  }
+
+  return ret;
+}
+
+
+int
+smbpool_wait(const char* server, smbpool_waiter_t* w,
+	     void (*cb)(void* arg, int err), void* arg) {
+  smbpool_waiter_t** it;
+  smbpool_session_t* s;
+  time_t now = time(0);
+  int count = 0;
+
+  if(!w->deadline) {
+    w->deadline = now + SMBPOOL_WAIT_TIMEOUT;
+  }
+  w->server = server;
+  w->cb = cb;
+  w->arg = arg;
+  w->next = 0;
+
+  pthread_mutex_lock(&g_lock);
+  for(s=g_session_seq; s; s=s->next) {
+    if(!strcmp(s->server, server)) {
+      if(!s->busy) {
+	break;
+      }
+      count++;
+    }
+  }
+  if(s || count < SMBPOOL_MAX_PER_SERVER) {
+    pthread_mutex_unlock(&g_lock);
+    return -1;
+  }
+
+  // first come, first served
+  for(it=&g_waiter_seq; *it; it=&(*it)->next);
+  *it = w;
+
+  if(task_timer_start(&w->timer, w->deadline > now ?
+		      (w->deadline - now) * 1000 : 0,
+		      smbpool_wait_timeout, w)) {
+    smbpool_waiter_unlink(w);
+    pthread_mutex_unlock(&g_lock);
+    return -1;
+  }
+  pthread_mutex_unlock(&g_lock);
+
+  return 0;
+}
+
+
+void
+smbpool_release(struct smb2_context *smb2) {
+  smbpool_session_t* s;
+  char* server = 0;
+
+  pthread_mutex_lock(&g_lock);
+  for(s=g_session_seq; s; s=s->next) {
+    if(s->smb2 == smb2) {
+      s->busy = false;
+      s->idle_since = time(0);
+      server = strdup(s->server);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&g_lock);
+
+  if(!s) {
+    smb2_destroy_context(smb2);
+  } else if(server) {
+    smbpool_wake(server);
+  }
+  free(server);
+}
+
+
+void
+smbpool_discard(struct smb2_context *smb2) {
+  smbpool_session_t* s;
+
+  pthread_mutex_lock(&g_lock);
+  for(s=g_session_seq; s; s=s->next) {
+    if(s->smb2 == smb2) {
+      smbpool_unlink(s);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&g_lock);
+
+  if(s) {
+    smbpool_wake(s->server);
+    smbpool_session_free(s);
+  } else {
+    smb2_destroy_context(smb2);
+  }
+}
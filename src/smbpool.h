@@ -0,0 +1,76 @@
+/* Copyright (C) 2026 John Törnblom
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation; either version 3, or (at your option) any
+later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; see the file COPYING. If not, see
+<http://www.gnu.org/licenses/>.  */
+
+#pragma once
+
+#include <time.h>
+
+#include <smb2/smb2.h>
+#include <smb2/libsmb2.h>
+
+#include "task.h"
+
+
+/**
+ * A request that waits for a session with a server that is at its cap. The
+ * caller zero-initializes it before the first wait.
+ **/
+typedef struct smbpool_waiter {
+  const char* server;
+  void (*cb)(void* arg, int err);
+  void* arg;
+  time_t deadline;
+  task_timer_t timer;
+  struct smbpool_waiter* next;
+} smbpool_waiter_t;
+
+
+/**
+ * Acquire an authenticated session with a share on a server ("addr:port"),
+ * reusing an idle session with the same credentials when there is one.
+ * Returns 0 on success.
+ *
+ * On failure, -1 is returned and *smb2 is either NULL (errno is set), or a
+ * context that holds the smb error, which the caller has to pass on to
+ * smbpool_discard() once the error has been reported. If the server is at its
+ * cap, errno is EAGAIN, and the caller may use smbpool_wait().
+ **/
+int smbpool_acquire(const char* server, const char* share, const char* user,
+		    const char* pass, struct smb2_context **smb2);
+
+
+/**
+ * Wait for a session with a server that is at its cap to become available,
+ * without blocking. Once it has, or when the wait times out, cb(arg, err) is
+ * invoked with err set to 0 or ETIMEDOUT respectively, after which the
+ * caller should try smbpool_acquire() again. The deadline is kept across
+ * waits with the same waiter. Returns -1 if the server is no longer at its
+ * cap, in which case cb is not invoked.
+ **/
+int smbpool_wait(const char* server, smbpool_waiter_t* w,
+		 void (*cb)(void* arg, int err), void* arg);
+
+
+/**
+ * Return a session to the pool, so that it can be reused by other requests.
+ **/
+void smbpool_release(struct smb2_context *smb2);
+
+
+/**
+ * Destroy a session that is in a bad state, e.g., after an i/o error.
+ **/
+void smbpool_discard(struct smb2_context *smb2);
@@ -0,0 +1,474 @@
+/* Copyright (C) 2026 John Törnblom
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation; either version 3, or (at your option) any
+later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; see the file COPYING. If not, see
+<http://www.gnu.org/licenses/>.  */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <microhttpd.h>
+
+#include "task.h"
+
+
+/**
+ * Maximum number of helper threads. They are started on demand, i.e., when
+ * work is queued and no helper is idle, and kept once started.
+ **/
+#ifndef TASK_POOL_SIZE
+#define TASK_POOL_SIZE 16
+#endif
+
+
+/**
+ * Work queued for the helper threads.
+ **/
+typedef struct task {
+  task_fn_t* fn;
+  void* arg;
+  struct MHD_Connection *conn;
+  struct task* next;
+} task_t;
+
+
+/**
+ * State of a response that is read on helper threads.
+ **/
+typedef struct task_reader {
+  pthread_mutex_t lock;
+  struct MHD_Connection *conn;
+  MHD_ContentReaderCallback cb;
+  MHD_ContentReaderFreeCallback free_cb;
+  void* cls;
+
+  uint64_t size;
+  uint64_t pos;
+  ssize_t status;
+  bool busy;
+  bool waiting;
+  bool closed;
+
+  size_t len;
+  size_t off;
+  size_t bufsize;
+  char buf[];
+} task_reader_t;
+
+
+/**
+ * Global state variables.
+ **/
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
+static task_t* g_task_head = 0;
+static task_t* g_task_tail = 0;
+static unsigned int g_queued = 0;
+static unsigned int g_threads = 0;
+static unsigned int g_idle = 0;
+
+static pthread_mutex_t g_timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_timer_cond;
+static pthread_cond_t g_timer_done = PTHREAD_COND_INITIALIZER;
+static task_timer_t* g_timer_head = 0;
+static task_timer_t* g_timer_firing = 0;
+static bool g_timer_started = false;
+
+
+/**
+ * Helper thread that runs queued work.
+ **/
+static void*
+task_thread(void* args) {
+  task_t* t;
+
+  pthread_mutex_lock(&g_lock);
+  while(1) {
+    g_idle++;
+    while(!g_task_head) {
+      pthread_cond_wait(&g_cond, &g_lock);
+    }
+    g_idle--;
+
+    t = g_task_head;
+    if(!(g_task_head=t->next)) {
+      g_task_tail = 0;
+    }
+    g_queued--;
+    pthread_mutex_unlock(&g_lock);
+
+    t->fn(t->arg);
+    if(t->conn) {
+      MHD_resume_connection(t->conn);
+    }
+    free(t);
+
+    pthread_mutex_lock(&g_lock);
+  }
+
+  return 0;
+}
+
+
+/**
+ * Queue work for the helper threads, and start another one if all of them
+ * are busy.
+ **/
+static int
+task_queue(task_fn_t* fn, void* arg, struct MHD_Connection *conn) {
+  pthread_t thread;
+  task_t* t;
+
+  if(!(t=malloc(sizeof(task_t)))) {
+    return -1;
+  }
+
+  t->fn = fn;
+  t->arg = arg;
+  t->conn = conn;
+  t->next = 0;
+
+  pthread_mutex_lock(&g_lock);
+  if(g_task_tail) {
+    g_task_tail->next = t;
+  } else {
+    g_task_head = t;
+  }
+  g_task_tail = t;
+  g_queued++;
+
+  if(g_queued > g_idle && g_threads < TASK_POOL_SIZE) {
+    if(!pthread_create(&thread, 0, task_thread, 0)) {
+      pthread_detach(thread);
+      g_threads++;
+    } else {
+      perror("pthread_create");
+    }
+  }
+
+  // nothing will ever run the work without a helper thread
+  if(!g_threads) {
+    g_task_head = g_task_tail = 0;
+    g_queued = 0;
+    pthread_mutex_unlock(&g_lock);
+    free(t);
+    return -1;
+  }
+
+  pthread_cond_signal(&g_cond);
+  pthread_mutex_unlock(&g_lock);
+
+  return 0;
+}
+
+
+int
+task_submit(task_fn_t* fn, void* arg) {
+  return task_queue(fn, arg, 0);
+}
+
+
+int
+task_suspend(struct MHD_Connection *conn, task_fn_t* fn, void* arg) {
+  MHD_suspend_connection(conn);
+  if(task_queue(fn, arg, conn)) {
+    MHD_resume_connection(conn);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/**
+ * Compare two points in time.
+ **/
+static int
+task_timespec_cmp(const struct timespec* a, const struct timespec* b) {
+  if(a->tv_sec != b->tv_sec) {
+    return a->tv_sec < b->tv_sec ? -1 : 1;
+  }
+  if(a->tv_nsec != b->tv_nsec) {
+    return a->tv_nsec < b->tv_nsec ? -1 : 1;
+  }
+  return 0;
+}
+
+
+/**
+ * Thread that runs timers once they are due.
+ **/
+static void*
+task_timer_thread(void* args) {
+  struct timespec now;
+  task_timer_t* t;
+
+  pthread_mutex_lock(&g_timer_lock);
+  while(1) {
+    if(!(t=g_timer_head)) {
+      pthread_cond_wait(&g_timer_cond, &g_timer_lock);
+      continue;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if(task_timespec_cmp(&now, &t->deadline) < 0) {
+      pthread_cond_timedwait(&g_timer_cond, &g_timer_lock, &t->deadline);
+      continue;
+    }
+
+    g_timer_head = t->next;
+    g_timer_firing = t;
+    pthread_mutex_unlock(&g_timer_lock);
+
+    // the timer may be released by fn, or as soon as it has returned
+    t->fn(t->arg);
+
+    pthread_mutex_lock(&g_timer_lock);
+    g_timer_firing = 0;
+    pthread_cond_broadcast(&g_timer_done);
+  }
+
+  return 0;
+}
+
+
+int
+task_timer_start(task_timer_t* t, unsigned int ms, task_fn_t* fn,
+		 void* arg) {
+  pthread_condattr_t attr;
+  task_timer_t** it;
+  pthread_t thread;
+
+  clock_gettime(CLOCK_MONOTONIC, &t->deadline);
+  t->deadline.tv_sec += ms / 1000;
+  t->deadline.tv_nsec += (ms % 1000) * 1000000L;
+  if(t->deadline.tv_nsec >= 1000000000L) {
+    t->deadline.tv_sec++;
+    t->deadline.tv_nsec -= 1000000000L;
+  }
+  t->fn = fn;
+  t->arg = arg;
+
+  pthread_mutex_lock(&g_timer_lock);
+  if(!g_timer_started) {
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&g_timer_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if(pthread_create(&thread, 0, task_timer_thread, 0)) {
+      perror("pthread_create");
+      pthread_cond_destroy(&g_timer_cond);
+      pthread_mutex_unlock(&g_timer_lock);
+      return -1;
+    }
+    pthread_detach(thread);
+    g_timer_started = true;
+  }
+
+  // timers are kept sorted on their deadlines
+  for(it=&g_timer_head; *it; it=&(*it)->next) {
+    if(task_timespec_cmp(&t->deadline, &(*it)->deadline) < 0) {
+      break;
+    }
+  }
+  t->next = *it;
+  *it = t;
+
+  pthread_cond_signal(&g_timer_cond);
+  pthread_mutex_unlock(&g_timer_lock);
+
+  return 0;
+}
+
+
+int
+task_timer_stop(task_timer_t* t) {
+  pthread_mutex_lock(&g_timer_lock);
+  for(task_timer_t** it=&g_timer_head; *it; it=&(*it)->next) {
+    if(*it == t) {
+      *it = t->next;
+      pthread_mutex_unlock(&g_timer_lock);
+      return 0;
+    }
+  }
+
+  while(g_timer_firing == t) {
+    pthread_cond_wait(&g_timer_done, &g_timer_lock);
+  }
+  pthread_mutex_unlock(&g_timer_lock);
+
+  return -1;
+}
+
+
+/**
+ * Release a response that is read on helper threads.
+ **/
+static void
+task_reader_free(void* arg) {
+  task_reader_t* tr = arg;
+
+  if(tr->free_cb) {
+    tr->free_cb(tr->cls);
+  }
+  pthread_mutex_destroy(&tr->lock);
+  free(tr);
+}
+
+
+/**
+ * Read the next block of a response into the buffer of its reader.
+ **/
+static void
+task_reader_fill(void* arg) {
+  task_reader_t* tr = arg;
+  size_t max = tr->bufsize;
+  bool closed;
+  ssize_t n;
+
+  if(tr->size != MHD_SIZE_UNKNOWN && tr->size - tr->pos < max) {
+    max = tr->size - tr->pos;
+  }
+  if(!max) {
+    n = MHD_CONTENT_READER_END_OF_STREAM;
+  } else {
+    n = tr->cb(tr->cls, tr->pos, tr->buf, max);
+  }
+
+  pthread_mutex_lock(&tr->lock);
+  tr->off = 0;
+  tr->len = 0;
+  if(n > 0) {
+    tr->len = n;
+    tr->pos += n;
+  } else if(n < 0) {
+    tr->status = n;
+  }
+  tr->busy = false;
+  if(tr->waiting) {
+    tr->waiting = false;
+    MHD_resume_connection(tr->conn);
+  }
+  closed = tr->closed;
+  pthread_mutex_unlock(&tr->lock);
+
+  // the response was destroyed while the block was being read
+  if(closed) {
+    task_reader_free(tr);
+  }
+}
+
+
+/**
+ * Start reading the next block. The caller must hold the lock of the reader.
+ **/
+static int
+task_reader_start(task_reader_t* tr) {
+  tr->busy = true;
+  if(task_submit(task_reader_fill, tr)) {
+    tr->busy = false;
+    tr->status = MHD_CONTENT_READER_END_WITH_ERROR;
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/**
+ * Pass on data that has been read by a helper thread, or suspend the
+ * connection until there is some.
+ **/
+static ssize_t
+task_reader_read(void *cls, uint64_t pos, char *buf, size_t max) {
+  task_reader_t* tr = cls;
+  ssize_t ret = 0;
+
+  pthread_mutex_lock(&tr->lock);
+  if(tr->off < tr->len) {
+    ret = tr->len - tr->off;
+    if((size_t)ret > max) {
+      ret = max;
+    }
+    memcpy(buf, tr->buf + tr->off, ret);
+    tr->off += ret;
+
+    // read ahead while the block is being sent
+    if(tr->off == tr->len && !tr->status) {
+      task_reader_start(tr);
+    }
+  } else if(tr->busy || (!tr->status && !task_reader_start(tr))) {
+    tr->waiting = true;
+    MHD_suspend_connection(tr->conn);
+  } else {
+    ret = tr->status;
+  }
+  pthread_mutex_unlock(&tr->lock);
+
+  return ret;
+}
+
+
+/**
+ * Release a response once it has been destroyed by libmicrohttpd, deferred
+ * to a helper thread since free callbacks may block too.
+ **/
+static void
+task_reader_close(void *cls) {
+  task_reader_t* tr = cls;
+  bool busy;
+
+  pthread_mutex_lock(&tr->lock);
+  tr->closed = true;
+  busy = tr->busy;
+  pthread_mutex_unlock(&tr->lock);
+
+  if(!busy && task_submit(task_reader_free, tr)) {
+    task_reader_free(tr);
+  }
+}
+
+
+struct MHD_Response*
+task_create_response(struct MHD_Connection *conn, uint64_t size,
+		     size_t block_size, MHD_ContentReaderCallback cb,
+		     void* cls, MHD_ContentReaderFreeCallback free_cb) {
+  struct MHD_Response *resp;
+  task_reader_t* tr;
+
+  if(!(tr=calloc(1, sizeof(task_reader_t) + block_size))) {
+    return 0;
+  }
+
+  pthread_mutex_init(&tr->lock, 0);
+  tr->conn = conn;
+  tr->cb = cb;
+  tr->free_cb = free_cb;
+  tr->cls = cls;
+  tr->size = size;
+  tr->bufsize = block_size;
+
+  if(!(resp=MHD_create_response_from_callback(size, block_size,
+					      &task_reader_read, tr,
+					      &task_reader_close))) {
+    pthread_mutex_destroy(&tr->lock);
+    free(tr);
+    return 0;
+  }
+
+  return resp;
+}
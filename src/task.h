@@ -0,0 +1,89 @@
+/* Copyright (C) 2026 John Törnblom
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation; either version 3, or (at your option) any
+later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; see the file COPYING. If not, see
+<http://www.gnu.org/licenses/>.  */
+
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+#include <microhttpd.h>
+
+
+/**
+ * Work that is run on a helper thread.
+ **/
+typedef void (task_fn_t)(void* arg);
+
+
+/**
+ * Run fn(arg) on one of a bounded number of helper threads that are shared
+ * by all requests. Work is queued while all of them are busy. Returns 0 on
+ * success.
+ **/
+int task_submit(task_fn_t* fn, void* arg);
+
+
+/**
+ * Suspend a connection, and run fn(arg) on a helper thread. The connection
+ * is resumed once fn has returned, upon which libmicrohttpd invokes the
+ * access handler again. Must be called from the access handler. Returns 0
+ * on success, and leaves the connection as it was on failure.
+ **/
+int task_suspend(struct MHD_Connection *conn, task_fn_t* fn, void* arg);
+
+
+/**
+ * A timer that runs a function once. The function is invoked on the timer
+ * thread, and must not block, e.g., it may resume a connection or submit
+ * work to the helper threads.
+ **/
+typedef struct task_timer {
+  struct timespec deadline;
+  task_fn_t* fn;
+  void* arg;
+  struct task_timer* next;
+} task_timer_t;
+
+
+/**
+ * Run fn(arg) once the given number of milliseconds have passed, unless the
+ * timer is stopped before that. Returns 0 on success.
+ **/
+int task_timer_start(task_timer_t* t, unsigned int ms, task_fn_t* fn,
+		     void* arg);
+
+
+/**
+ * Stop a timer. Returns 0 if the timer was stopped before it fired, and -1 if
+ * it has already fired, in which case this function waits for fn to return.
+ **/
+int task_timer_stop(task_timer_t* t);
+
+
+/**
+ * Create a response like MHD_create_response_from_callback(), except that
+ * cb and free_cb are invoked on helper threads, so that they may block.
+ * While cb is running, the connection is suspended rather than holding up
+ * the event loop that serves it, and the next block is read ahead while
+ * the previous one is being sent. Like MHD_create_response_from_callback(),
+ * free_cb is invoked with cls once the response is destroyed, but not when
+ * this function fails.
+ **/
+struct MHD_Response* task_create_response(struct MHD_Connection *conn,
+					  uint64_t size, size_t block_size,
+					  MHD_ContentReaderCallback cb,
+					  void* cls,
+					  MHD_ContentReaderFreeCallback free_cb);
@@ -0,0 +1,1074 @@
+/* Copyright (C) 2026 John Törnblom
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation; either version 3, or (at your option) any
+later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; see the file COPYING. If not, see
+<http://www.gnu.org/licenses/>.  */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include <microhttpd.h>
+
+#include "dircache.h"
+#include "dirlist.h"
+#include "task.h"
+#include "upload.h"
+#include "websrv.h"
+
+
+/**
+ * Size of the buffer that request bodies are collected in before they are
+ * written to disk, i.e., the size of most writes.
+ **/
+#ifndef UPLOAD_BUF_SIZE
+#define UPLOAD_BUF_SIZE (1024 * 1024)
+#endif
+
+
+/**
+ * Size of each of the two buffers that request bodies are received into,
+ * while the other one is being written to disk by a helper thread.
+ **/
+#ifndef UPLOAD_IN_SIZE
+#define UPLOAD_IN_SIZE (256 * 1024)
+#endif
+
+
+/**
+ * Alignment of the write buffer.
+ **/
+#ifndef UPLOAD_BUF_ALIGN
+#define UPLOAD_BUF_ALIGN 0x4000
+#endif
+
+
+/**
+ * Size of the buffer used by the multipart/form-data parser.
+ **/
+#ifndef UPLOAD_POST_BUF_SIZE
+#define UPLOAD_POST_BUF_SIZE 0x10000
+#endif
+
+
+/**
+ * Suffix of temporary files that uploads are written to before they are
+ * renamed to their final destination.
+ **/
+#define UPLOAD_SUFFIX ".part"
+
+
+/**
+ * Complete length of a Content-Range that ends with an asterisk, i.e., the
+ * client does not know the size of the file yet.
+ **/
+#define UPLOAD_SIZE_UNKNOWN UINT64_MAX
+
+
+struct upload {
+  struct MHD_Connection *conn;
+  struct MHD_PostProcessor* pp;
+  unsigned int status;
+
+  // Content-Range of a resumable PUT request
+  bool resumable;
+  bool probe;
+  uint64_t start;
+  uint64_t end;
+  uint64_t total;
+
+  // the file that is currently being written
+  int fd;
+  bool existed;
+  char path[PATH_MAX];
+  char tmp[PATH_MAX];
+  char* buf;
+  size_t len;
+  uint64_t offset;
+  uint64_t received;
+  uint64_t progress;
+
+  // destination directory and completed files of a multipart POST request
+  char dir[PATH_MAX];
+  dirlist_t saved;
+
+  // data received by libmicrohttpd, and data being processed by a helper
+  pthread_mutex_t lock;
+  char* in;
+  size_t in_len;
+  char* work;
+  size_t work_len;
+  bool started;
+  bool busy;
+  bool waiting;
+  bool closed;
+  bool finished;
+
+  // response recorded by a helper, and queued once the connection resumes
+  unsigned int reply_status;
+  char reply_range[64];
+  char* reply_body;
+  size_t reply_size;
+
+  struct upload* next;
+};
+
+
+/**
+ * Global state variables.
+ **/
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static upload_t* g_upload_seq = 0;
+
+
+/**
+ * Map an errno from a failed file operation to an HTTP status.
+ **/
+static unsigned int
+upload_errno_status(int err) {
+  switch(err) {
+  case ENOENT:
+  case ENOTDIR:
+    return MHD_HTTP_NOT_FOUND;
+
+  case EACCES:
+  case EPERM:
+  case EROFS:
+    return MHD_HTTP_FORBIDDEN;
+
+  case EISDIR:
+  case EEXIST:
+    return MHD_HTTP_CONFLICT;
+
+  case ENOSPC:
+  case EDQUOT:
+    return MHD_HTTP_INSUFFICIENT_STORAGE;
+
+  case EFBIG:
+    return MHD_HTTP_CONTENT_TOO_LARGE;
+
+  case ENAMETOOLONG:
+    return MHD_HTTP_BAD_REQUEST;
+
+  default:
+    return MHD_HTTP_INTERNAL_SERVER_ERROR;
+  }
+}
+
+
+/**
+ * Record the first error of an upload. Once an error has occurred, the rest
+ * of the request body is discarded.
+ **/
+static void
+upload_fail(upload_t* up, unsigned int status) {
+  if(!up->status) {
+    up->status = status;
+  }
+}
+
+
+/**
+ * Parse a Content-Range header on the form "bytes a-b/total", where total
+ * may be an asterisk. An asterisk in place of the range "a-b" asks for the
+ * status of a resumable upload.
+ **/
+static int
+upload_parse_content_range(upload_t* up, const char* s) {
+  char* end;
+
+  if(strncmp(s, "bytes ", 6)) {
+    return -1;
+  }
+  s += 6;
+  s += strspn(s, " ");
+
+  if(*s == '*') {
+    up->probe = true;
+    s++;
+  } else {
+    if(*s < '0' || *s > '9') {
+      return -1;
+    }
+    up->start = strtoull(s, &end, 10);
+    if(*end != '-' || end[1] < '0' || end[1] > '9') {
+      return -1;
+    }
+    up->end = strtoull(end+1, &end, 10);
+    if(up->end < up->start) {
+      return -1;
+    }
+    s = end;
+  }
+
+  if(*s++ != '/') {
+    return -1;
+  }
+  if(*s == '*' && !s[1]) {
+    up->total = UPLOAD_SIZE_UNKNOWN;
+    return up->probe ? -1 : 0;
+  }
+  if(*s < '0' || *s > '9') {
+    return -1;
+  }
+
+  up->total = strtoull(s, &end, 10);
+  if(*end) {
+    return -1;
+  }
+  if(!up->probe && up->end >= up->total) {
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/**
+ * Set the destination path of the current file, and the path of the
+ * temporary file it is written to.
+ **/
+static int
+upload_set_path(upload_t* up, const char* dir, const char* name) {
+  int ret = 0;
+  size_t len;
+
+  // the path is reported by upload_progress_request()
+  pthread_mutex_lock(&g_lock);
+  if(dir) {
+    len = snprintf(up->path, sizeof(up->path), "%s/%s", dir, name);
+  } else {
+    len = snprintf(up->path, sizeof(up->path), "%s", name);
+  }
+  if(len >= sizeof(up->path) ||
+     snprintf(up->tmp, sizeof(up->tmp), "%s" UPLOAD_SUFFIX,
+	      up->path) >= sizeof(up->tmp)) {
+    up->path[0] = 0;
+    up->tmp[0] = 0;
+    ret = -1;
+  }
+  up->progress = 0;
+  pthread_mutex_unlock(&g_lock);
+
+  return ret;
+}
+
+
+/**
+ * Write buffered data to disk.
+ **/
+static int
+upload_flush(upload_t* up) {
+  size_t off = 0;
+  ssize_t n;
+
+  while(off < up->len) {
+    if((n=pwrite(up->fd, up->buf+off, up->len-off, up->offset+off)) < 0) {
+      if(errno == EINTR) {
+	continue;
+      }
+      return -1;
+    }
+    off += n;
+  }
+
+  up->offset += up->len;
+  up->len = 0;
+
+  return 0;
+}
+
+
+/**
+ * Append data to the current file. Writes are collected in a buffer so that
+ * the file system sees a few large writes rather than one write per chunk
+ * received from the network.
+ **/
+static void
+upload_write(upload_t* up, const char* data, size_t size) {
+  size_t n;
+
+  while(size) {
+    n = UPLOAD_BUF_SIZE - up->len;
+    if(n > size) {
+      n = size;
+    }
+    memcpy(up->buf + up->len, data, n);
+    up->len += n;
+    data += n;
+    size -= n;
+
+    if(up->len == UPLOAD_BUF_SIZE && upload_flush(up)) {
+      upload_fail(up, upload_errno_status(errno));
+      return;
+    }
+  }
+}
+
+
+/**
+ * Write buffered data to disk and close the current file, making sure the
+ * data is persisted if the file is to be renamed or resumed.
+ **/
+static int
+upload_close(upload_t* up, bool sync) {
+  int err = 0;
+
+  if(upload_flush(up) || (sync && fsync(up->fd))) {
+    err = errno;
+  }
+  if(close(up->fd) && !err) {
+    err = errno;
+  }
+  up->fd = -1;
+
+  if(err) {
+    errno = err;
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/**
+ * Drop cached listings of the directory that contains the current file.
+ **/
+static void
+upload_invalidate(upload_t* up) {
+  char dir[PATH_MAX];
+  char* p;
+
+  strcpy(dir, up->path);
+  if(!(p=strrchr(dir, '/'))) {
+    return;
+  }
+  while(p > dir && p[-1] == '/') {
+    p--;
+  }
+  if(p == dir) {
+    p++;
+  }
+  *p = 0;
+
+  dircache_invalidate(dir);
+}
+
+
+/**
+ * Complete the current file, and atomically move it into place.
+ **/
+static int
+upload_commit(upload_t* up) {
+  struct stat st;
+
+  if(upload_close(up, true)) {
+    upload_fail(up, upload_errno_status(errno));
+    return -1;
+  }
+
+  up->existed = !stat(up->path, &st);
+  if(up->existed && S_ISDIR(st.st_mode)) {
+    upload_fail(up, MHD_HTTP_CONFLICT);
+    return -1;
+  }
+  if(rename(up->tmp, up->path)) {
+    upload_fail(up, upload_errno_status(errno));
+    return -1;
+  }
+  up->tmp[0] = 0;
+  upload_invalidate(up);
+
+  return 0;
+}
+
+
+/**
+ * Start writing a file to its temporary location, continuing from the given
+ * offset if the upload is resumed.
+ **/
+static int
+upload_open(upload_t* up, bool resume, uint64_t offset) {
+  struct stat st;
+  int flags;
+
+  // a resumed upload must continue where a previous request left off
+  flags = O_WRONLY;
+  if(!resume) {
+    flags |= O_CREAT | O_TRUNC;
+  } else if(!offset) {
+    flags |= O_CREAT;
+  }
+
+  if(!stat(up->path, &st) && S_ISDIR(st.st_mode)) {
+    upload_fail(up, MHD_HTTP_CONFLICT);
+    return -1;
+  }
+  if((up->fd=open(up->tmp, flags, 0666)) < 0) {
+    if(resume && errno == ENOENT) {
+      upload_fail(up, MHD_HTTP_RANGE_NOT_SATISFIABLE);
+    } else {
+      upload_fail(up, upload_errno_status(errno));
+    }
+    return -1;
+  }
+
+  if(resume) {
+    if(fstat(up->fd, &st)) {
+      upload_fail(up, upload_errno_status(errno));
+      return -1;
+    }
+    if(offset > (uint64_t)st.st_size) {
+      upload_fail(up, MHD_HTTP_RANGE_NOT_SATISFIABLE);
+      return -1;
+    }
+    if(ftruncate(up->fd, offset)) {
+      upload_fail(up, upload_errno_status(errno));
+      return -1;
+    }
+  }
+
+  up->offset = offset;
+  up->received = 0;
+  up->len = 0;
+
+  return 0;
+}
+
+
+/**
+ * Start writing a new file from a multipart/form-data body.
+ **/
+static int
+upload_begin_part(upload_t* up, const char* filename) {
+  if(!*filename || strchr(filename, '/') || !strcmp(filename, ".") ||
+     !strcmp(filename, "..")) {
+    upload_fail(up, MHD_HTTP_BAD_REQUEST);
+    return -1;
+  }
+
+  if(upload_set_path(up, up->dir, filename)) {
+    upload_fail(up, MHD_HTTP_BAD_REQUEST);
+    return -1;
+  }
+
+  return upload_open(up, false, 0);
+}
+
+
+/**
+ * Complete a file from a multipart/form-data body.
+ **/
+static void
+upload_end_part(upload_t* up) {
+  const char* name = strrchr(up->path, '/') + 1;
+  uint64_t size = up->offset + up->len;
+  struct stat st;
+  time_t mtime;
+
+  mtime = fstat(up->fd, &st) ? 0 : st.st_mtime;
+  if(!upload_commit(up) && dirlist_add(&up->saved, name, '-', mtime, size)) {
+    upload_fail(up, MHD_HTTP_INTERNAL_SERVER_ERROR);
+  }
+}
+
+
+/**
+ * Stream files of a multipart/form-data body to disk. Fields that are not
+ * files are ignored.
+ **/
+static enum MHD_Result
+upload_post_iterator(void *cls, enum MHD_ValueKind kind, const char *key,
+		     const char *filename, const char *mime,
+		     const char *encoding, const char *data, uint64_t off,
+		     size_t size) {
+  upload_t* up = cls;
+
+  if(!filename || up->status) {
+    return MHD_YES;
+  }
+
+  // a new part starts at offset zero, but the first chunk may be empty
+  if(up->fd < 0 || (!off && up->received) ||
+     strcmp(filename, strrchr(up->path, '/') + 1)) {
+    if(up->fd >= 0) {
+      upload_end_part(up);
+    }
+    if(up->status || upload_begin_part(up, filename)) {
+      return MHD_YES;
+    }
+  }
+
+  up->received += size;
+  upload_write(up, data, size);
+
+  return MHD_YES;
+}
+
+
+/**
+ * Prepare a PUT request.
+ **/
+static void
+upload_create_put(upload_t* up, struct MHD_Connection *conn,
+		  const char* path) {
+  const char* s;
+
+  if(!*path || path[strlen(path)-1] == '/') {
+    upload_fail(up, MHD_HTTP_CONFLICT);
+    return;
+  }
+  if(upload_set_path(up, 0, path)) {
+    upload_fail(up, MHD_HTTP_BAD_REQUEST);
+    return;
+  }
+
+  if((s=MHD_lookup_connection_value(conn, MHD_HEADER_KIND,
+				    MHD_HTTP_HEADER_CONTENT_RANGE))) {
+    up->resumable = true;
+    if(upload_parse_content_range(up, s)) {
+      upload_fail(up, MHD_HTTP_BAD_REQUEST);
+      return;
+    }
+  } else if((s=MHD_lookup_connection_value(conn, MHD_HEADER_KIND,
+					   MHD_HTTP_HEADER_CONTENT_LENGTH))) {
+    up->total = strtoull(s, 0, 10);
+  } else {
+    up->total = UPLOAD_SIZE_UNKNOWN;
+  }
+}
+
+
+/**
+ * Prepare a multipart/form-data POST request.
+ **/
+static void
+upload_create_post(upload_t* up, struct MHD_Connection *conn,
+		   const char* path) {
+  struct stat st;
+
+  up->total = UPLOAD_SIZE_UNKNOWN;
+
+  if(!*path) {
+    path = "/";
+  }
+  if(strlen(path) >= sizeof(up->dir)) {
+    upload_fail(up, MHD_HTTP_BAD_REQUEST);
+    return;
+  }
+  strcpy(up->dir, path);
+
+  if(stat(path, &st)) {
+    upload_fail(up, upload_errno_status(errno));
+    return;
+  }
+  if(!S_ISDIR(st.st_mode)) {
+    upload_fail(up, MHD_HTTP_CONFLICT);
+    return;
+  }
+
+  if(!(up->pp=MHD_create_post_processor(conn, UPLOAD_POST_BUF_SIZE,
+					&upload_post_iterator, up))) {
+    upload_fail(up, MHD_HTTP_UNSUPPORTED_MEDIA_TYPE);
+  }
+}
+
+
+upload_t*
+upload_create(struct MHD_Connection *conn, const char* path,
+	      const char* method) {
+  upload_t* up;
+
+  if(!(up=calloc(1, sizeof(upload_t)))) {
+    return 0;
+  }
+  if(posix_memalign((void**)&up->buf, UPLOAD_BUF_ALIGN, UPLOAD_BUF_SIZE)) {
+    free(up);
+    return 0;
+  }
+  if(!(up->in=malloc(UPLOAD_IN_SIZE)) || !(up->work=malloc(UPLOAD_IN_SIZE))) {
+    free(up->in);
+    free(up->buf);
+    free(up);
+    return 0;
+  }
+
+  pthread_mutex_init(&up->lock, 0);
+  up->conn = conn;
+  up->fd = -1;
+
+  if(!strcmp(method, MHD_HTTP_METHOD_PUT)) {
+    upload_create_put(up, conn, path);
+  } else {
+    upload_create_post(up, conn, path);
+  }
+
+  pthread_mutex_lock(&g_lock);
+  up->next = g_upload_seq;
+  g_upload_seq = up;
+  pthread_mutex_unlock(&g_lock);
+
+  return up;
+}
+
+
+/**
+ * Open the destination of a PUT request once the first data is processed,
+ * so that the file system is only accessed from helper threads.
+ **/
+static void
+upload_start(upload_t* up) {
+  if(up->started) {
+    return;
+  }
+  up->started = true;
+
+  if(!up->dir[0] && !up->status && !up->probe) {
+    upload_open(up, up->resumable, up->start);
+  }
+}
+
+
+/**
+ * Parse and write a chunk of the request body.
+ **/
+static void
+upload_consume(upload_t* up, const char* data, size_t size) {
+  upload_start(up);
+  if(up->status || !size) {
+    return;
+  }
+
+  if(up->pp) {
+    if(MHD_post_process(up->pp, data, size) != MHD_YES) {
+      upload_fail(up, MHD_HTTP_BAD_REQUEST);
+    }
+  } else if(up->probe) {
+    upload_fail(up, MHD_HTTP_BAD_REQUEST);
+  } else {
+    up->received += size;
+    upload_write(up, data, size);
+  }
+
+  // include data of the file from previous requests of a resumed upload
+  pthread_mutex_lock(&g_lock);
+  up->progress = up->offset + up->len;
+  pthread_mutex_unlock(&g_lock);
+}
+
+
+/**
+ * Release an upload that is no longer referenced by its connection.
+ **/
+static void
+upload_free(void* arg) {
+  upload_t* up = arg;
+
+  if(up->pp) {
+    MHD_destroy_post_processor(up->pp);
+  }
+
+  // keep what has been received of an aborted resumable upload
+  if(up->fd >= 0) {
+    if(up->resumable && !up->status) {
+      upload_flush(up);
+    }
+    close(up->fd);
+  }
+  if(up->tmp[0] && !up->resumable) {
+    unlink(up->tmp);
+  }
+
+  pthread_mutex_destroy(&up->lock);
+  dirlist_free(&up->saved);
+  free(up->reply_body);
+  free(up->work);
+  free(up->in);
+  free(up->buf);
+  free(up);
+}
+
+
+/**
+ * Write received data on a helper thread, and resume the connection if it
+ * was suspended while waiting for the buffer to become available.
+ **/
+static void
+upload_work(void* arg) {
+  upload_t* up = arg;
+  bool closed;
+
+  upload_consume(up, up->work, up->work_len);
+
+  pthread_mutex_lock(&up->lock);
+  up->work_len = 0;
+  up->busy = false;
+  if(up->waiting) {
+    up->waiting = false;
+    MHD_resume_connection(up->conn);
+  }
+  closed = up->closed;
+  pthread_mutex_unlock(&up->lock);
+
+  if(closed) {
+    upload_free(up);
+  }
+}
+
+
+/**
+ * Hand the received data over to a helper thread. The caller must hold the
+ * lock of the upload.
+ **/
+static void
+upload_dispatch(upload_t* up) {
+  char* buf = up->work;
+
+  up->work = up->in;
+  up->work_len = up->in_len;
+  up->in = buf;
+  up->in_len = 0;
+  up->busy = true;
+
+  if(task_submit(upload_work, up)) {
+    up->busy = false;
+    upload_fail(up, MHD_HTTP_SERVICE_UNAVAILABLE);
+  }
+}
+
+
+size_t
+upload_process(upload_t* up, const char* data, size_t size) {
+  size_t n;
+
+  pthread_mutex_lock(&up->lock);
+  if(up->in_len == UPLOAD_IN_SIZE) {
+    // both buffers are full, wait for the helper to catch up
+    if(up->busy) {
+      up->waiting = true;
+      MHD_suspend_connection(up->conn);
+      pthread_mutex_unlock(&up->lock);
+      return 0;
+    }
+    upload_dispatch(up);
+  }
+
+  n = UPLOAD_IN_SIZE - up->in_len;
+  if(n > size) {
+    n = size;
+  }
+  memcpy(up->in + up->in_len, data, n);
+  up->in_len += n;
+
+  if(up->in_len == UPLOAD_IN_SIZE && !up->busy) {
+    upload_dispatch(up);
+  }
+  pthread_mutex_unlock(&up->lock);
+
+  return n;
+}
+
+
+/**
+ * Record a response with an empty body.
+ **/
+static void
+upload_respond(upload_t* up, unsigned int status, const char* range) {
+  up->reply_status = status;
+  if(range) {
+    snprintf(up->reply_range, sizeof(up->reply_range), "%s", range);
+  }
+}
+
+
+/**
+ * Respond with the range of a resumable upload that has been persisted, if
+ * any. Following the convention of common resumable upload protocols, 308
+ * tells the client to continue with the next byte after that range.
+ **/
+static void
+upload_respond_incomplete(upload_t* up, unsigned int status, uint64_t size) {
+  char range[64];
+
+  if(!size) {
+    upload_respond(up, status, 0);
+    return;
+  }
+
+  snprintf(range, sizeof(range), "bytes=0-%llu",
+	   (unsigned long long)(size - 1));
+
+  upload_respond(up, status, range);
+}
+
+
+/**
+ * Size of the temporary file of a resumable upload.
+ **/
+static uint64_t
+upload_resumable_size(upload_t* up) {
+  struct stat st;
+
+  if(!up->tmp[0] || stat(up->tmp, &st)) {
+    return 0;
+  }
+
+  return st.st_size;
+}
+
+
+/**
+ * Complete a PUT request.
+ **/
+static void
+upload_finish_put(upload_t* up) {
+  if(up->status == MHD_HTTP_RANGE_NOT_SATISFIABLE) {
+    upload_respond_incomplete(up, up->status, upload_resumable_size(up));
+    return;
+  }
+  if(up->status) {
+    upload_respond(up, up->status, 0);
+    return;
+  }
+
+  if(up->probe) {
+    upload_respond_incomplete(up, MHD_HTTP_PERMANENT_REDIRECT,
+			      upload_resumable_size(up));
+    return;
+  }
+
+  if(up->resumable && up->received != up->end - up->start + 1) {
+    upload_respond(up, MHD_HTTP_BAD_REQUEST, 0);
+    return;
+  }
+
+  // persist the chunk, and wait for the rest of the file
+  if(up->resumable && up->end + 1 != up->total) {
+    if(upload_close(up, true)) {
+      upload_respond(up, upload_errno_status(errno), 0);
+      return;
+    }
+    upload_respond_incomplete(up, MHD_HTTP_PERMANENT_REDIRECT, up->end + 1);
+    return;
+  }
+
+  if(upload_commit(up)) {
+    upload_respond(up, up->status, 0);
+    return;
+  }
+
+  upload_respond(up, up->existed ? MHD_HTTP_NO_CONTENT : MHD_HTTP_CREATED, 0);
+}
+
+
+/**
+ * Complete a multipart/form-data POST request, and respond with a listing
+ * of the files that were written.
+ **/
+static void
+upload_finish_post(upload_t* up) {
+  dirlist_opts_t opts = {0};
+
+  // flush the tail of the last part through the iterator
+  if(up->pp) {
+    if(MHD_destroy_post_processor(up->pp) != MHD_YES) {
+      upload_fail(up, MHD_HTTP_BAD_REQUEST);
+    }
+    up->pp = 0;
+  }
+  if(up->fd >= 0 && !up->status) {
+    upload_end_part(up);
+  }
+  if(!up->status && !up->saved.count) {
+    upload_fail(up, MHD_HTTP_BAD_REQUEST);
+  }
+  if(up->status) {
+    upload_respond(up, up->status, 0);
+    return;
+  }
+
+  opts.limit = SIZE_MAX;
+  if(!(up->reply_body=dirlist_render(&up->saved, &opts, &up->reply_size))) {
+    upload_respond(up, MHD_HTTP_INTERNAL_SERVER_ERROR, 0);
+    return;
+  }
+
+  upload_respond(up, MHD_HTTP_CREATED, 0);
+}
+
+
+/**
+ * Process the rest of the request body, and complete the upload on a helper
+ * thread.
+ **/
+static void
+upload_complete(void* arg) {
+  upload_t* up = arg;
+
+  upload_consume(up, up->in, up->in_len);
+  up->in_len = 0;
+
+  if(up->dir[0]) {
+    upload_finish_post(up);
+  } else {
+    upload_finish_put(up);
+  }
+  up->finished = true;
+}
+
+
+/**
+ * Queue the response that was recorded when the upload was completed.
+ **/
+static enum MHD_Result
+upload_reply(upload_t* up, struct MHD_Connection *conn) {
+  enum MHD_Result ret = MHD_NO;
+  struct MHD_Response *resp;
+
+  if(up->reply_body) {
+    resp = MHD_create_response_from_buffer(up->reply_size, up->reply_body,
+					   MHD_RESPMEM_MUST_FREE);
+    if(resp) {
+      up->reply_body = 0;
+      MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE,
+			      "application/json");
+    }
+  } else {
+    resp = MHD_create_response_from_buffer(0, "", MHD_RESPMEM_PERSISTENT);
+    if(resp && up->reply_range[0]) {
+      MHD_add_response_header(resp, MHD_HTTP_HEADER_RANGE, up->reply_range);
+    }
+  }
+
+  if(resp) {
+    ret = websrv_queue_response(conn, up->reply_status, resp);
+    MHD_destroy_response(resp);
+  }
+
+  return ret;
+}
+
+
+enum MHD_Result
+upload_finish(upload_t* up, struct MHD_Connection *conn) {
+  if(up->finished) {
+    return upload_reply(up, conn);
+  }
+
+  // the connection is resumed, and this function invoked again, once the
+  // last chunk has been written
+  pthread_mutex_lock(&up->lock);
+  if(up->busy) {
+    up->waiting = true;
+    MHD_suspend_connection(conn);
+    pthread_mutex_unlock(&up->lock);
+    return MHD_YES;
+  }
+  pthread_mutex_unlock(&up->lock);
+
+  if(task_suspend(conn, upload_complete, up)) {
+    upload_complete(up);
+    return upload_reply(up, conn);
+  }
+
+  return MHD_YES;
+}
+
+
+void
+upload_destroy(upload_t* up) {
+  bool busy;
+
+  pthread_mutex_lock(&g_lock);
+  for(upload_t** it=&g_upload_seq; *it; it=&(*it)->next) {
+    if(*it == up) {
+      *it = up->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&g_lock);
+
+  // a helper that is still writing releases the upload once it is done
+  pthread_mutex_lock(&up->lock);
+  up->closed = true;
+  busy = up->busy;
+  pthread_mutex_unlock(&up->lock);
+
+  if(!busy && task_submit(upload_free, up)) {
+    upload_free(up);
+  }
+}
+
+
+enum MHD_Result
+upload_progress_request(struct MHD_Connection *conn, const char* url) {
+  enum MHD_Result ret = MHD_NO;
+  struct MHD_Response *resp;
+  size_t size = 4;
+  uint64_t received;
+  upload_t* up;
+  char* buf;
+  char* p;
+
+  pthread_mutex_lock(&g_lock);
+  for(up=g_upload_seq; up; up=up->next) {
+    size += 6 * strlen(up->path) + 128;
+  }
+  if(!(buf=malloc(size))) {
+    pthread_mutex_unlock(&g_lock);
+    return MHD_NO;
+  }
+
+  p = buf;
+  *p++ = '[';
+  for(up=g_upload_seq; up; up=up->next) {
+    received = up->progress;
+    if(p > buf + 1) {
+      *p++ = ',';
+    }
+    p += sprintf(p, "{\"path\": ");
+    p += dirlist_json_string(p, up->path);
+    if(up->total == UPLOAD_SIZE_UNKNOWN) {
+      p += sprintf(p, ", \"received\": %llu, \"total\": null}",
+		   (unsigned long long)received);
+    } else {
+      p += sprintf(p, ", \"received\": %llu, \"total\": %llu}",
+		   (unsigned long long)received,
+		   (unsigned long long)up->total);
+    }
+  }
+  *p++ = ']';
+  *p++ = '\n';
+  pthread_mutex_unlock(&g_lock);
+
+  if((resp=MHD_create_response_from_buffer(p - buf, buf,
+					   MHD_RESPMEM_MUST_FREE))) {
+    MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE,
+                            "application/json");
+    MHD_add_response_header(resp, MHD_HTTP_HEADER_CACHE_CONTROL, "no-cache");
+    ret = websrv_queue_response(conn, MHD_HTTP_OK, resp);
+    MHD_destroy_response(resp);
+  } else {
+    free(buf);
+  }
+
+  return ret;
+}
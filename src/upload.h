@@ -0,0 +1,67 @@
+/* Copyright (C) 2026 John Törnblom
+
+This program is free software; you can redistribute it and/or modify it
+under the terms of the GNU General Public License as published by the
+Free Software Foundation; either version 3, or (at your option) any
+later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; see the file COPYING. If not, see
+<http://www.gnu.org/licenses/>.  */
+
+#pragma once
+
+#include <stddef.h>
+
+#include <microhttpd.h>
+
+
+/**
+ * State of an upload that is in progress.
+ **/
+typedef struct upload upload_t;
+
+
+/**
+ * Begin an upload to a path on the local file system. A PUT request writes
+ * its body to the file at the given path, and a POST request writes each
+ * file in its multipart/form-data body to the directory at the given path.
+ **/
+upload_t* upload_create(struct MHD_Connection *conn, const char* path,
+			const char* method);
+
+
+/**
+ * Receive a chunk of the request body, which is written to disk by a helper
+ * thread. Returns the number of bytes consumed, which is less than size if
+ * the connection was suspended until the helper has caught up.
+ **/
+size_t upload_process(upload_t* up, const char* data, size_t size);
+
+
+/**
+ * Complete an upload once the entire request body has been received, and
+ * respond to the request. The connection is suspended while the upload is
+ * completed by a helper thread, and the response is queued when this
+ * function is invoked again after it has been resumed.
+ **/
+enum MHD_Result upload_finish(upload_t* up, struct MHD_Connection *conn);
+
+
+/**
+ * Release resources held by an upload. Data of an aborted resumable upload
+ * is kept, so that the client can continue where it left off.
+ **/
+void upload_destroy(upload_t* up);
+
+
+/**
+ * Respond with the progress of uploads in progress (json).
+ **/
+enum MHD_Result upload_progress_request(struct MHD_Connection *conn,
+					const char* url);
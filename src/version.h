@@ -19,11 +19,13 @@ along with this program; see the file COPYING. If not, see
 #define STRINGIFY(x) #x
 #define TOSTRING(x) STRINGIFY(x)
 
+#define API_VERSION 1
+
 #define PAGE_VERSION                         \
   "{"                                        \
   "\"tag\": " TOSTRING(VERSION_TAG) ","      \
   "\"date\": " TOSTRING(__DATE__) ","        \
   "\"time\": " TOSTRING(__TIME__) ","        \
-  "\"api\": 1"                               \
+  "\"api\": " TOSTRING(API_VERSION)          \
   "}"
 
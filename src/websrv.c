@@ -18,6 +18,7 @@ along with this program; see the file COPYING. If not, see
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include <arpa/inet.h>
 #include <sys/socket.h>
@@ -26,45 +27,206 @@ along with this program; see the file COPYING. If not, see
 #include <microhttpd.h>
 
 #include "asset.h"
+#include "dircache.h"
 #include "fs.h"
+#include "homebrew.h"
 #include "mdns.h"
+#include "pipe.h"
+#include "search.h"
 #include "smb.h"
 #include "sys.h"
+#include "upload.h"
 #include "version.h"
 #include "websrv.h"
 
 
+/**
+ * Number of worker threads that drive connections from a shared event loop
+ * (epoll on Linux, poll/select elsewhere). Zero selects the legacy mode where
+ * each connection is served by a dedicated thread. Handlers that block on
+ * i/o (smb, uploads, archives and file readers) suspend their connection,
+ * and do the work on the helper threads in task.c.
+ **/
+#ifndef WEBSRV_THREAD_POOL_SIZE
+#define WEBSRV_THREAD_POOL_SIZE 4
+#endif
+
+
+/**
+ * Size of the first arena chunk of a form request without a Content-Length,
+ * and headroom for field names and bookkeeping when there is one.
+ **/
+#ifndef POST_ARENA_CHUNK_SIZE
+#define POST_ARENA_CHUNK_SIZE 0x4000
+#endif
+
+
+/**
+ * Upper bound on the part of the first arena chunk that is sized after the
+ * Content-Length of a form request. The header is client-controlled, so
+ * larger bodies grow the arena as the data actually arrives.
+ **/
+#ifndef POST_ARENA_HINT_MAX
+#define POST_ARENA_HINT_MAX (4 * POST_ARENA_CHUNK_SIZE)
+#endif
+
+
+/**
+ * Number of buckets in the field index of a form request.
+ **/
+#define POST_INDEX_SIZE 16
+
+
+/**
+ * Round a size up to the alignment of arena allocations.
+ **/
+#define POST_ARENA_ALIGN(n) (((n) + 15) & ~(size_t)15)
+
+
+/**
+ * A chunk of memory that allocations of a form request are carved from.
+ **/
+typedef struct post_chunk {
+  struct post_chunk *next;
+  size_t size;
+  size_t used;
+  _Alignas(16) uint8_t data[];
+} post_chunk_t;
+
+
 typedef struct post_data {
   char *key;
   uint8_t *val;
   size_t len;
+  size_t cap;
   struct post_data *next;
 } post_data_t;
 
 
 typedef struct post_request {
   struct MHD_PostProcessor* pp;
-  post_data_t* data;
+  post_chunk_t* arena;
+  size_t arena_hint;
+  post_data_t* index[POST_INDEX_SIZE];
+  upload_t* upload;
+  websrv_state_t* state;
 } post_request_t;
 
 
+/**
+ * Allocate memory that lives until the request is completed. Chunks grow
+ * geometrically, and the first one is sized to hold the entire request body
+ * if its length is known, up to POST_ARENA_HINT_MAX.
+ **/
+static void*
+post_arena_alloc(post_request_t* req, size_t size) {
+  post_chunk_t* c = req->arena;
+  size_t n;
+
+  size = POST_ARENA_ALIGN(size);
+  if(!c || c->size - c->used < size) {
+    n = c ? 2 * c->size : req->arena_hint + POST_ARENA_CHUNK_SIZE;
+    if(n < size) {
+      n = size;
+    }
+    if(!(c=malloc(sizeof(post_chunk_t) + n))) {
+      return 0;
+    }
+    c->next = req->arena;
+    c->size = n;
+    c->used = 0;
+    req->arena = c;
+  }
+
+  c->used += size;
+
+  return c->data + c->used - size;
+}
+
+
+/**
+ * Grow the value of a field to hold at least the given number of bytes,
+ * extending it in place if it is the most recent allocation of the arena.
+ **/
+static int
+post_data_reserve(post_request_t* req, post_data_t* data, size_t cap) {
+  post_chunk_t* c = req->arena;
+  uint8_t* val;
+
+  cap = POST_ARENA_ALIGN(cap);
+  if(data->val && data->val + data->cap == c->data + c->used &&
+     c->size - c->used >= cap - data->cap) {
+    c->used += cap - data->cap;
+    data->cap = cap;
+    return 0;
+  }
+
+  if(cap < 2 * data->cap) {
+    cap = 2 * data->cap;
+  }
+
+  // without a Content-Length, large values end up alone in a chunk, which
+  // can then be resized without leaving a stale copy behind
+  if(data->val == c->data && c->used == data->cap) {
+    if(!(c=realloc(c, sizeof(post_chunk_t) + cap))) {
+      return -1;
+    }
+    c->size = cap;
+    c->used = cap;
+    req->arena = c;
+    data->val = c->data;
+    data->cap = cap;
+    return 0;
+  }
+  if(!(val=post_arena_alloc(req, cap))) {
+    return -1;
+  }
+  if(data->len) {
+    memcpy(val, data->val, data->len);
+  }
+  data->val = val;
+  data->cap = cap;
+
+  return 0;
+}
+
+
+/**
+ * Compute the index bucket of a field name (FNV-1a).
+ **/
+static unsigned int
+post_data_hash(const char* key) {
+  uint32_t h = 2166136261u;
+
+  while(*key) {
+    h = (h ^ (uint8_t)*key++) * 16777619u;
+  }
+
+  return h % POST_INDEX_SIZE;
+}
+
+
 static post_data_t*
-post_data_get(post_data_t* data, const char* key) {
-  if(!data) {
+post_data_get(post_request_t* req, const char* key) {
+  post_data_t* data;
+
+  if(!req) {
     return 0;
   }
 
-  if(!strcmp(key, data->key)) {
-    return data;
+  for(data=req->index[post_data_hash(key)]; data; data=data->next) {
+    if(!strcmp(key, data->key)) {
+      return data;
+    }
   }
 
-  return post_data_get(data->next, key);
+  return 0;
 }
 
 
 static const char*
-post_data_val(post_data_t* data, const char* key) {
-  data = post_data_get(data, key);
+post_data_val(post_request_t* req, const char* key) {
+  post_data_t* data = post_data_get(req, key);
   return data ? (const char*)data->val : 0;
 }
 
@@ -74,17 +236,29 @@ post_iterator(void *cls, enum MHD_ValueKind kind, const char *key,
                const char *filename, const char *mime, const char *encoding,
                const char *value, uint64_t off, size_t size) {
   post_request_t *req = cls;
-  post_data_t *data = post_data_get(req->data, key);
+  post_data_t *data = post_data_get(req, key);
+  unsigned int h;
+  size_t len;
 
-  if(data) {
-    data->val = realloc(data->val, off+size+1);
-  } else {
-    data = malloc(sizeof(post_data_t));
-    data->next = req->data;
-    data->key = strdup(key);
-    data->val = malloc(off+size+1);
+  if(!data) {
+    len = strlen(key) + 1;
+    if(!(data=post_arena_alloc(req, sizeof(post_data_t))) ||
+       !(data->key=post_arena_alloc(req, len))) {
+      return MHD_NO;
+    }
+    memcpy(data->key, key, len);
+    data->val = 0;
     data->len = 0;
-    req->data = data;
+    data->cap = 0;
+
+    h = post_data_hash(key);
+    data->next = req->index[h];
+    req->index[h] = data;
+  }
+
+  if(off + size + 1 > data->cap &&
+     post_data_reserve(req, data, off + size + 1)) {
+    return MHD_NO;
   }
 
   memcpy(data->val+off, value, size);
@@ -105,6 +279,156 @@ websrv_queue_response(struct MHD_Connection *conn, unsigned int status,
 }
 
 
+int
+websrv_accept_encoding(struct MHD_Connection *conn, const char* coding) {
+  const char* s = MHD_lookup_connection_value(conn, MHD_HEADER_KIND,
+					      MHD_HTTP_HEADER_ACCEPT_ENCODING);
+  size_t len = strlen(coding);
+  int wildcard = 0;
+  const char* p;
+  size_t n;
+  int q;
+
+  while(s && *s) {
+    s += strspn(s, " \t,");
+    n = strcspn(s, " \t,;");
+    p = s + n;
+
+    // default quality is 1, overridden by an optional ";q=" parameter
+    q = 1000;
+    p += strspn(p, " \t");
+    if(*p == ';') {
+      p += strspn(p+1, " \t") + 1;
+      if(!strncasecmp(p, "q=", 2)) {
+        q = (int)(strtod(p+2, 0) * 1000);
+      }
+    }
+
+    if(n == len && !strncasecmp(s, coding, n)) {
+      return q;
+    }
+    if(n == 1 && *s == '*') {
+      wildcard = q;
+    }
+
+    s += strcspn(s, ",");
+  }
+
+  return wildcard;
+}
+
+void
+websrv_http_date(time_t t, char* buf, size_t size) {
+  struct tm tm;
+
+  gmtime_r(&t, &tm);
+  strftime(buf, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+
+/**
+ * Parse an HTTP-date in the preferred IMF-fixdate format.
+ **/
+static time_t
+websrv_parse_http_date(const char* s) {
+  static const char* months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  struct tm tm = {0};
+  char mon[4] = {0};
+  const char* p;
+
+  if(sscanf(s, "%*3s, %d %3s %d %d:%d:%d GMT", &tm.tm_mday, mon, &tm.tm_year,
+	    &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6) {
+    return -1;
+  }
+  if(strlen(mon) != 3 || !(p=strstr(months, mon)) || (p - months) % 3) {
+    return -1;
+  }
+
+  tm.tm_mon = (p - months) / 3;
+  tm.tm_year -= 1900;
+
+  return timegm(&tm);
+}
+
+
+/**
+ * Compare two entity tags, ignoring weakness indicators if weak is set.
+ **/
+static int
+websrv_etag_equal(const char* a, size_t alen, const char* b, int weak) {
+  size_t blen = strlen(b);
+
+  if(!strncmp(a, "W/", 2)) {
+    if(!weak) {
+      return 0;
+    }
+    a += 2;
+    alen -= 2;
+  }
+  if(!strncmp(b, "W/", 2)) {
+    if(!weak) {
+      return 0;
+    }
+    b += 2;
+    blen -= 2;
+  }
+
+  return alen == blen && !strncmp(a, b, alen);
+}
+
+
+int
+websrv_not_modified(struct MHD_Connection *conn, const char* etag,
+		    time_t mtime) {
+  const char* s;
+  time_t t;
+  size_t n;
+
+  // If-None-Match takes precedence over If-Modified-Since
+  if((s=MHD_lookup_connection_value(conn, MHD_HEADER_KIND,
+				    MHD_HTTP_HEADER_IF_NONE_MATCH))) {
+    while(etag && *s) {
+      s += strspn(s, " \t,");
+      n = strcspn(s, " \t,");
+      if(n == 1 && *s == '*') {
+	return 1;
+      }
+      if(n && websrv_etag_equal(s, n, etag, 1)) {
+	return 1;
+      }
+      s += n;
+    }
+    return 0;
+  }
+
+  if(mtime >= 0 &&
+     (s=MHD_lookup_connection_value(conn, MHD_HEADER_KIND,
+				    MHD_HTTP_HEADER_IF_MODIFIED_SINCE)) &&
+     (t=websrv_parse_http_date(s)) >= 0) {
+    return mtime <= t;
+  }
+
+  return 0;
+}
+
+
+int
+websrv_if_range(struct MHD_Connection *conn, const char* etag, time_t mtime) {
+  const char* s;
+
+  if(!(s=MHD_lookup_connection_value(conn, MHD_HEADER_KIND,
+				     MHD_HTTP_HEADER_IF_RANGE))) {
+    return 1;
+  }
+
+  // If-Range requires a strong comparison, so weak tags never match
+  if(*s == '"' || !strncmp(s, "W/", 2)) {
+    return etag && websrv_etag_equal(s, strlen(s), etag, 0);
+  }
+
+  return mtime >= 0 && websrv_parse_http_date(s) == mtime;
+}
+
 
 /**
  * Respond to a version request.
@@ -200,7 +524,7 @@ hbldr_request(struct MHD_Connection *conn) {
       MHD_destroy_response(resp);
     }
   } else if(pipe && strcmp(pipe, "0")) {
-    if((resp=MHD_create_response_from_pipe(fd))) {
+    if((resp=pipe_create_response(conn, fd))) {
       MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE, "text/x-log; charset=utf-8");
       MHD_add_response_header(resp, MHD_HTTP_HEADER_CACHE_CONTROL, "no-cache");
       ret = websrv_queue_response(conn, MHD_HTTP_OK, resp);
@@ -223,9 +547,10 @@ hbldr_request(struct MHD_Connection *conn) {
  * Respond to a ELF payload loading request.
  **/
 static enum MHD_Result
-elfldr_request(struct MHD_Connection *conn, post_data_t *data) {
+elfldr_request(struct MHD_Connection *conn, post_request_t *req) {
   enum MHD_Result ret = MHD_NO;
   struct MHD_Response *resp;
+  post_data_t *data;
   const char *args;
   const char *pipe;
   const char *env;
@@ -234,21 +559,21 @@ elfldr_request(struct MHD_Connection *conn, post_data_t *data) {
   int fd = -1;
 
   if(!(args=MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "args"))) {
-    args = post_data_val(data, "args");
+    args = post_data_val(req, "args");
   }
   if(!(env=MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "env"))) {
-    env = post_data_val(data, "env");
+    env = post_data_val(req, "env");
   }
   if(!(pipe=MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "pipe"))) {
-    pipe = post_data_val(data, "pipe");
+    pipe = post_data_val(req, "pipe");
   }
   if(!(cwd=MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "cwd"))) {
-    cwd = post_data_val(data, "cwd");
+    cwd = post_data_val(req, "cwd");
   }
 
   if((uri=MHD_lookup_connection_value(conn, MHD_GET_ARGUMENT_KIND, "elf"))) {
     fd = sys_launch_daemon(cwd, uri, args, env);
-  } else if((data=post_data_get(data, "elf"))) {
+  } else if((data=post_data_get(req, "elf"))) {
     fd = sys_launch_payload(cwd, data->val, data->len, args, env);
   } else {
     return asset_request(conn, "/elfldr.html");
@@ -263,7 +588,7 @@ elfldr_request(struct MHD_Connection *conn, post_data_t *data) {
   }
 
   if(pipe && strcmp(pipe, "0")) {
-    if((resp=MHD_create_response_from_pipe(fd))) {
+    if((resp=pipe_create_response(conn, fd))) {
       MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE, "text/x-log; charset=utf-8");
       MHD_add_response_header(resp, MHD_HTTP_HEADER_CACHE_CONTROL, "no-cache");
       ret = websrv_queue_response(conn, MHD_HTTP_OK, resp);
@@ -291,33 +616,81 @@ websrv_on_request(void *cls, struct MHD_Connection *conn,
                   size_t *upload_data_size, void **con_cls) {
   post_request_t *req = *con_cls;
   enum MHD_Result ret = MHD_NO;
+  const char* s;
 
   if(strcmp(method, MHD_HTTP_METHOD_GET) &&
      strcmp(method, MHD_HTTP_METHOD_POST) &&
+     strcmp(method, MHD_HTTP_METHOD_PUT) &&
      strcmp(method, MHD_HTTP_METHOD_HEAD)) {
     return MHD_NO;
   }
 
   if(!req) {
-    req = *con_cls = malloc(sizeof(post_request_t));
-    req->pp = MHD_create_post_processor(conn, 0x1000, &post_iterator, req);
-    req->data = 0;
+    if(!(req=*con_cls=calloc(1, sizeof(post_request_t)))) {
+      return MHD_NO;
+    }
+
+    // uploads are streamed to disk rather than collected in memory
+    if(!strncmp("/fs/", url, 4) && (!strcmp(method, MHD_HTTP_METHOD_PUT) ||
+				    !strcmp(method, MHD_HTTP_METHOD_POST))) {
+      if(!(req->upload=upload_create(conn, url+3, method))) {
+	return MHD_NO;
+      }
+    } else if((req->pp=MHD_create_post_processor(conn, 0x1000,
+						 &post_iterator, req))) {
+      // small forms fit in a single arena chunk, larger ones (e.g., ELF
+      // payloads) grow the arena as the data arrives
+      if((s=MHD_lookup_connection_value(conn, MHD_HEADER_KIND,
+					MHD_HTTP_HEADER_CONTENT_LENGTH))) {
+	req->arena_hint = strtoull(s, 0, 10);
+	if(req->arena_hint > POST_ARENA_HINT_MAX) {
+	  req->arena_hint = POST_ARENA_HINT_MAX;
+	}
+      }
+    }
     return MHD_YES;
   }
 
+  if(req->upload) {
+    if(*upload_data_size) {
+      *upload_data_size -= upload_process(req->upload, upload_data,
+					  *upload_data_size);
+      return MHD_YES;
+    }
+    return upload_finish(req->upload, conn);
+  }
+
   if(!strcmp(method, MHD_HTTP_METHOD_GET)) {
+    if(!strncmp("/fs-search", url, 10) && (!url[10] || url[10] == '/')) {
+      return search_request(conn, url);
+    }
+    if(!strcmp("/fs-cache", url)) {
+      return dircache_request(conn, url);
+    }
+    if(!strcmp("/fs-uploads", url)) {
+      return upload_progress_request(conn, url);
+    }
     if(!strcmp("/fs", url)) {
-      return fs_request(conn, url);
+      return fs_request(conn, url, &req->state);
     }
     if(!strncmp("/fs/", url, 4)) {
-      return fs_request(conn, url);
+      return fs_request(conn, url, &req->state);
+    }
+    if(!strcmp("/homebrew/index", url)) {
+      return homebrew_index_request(conn, url, &req->state);
+    }
+    if(!strcmp("/homebrew/icons", url)) {
+      return homebrew_icons_request(conn, url, &req->state);
     }
     if(!strcmp("/mdns", url)) {
-      return mdns_request(conn, url);
+      return mdns_request(conn, url, &req->state);
+    }
+    if(!strcmp("/mdns/events", url)) {
+      return mdns_events_request(conn, url);
     }
 #ifdef __SCE__
     if(!strncmp("/smb", url, 4)) {
-      return smb_request(conn, url);
+      return smb_request(conn, url, &req->state);
     }
 #endif
     if(!strcmp("/launch", url)) {
@@ -345,7 +718,7 @@ websrv_on_request(void *cls, struct MHD_Connection *conn,
       return ret;
     }
     if(!strcmp("/elfldr", url)) {
-      return elfldr_request(conn, req->data);
+      return elfldr_request(conn, req);
     }
   }
 
@@ -358,20 +731,28 @@ static void
 websrv_on_completed(void *cls, struct MHD_Connection *connection,
                     void **con_cls, enum MHD_RequestTerminationCode toe) {
   post_request_t *req = *con_cls;
-  post_data_t *data;
+  post_chunk_t *c;
 
   if(!req) {
     return;
   }
 
-  while((data=req->data)) {
-    req->data = data->next;
-    free(data->key);
-    free(data->val);
-    free(data);
+  if(req->upload) {
+    upload_destroy(req->upload);
+  }
+  if(req->state) {
+    req->state->free_cb(req->state);
+  }
+  if(req->pp) {
+    MHD_destroy_post_processor(req->pp);
+  }
+
+  // all form fields are released together with the arena
+  while((c=req->arena)) {
+    req->arena = c->next;
+    free(c);
   }
 
-  MHD_destroy_post_processor(req->pp);
   free(req);
 }
 
@@ -381,6 +762,7 @@ websrv_listen(unsigned short port) {
   struct sockaddr_in server_addr;
   struct sockaddr_in client_addr;
   struct MHD_Daemon *httpd;
+  unsigned int flags;
   socklen_t addr_len;
   int connfd;
   int srvfd;
@@ -409,18 +791,25 @@ websrv_listen(unsigned short port) {
     return -1;
   }
 
-  if(listen(srvfd, 5) != 0) {
+  if(listen(srvfd, SOMAXCONN) != 0) {
     perror("listen");
     close(srvfd);
     return -1;
   }
 
-  if(!(httpd=MHD_start_daemon(MHD_USE_THREAD_PER_CONNECTION | MHD_USE_ITC |
-			      MHD_USE_NO_LISTEN_SOCKET | MHD_USE_DEBUG |
-			      MHD_USE_INTERNAL_POLLING_THREAD,
-			      0, NULL, NULL, &websrv_on_request, NULL,
+  flags = MHD_USE_ITC | MHD_USE_NO_LISTEN_SOCKET | MHD_USE_DEBUG |
+          MHD_USE_INTERNAL_POLLING_THREAD | MHD_ALLOW_SUSPEND_RESUME;
+  if(WEBSRV_THREAD_POOL_SIZE > 0) {
+    flags |= MHD_USE_AUTO;
+  } else {
+    flags |= MHD_USE_THREAD_PER_CONNECTION;
+  }
+
+  if(!(httpd=MHD_start_daemon(flags, 0, NULL, NULL, &websrv_on_request, NULL,
                               MHD_OPTION_NOTIFY_COMPLETED, &websrv_on_completed,
-                              NULL, MHD_OPTION_END))) {
+                              NULL, MHD_OPTION_THREAD_POOL_SIZE,
+                              (unsigned int)WEBSRV_THREAD_POOL_SIZE,
+                              MHD_OPTION_END))) {
     perror("MHD_start_daemon");
     close(srvfd);
     return -1;
@@ -16,10 +16,52 @@ along with this program; see the file COPYING. If not, see
 
 #pragma once
 
+#include <time.h>
+
 #include <microhttpd.h>
 
+/**
+ * State that a request handler keeps between invocations of the same
+ * request, e.g., while the connection is suspended. Handlers embed it first
+ * in their own state, and it is released with free_cb once the request is
+ * completed.
+ **/
+typedef struct websrv_state {
+  void (*free_cb)(struct websrv_state* state);
+} websrv_state_t;
+
+
 enum MHD_Result websrv_queue_response(struct MHD_Connection *conn,
 				      unsigned int status,
 				      struct MHD_Response *resp);
 
+/**
+ * Obtain the quality value (0-1000) that the client assigned to the given
+ * content coding in its Accept-Encoding header, where 0 means that the
+ * coding is not acceptable.
+ **/
+int websrv_accept_encoding(struct MHD_Connection *conn, const char* coding);
+
+/**
+ * Format a time as an HTTP-date, e.g., "Sun, 06 Nov 1994 08:49:37 GMT".
+ **/
+void websrv_http_date(time_t t, char* buf, size_t size);
+
+/**
+ * Evaluate the If-None-Match and If-Modified-Since request headers against
+ * the given validators (etag may be null, and mtime -1 if unknown). Returns
+ * non-zero if the client already holds the current representation, and the
+ * request should be answered with 304 Not Modified.
+ **/
+int websrv_not_modified(struct MHD_Connection *conn, const char* etag,
+			time_t mtime);
+
+/**
+ * Evaluate the If-Range request header against the given validators (etag
+ * may be null, and mtime -1 if unknown). Returns non-zero if the Range header
+ * should be honored.
+ **/
+int websrv_if_range(struct MHD_Connection *conn, const char* etag,
+		    time_t mtime);
+
 int websrv_listen(unsigned short port);